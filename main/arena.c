@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "arena.h"
+
+#define ARENA_ALIGNMENT sizeof(void*)
+#define ALIGN_UP(x) (((x) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+static const char TAG[] = "arena";
+
+void arena_init(arena_t* arena, void* buf, size_t size) {
+    arena->base = buf;
+    arena->size = size;
+    arena->used = 0;
+    arena->failures = 0;
+}
+
+void arena_reset(arena_t* arena) {
+    arena->used = 0;
+    arena->failures = 0;
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+    size_t start = ALIGN_UP(arena->used);
+    if (start > arena->size || size > arena->size - start) {
+        ESP_LOGE(TAG, "Out of memory: %u bytes requested, %u available", size, arena_available(arena));
+        arena->failures++;
+        return NULL;
+    }
+
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+void* arena_calloc(arena_t* arena, size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        arena->failures++;
+        return NULL;
+    }
+
+    void* ptr = arena_alloc(arena, count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+
+    return ptr;
+}
+
+char* arena_strdup(arena_t* arena, const char* str) {
+    size_t len = strlen(str) + 1;
+    char* copy = arena_alloc(arena, len);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+    }
+
+    return copy;
+}
+
+char* arena_sprintf(arena_t* arena, const char* format, ...) {
+    // Format straight into the free tail of the arena and claim only what was written
+    size_t start = ALIGN_UP(arena->used);
+    if (start >= arena->size) {
+        ESP_LOGE(TAG, "Out of memory formatting string");
+        arena->failures++;
+        return NULL;
+    }
+
+    char* str = (char*)arena->base + start;
+    size_t available = arena->size - start;
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(str, available, format, args);
+    va_end(args);
+
+    if (len < 0 || len >= available) {
+        ESP_LOGE(TAG, "Out of memory formatting string: %i bytes requested, %u available", len + 1, available);
+        arena->failures++;
+        return NULL;
+    }
+
+    arena->used = start + len + 1;
+    return str;
+}
+
+char* arena_append(arena_t* arena, char* str, const char* format, ...) {
+    if (str == NULL) return NULL;
+
+    // Only the string allocated last can grow in place, any other is copied to the tail first
+    size_t len = strlen(str);
+    if (str + len + 1 != (char*)arena->base + arena->used) {
+        str = arena_strdup(arena, str);
+        if (str == NULL) return NULL;
+    }
+
+    size_t start = (uint8_t*)str + len - arena->base;
+    size_t available = arena->size - start;
+
+    va_list args;
+    va_start(args, format);
+    int appended = vsnprintf(&str[len], available, format, args);
+    va_end(args);
+
+    if (appended < 0 || appended >= available) {
+        str[len] = '\0';
+        ESP_LOGE(TAG, "Out of memory appending to string: %i bytes requested, %u available", appended + 1, available);
+        arena->failures++;
+        return NULL;
+    }
+
+    arena->used = start + appended + 1;
+    return str;
+}
+
+size_t arena_available(arena_t* arena) {
+    size_t start = ALIGN_UP(arena->used);
+    return start < arena->size ? arena->size - start : 0;
+}
@@ -0,0 +1,332 @@
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "esp_partition.h"
+#include "evtlog.h"
+
+#define LOG_PARTITION "evtlog"
+#define LOG_PARTITION_SUBTYPE 0x41
+#define MAX_SECTORS 64 // sectors of a larger partition are left unused
+#define SECTOR_MAGIC 0x4556 // "EV", changes with the record format
+
+// Events are kept in RAM and written together, once the buffer fills or the oldest of them has waited long enough
+#define PENDING_MAX_LEN 32
+#define FLUSH_DELAY_US (60 * 1000000LL)
+
+#define EVENT_USER_ID_MASK ((1LL << 52) - 1)
+#define EVENT_GATE_SHIFT 52
+#define EVENT_ACTION_SHIFT 56
+#define EVENT_RESULT_SHIFT 58
+#define EVENT_ENTRY(event) (((event)->user_id & EVENT_USER_ID_MASK) | ((int64_t)((event)->gate & 0xf) << EVENT_GATE_SHIFT) \
+    | ((int64_t)((event)->action & 0x3) << EVENT_ACTION_SHIFT) | ((int64_t)((event)->result & 0x7) << EVENT_RESULT_SHIFT))
+
+// First record of every sector. The time range of a sector is only complete once the next one is started, so it is
+// stored there, and the index of every sector but the one being written is built without reading the records
+typedef struct {
+    uint32_t seq; // of the sector, counting from 1 as the log goes round the partition
+    uint32_t prev_min_time;
+    uint32_t prev_max_time;
+    uint16_t magic;
+    uint16_t crc; // of the fields above
+} sector_header_t;
+
+typedef struct {
+    uint32_t seq; // 0 if the sector holds no events
+    uint32_t min_time; // of the records, UINT32_MAX if none, 0 if not known
+    uint32_t max_time; // 0 if none, UINT32_MAX if not known
+} sector_index_t;
+
+static const char TAG[] = "evtlog";
+
+static const esp_partition_t* log_partition;
+static sector_index_t sectors[MAX_SECTORS];
+static size_t sector_count;
+static size_t head; // the sector being written
+static size_t head_offset; // in the partition, where the next record is written
+
+static event_record_t pending[PENDING_MAX_LEN];
+static size_t pending_len;
+static int64_t pending_since; // esp_timer time of the oldest pending event
+
+static esp_err_t start_sector(size_t sector, uint32_t seq);
+static void index_record(sector_index_t* index, const event_record_t* record);
+static bool record_erased(const event_record_t* record);
+static uint16_t record_crc(const event_record_t* record);
+static uint16_t header_crc(const sector_header_t* header);
+
+// Builds the time index from the sector headers and finds where the log ends
+esp_err_t load_evtlog() {
+    log_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, LOG_PARTITION_SUBTYPE, LOG_PARTITION);
+    if (log_partition == NULL) {
+        ESP_LOGW(TAG, "No event log partition, gate events are not logged");
+        return ESP_OK;
+    }
+
+    size_t sector_size = log_partition->erase_size;
+    sector_count = log_partition->size / sector_size;
+    if (sector_count > MAX_SECTORS) {
+        sector_count = MAX_SECTORS;
+    }
+
+    esp_err_t err;
+    for (size_t sector = 0; sector < sector_count; sector++) {
+        sectors[sector].min_time = 0;
+        sectors[sector].max_time = UINT32_MAX;
+    }
+
+    bool found = false;
+    for (size_t sector = 0; sector < sector_count; sector++) {
+        sector_header_t header;
+        err = esp_partition_read(log_partition, sector * sector_size, &header, sizeof(header));
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        // Erased sectors, sectors left from an older partition layout and a header torn by a power loss read as empty
+        sectors[sector].seq = 0;
+        if (header.magic != SECTOR_MAGIC || header.crc != header_crc(&header) || header.seq == 0) continue;
+
+        sectors[sector].seq = header.seq;
+        sector_index_t* prev = &sectors[(sector + sector_count - 1) % sector_count];
+        prev->min_time = header.prev_min_time;
+        prev->max_time = header.prev_max_time;
+
+        if (!found || header.seq > sectors[head].seq) {
+            head = sector;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        ESP_LOGW(TAG, "Formatting event log");
+        return start_sector(0, 1);
+    }
+
+    // The range stored by the next sector describes this one only if it was started right after
+    for (size_t sector = 0; sector < sector_count; sector++) {
+        sector_index_t* next = &sectors[(sector + 1) % sector_count];
+        if (sectors[sector].seq != 0 && next->seq != sectors[sector].seq + 1) {
+            sectors[sector].min_time = 0;
+            sectors[sector].max_time = UINT32_MAX;
+        }
+    }
+
+    event_record_t records[EVTLOG_READ_CHUNK_LEN];
+    size_t records_len = 0;
+    size_t end = (head + 1) * sector_size;
+    sector_index_t* index = &sectors[head];
+    index->min_time = UINT32_MAX;
+    index->max_time = 0;
+
+    for (size_t offset = head * sector_size + sizeof(sector_header_t); offset < end; ) {
+        size_t len = end - offset < sizeof(records) ? end - offset : sizeof(records);
+        err = esp_partition_read(log_partition, offset, records, len);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        for (size_t i = 0; i < len / sizeof(event_record_t); i++, offset += sizeof(event_record_t)) {
+            if (record_erased(&records[i])) {
+                end = offset;
+                break;
+            }
+
+            // A record torn by a power loss is left where it is and skipped by the readers
+            if (records[i].crc == record_crc(&records[i])) {
+                index_record(index, &records[i]);
+                records_len++;
+            }
+        }
+        head_offset = offset;
+    }
+
+    ESP_LOGI(TAG, "Event log of %u sectors, sector %u of seq %" PRIu32 " has %u records", sector_count, head, index->seq, records_len);
+    return ESP_OK;
+}
+
+void evtlog_add(const event_t* event) {
+    if (log_partition == NULL) return;
+
+    if (pending_len == PENDING_MAX_LEN) {
+        evtlog_flush(true);
+    }
+    if (pending_len == 0) {
+        pending_since = esp_timer_get_time();
+    }
+
+    event_record_t* record = &pending[pending_len++];
+    record->entry = EVENT_ENTRY(event);
+    record->time = event->time;
+    record->latency = event->latency < UINT16_MAX ? event->latency : UINT16_MAX;
+    record->crc = record_crc(record);
+}
+
+// Writes the pending events unless they can wait for more. The oldest sector is erased when the newest is full
+esp_err_t evtlog_flush(bool force) {
+    if (pending_len == 0) return ESP_OK;
+    if (!force && pending_len < PENDING_MAX_LEN && esp_timer_get_time() - pending_since < FLUSH_DELAY_US) return ESP_OK;
+
+    esp_err_t err = ESP_OK;
+    size_t sector_size = log_partition->erase_size;
+    size_t written = 0;
+
+    while (written < pending_len) {
+        size_t len = ((head + 1) * sector_size - head_offset) / sizeof(event_record_t);
+        if (len == 0) {
+            err = start_sector((head + 1) % sector_count, sectors[head].seq + 1);
+            if (err != ESP_OK) break;
+            continue;
+        }
+        if (len > pending_len - written) {
+            len = pending_len - written;
+        }
+
+        err = esp_partition_write(log_partition, head_offset, &pending[written], len * sizeof(event_record_t));
+        if (err != ESP_OK) {
+            // The chunk is dropped with the rest and its place is written again. A record left there in part, and
+            // the one written over it, fail their CRC and are skipped by the readers
+            ESP_LOGE(TAG, "Error appending to event log: %i (%#x)", err, err);
+            break;
+        }
+
+        for (size_t i = 0; i < len; i++) {
+            index_record(&sectors[head], &pending[written + i]);
+        }
+        head_offset += len * sizeof(event_record_t);
+        written += len;
+    }
+
+    if (written < pending_len) {
+        ESP_LOGE(TAG, "%u events dropped", pending_len - written);
+    }
+    pending_len = 0;
+    return err;
+}
+
+void evtlog_seek(evtlog_cursor_t* cursor, time_t from, time_t to, int64_t user_id) {
+    cursor->from = from;
+    cursor->to = to;
+    cursor->user_id = user_id;
+    cursor->first_sector = sector_count > 0 ? (head + 1) % sector_count : 0;
+    cursor->visited = 0;
+    cursor->offset = 0;
+    cursor->end = 0;
+    cursor->chunk_len = 0;
+    cursor->chunk_pos = 0;
+}
+
+// Returns the next event matching the cursor. Pending events are only seen once flushed
+bool evtlog_next(evtlog_cursor_t* cursor, event_t* event) {
+    if (log_partition == NULL) return false;
+
+    size_t sector_size = log_partition->erase_size;
+    while (42) {
+        if (cursor->chunk_pos == cursor->chunk_len) {
+            // Moves on to the next sector overlapping the range
+            while (cursor->offset == cursor->end) {
+                if (cursor->visited == sector_count) return false;
+
+                size_t sector = (cursor->first_sector + cursor->visited++) % sector_count;
+                sector_index_t* index = &sectors[sector];
+                if (index->seq == 0 || index->max_time < cursor->from || index->min_time >= cursor->to) continue;
+
+                cursor->offset = sector * sector_size + sizeof(sector_header_t);
+                cursor->end = (sector + 1) * sector_size;
+            }
+
+            size_t len = cursor->end - cursor->offset < sizeof(cursor->chunk) ? cursor->end - cursor->offset : sizeof(cursor->chunk);
+            esp_err_t err = esp_partition_read(log_partition, cursor->offset, cursor->chunk, len);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Error reading event log: %i (%#x)", err, err);
+                return false;
+            }
+
+            cursor->offset += len;
+            cursor->chunk_len = len / sizeof(event_record_t);
+            cursor->chunk_pos = 0;
+        }
+
+        event_record_t* record = &cursor->chunk[cursor->chunk_pos++];
+        if (record_erased(record)) {
+            // The rest of the sector hasn't been written yet
+            cursor->offset = cursor->end;
+            cursor->chunk_pos = cursor->chunk_len;
+            continue;
+        }
+
+        if (record->crc != record_crc(record) || record->time < cursor->from || record->time >= cursor->to) continue;
+
+        int64_t user_id = record->entry & EVENT_USER_ID_MASK;
+        if (cursor->user_id != 0 && user_id != cursor->user_id) continue;
+
+        event->time = record->time;
+        event->user_id = user_id;
+        event->gate = (record->entry >> EVENT_GATE_SHIFT) & 0xf;
+        event->action = (record->entry >> EVENT_ACTION_SHIFT) & 0x3;
+        event->result = (record->entry >> EVENT_RESULT_SHIFT) & 0x7;
+        event->latency = record->latency;
+        return true;
+    }
+}
+
+// Erases the sector and makes it the one written. The sector is marked empty first, so that readers skip it
+// if the erase fails half way
+static esp_err_t start_sector(size_t sector, uint32_t seq) {
+    size_t sector_size = log_partition->erase_size;
+    sector_index_t* prev = &sectors[(sector + sector_count - 1) % sector_count];
+    sectors[sector].seq = 0;
+
+    esp_err_t err = esp_partition_erase_range(log_partition, sector * sector_size, sector_size);
+    if (err != ESP_OK) {
+        goto exit;
+    }
+
+    sector_header_t header = {
+        .seq = seq,
+        .prev_min_time = prev->min_time,
+        .prev_max_time = prev->max_time,
+        .magic = SECTOR_MAGIC,
+    };
+    header.crc = header_crc(&header);
+    err = esp_partition_write(log_partition, sector * sector_size, &header, sizeof(header));
+    if (err != ESP_OK) {
+        goto exit;
+    }
+
+    sectors[sector].seq = seq;
+    sectors[sector].min_time = UINT32_MAX;
+    sectors[sector].max_time = 0;
+    head = sector;
+    head_offset = sector * sector_size + sizeof(header);
+
+exit:
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error starting event log sector %u: %i (%#x)", sector, err, err);
+    }
+    return err;
+}
+
+static void index_record(sector_index_t* index, const event_record_t* record) {
+    if (record->time < index->min_time) {
+        index->min_time = record->time;
+    }
+    if (record->time > index->max_time) {
+        index->max_time = record->time;
+    }
+}
+
+static bool record_erased(const event_record_t* record) {
+    return record->entry == -1 && record->time == UINT32_MAX && record->latency == UINT16_MAX && record->crc == UINT16_MAX;
+}
+
+static uint16_t record_crc(const event_record_t* record) {
+    return esp_rom_crc16_le(0, (const uint8_t*)record, offsetof(event_record_t, crc));
+}
+
+static uint16_t header_crc(const sector_header_t* header) {
+    return esp_rom_crc16_le(0, (const uint8_t*)header, offsetof(sector_header_t, crc));
+}
@@ -1,8 +1,14 @@
+#include <ctype.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
 #include "freertos/FreeRTOS.h"
 
 #include "nvs.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
+#include "soc/gpio_reg.h"
 
 #include "gate_control.h"
 #include "handler.h"
@@ -10,75 +16,204 @@
 
 #define STORAGE_NAMESPACE "gate"
 
-#define CFG_NAME_POLL "poll"
 #define CFG_NAME_OPEN_PULSE_DURATION "openpulsedur"
 #define CFG_NAME_OPEN_DURATION "opendur"
 #define CFG_NAME_LOCK_DURATION "lockdur"
 #define CFG_NAME_OPEN_LEVEL "openlevel"
+#define CFG_NAME_STALE_WINDOW "stalewindow"
+#define CFG_NAME_STALE_POLICY "stalepolicy"
+#define CFG_NAME_USER_RATE_BURST "userburst"
+#define CFG_NAME_USER_RATE_PERIOD "userperiod"
+#define CFG_NAME_GATE_RATE_BURST "gateburst"
+#define CFG_NAME_GATE_RATE_PERIOD "gateperiod"
+#define CFG_NAME_GATES "gates"
 
-#define ACTIVE_OUTPUT_IDX_DISABLE_ALL 0
-#define ACTIVE_OUTPUT_IDX_MAX (2 * TOTAL_GATES)
+// Pins a gate can't drive: GPIO 0 and 12 are boot straps, 1 and 3 the console UART and 6 to 11 the SPI flash
+#define GATE_RESERVED_PINS ((1 << 0) | (1 << 1) | (1 << 3) | (0x3f << 6) | (1 << 12) | (1 << GPIO_LED_NUM))
 
-static const char TAG[] = "gate_control";
+#define TICKS_TO_US(ticks) ((int64_t)(ticks) * portTICK_PERIOD_MS * 1000)
 
-QueueHandle_t gk_open_queue;
-QueueHandle_t gk_status_queue;
+static const char TAG[] = "gate_control";
 
 static gate_control_config_t config;
+static uint32_t dirty_config; // bit per entry of config_name_value_default
+static uint32_t change_count;
+
+// The gate table in use is the one loaded at boot, changes are stored and take effect after a restart
+static gate_config_t gates[MAX_GATES];
+static size_t gates_count;
+static gate_config_t saved_gates[MAX_GATES];
+static size_t saved_gates_count;
+static bool gates_dirty;
 
 static esp_err_t store(char* name, uint32_t value);
 
 typedef struct {
-    uint32_t pin;
-    TickType_t close_gate_at;
+    int64_t close_gate_at; // us
+    bool open;
+    int64_t opened_by;
+    int64_t pressed_at; // us
+    uint32_t pending_id; // the open waiting for its first press, 0 if none
+    uint32_t done_id; // the latest open carried out by a press
+    uint32_t failed_id; // the latest open that ended before the button could be pressed
 } gate_control_t;
 
+// Everything the output levels depend on, so that the levels at a future edge can be worked out in advance
+typedef struct {
+    gate_control_t gates[MAX_GATES];
+    int64_t change_level_at; // us
+    size_t slot; // of the pulse train, gate i is pressed in slot 2 * i + 1 and all are released in the others
+} pulse_state_t;
+
 typedef struct {
     char* name;
     uint32_t* value;
     uint32_t default_value;
 } config_name_value_t;
 
-gate_control_t gates[] = {
-    {
-        // lower gate
-        .pin = GPIO_NUM_15,
-        .close_gate_at = 0,
-    },
-    {
-        // upper gate
-        .pin = GPIO_NUM_4,
-        .close_gate_at = 0,
-    },
-};
+static pulse_state_t state;
+
+// The edge programmed into the pulse timer: its time, 0 if none, and the state and output levels from then on
+static portMUX_TYPE edge_lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t edge_at;
+static bool edge_done;
+static pulse_state_t edge_state;
+static uint32_t edge_levels;
+static uint32_t written_levels;
+static bool written; // written_levels holds the levels of the pins
+static uint32_t output_mask; // the gate pins and the LED
+
+// Seqlock of the published gate states, odd while the gate task writes them
+static atomic_uint status_seq;
+static gate_state_t status[MAX_GATES];
+static TaskHandle_t notify_task; // the latest to submit a command
+
+// Commands submitted for a gate that the gate task hasn't taken yet, merged: an unlock cancels what was submitted
+// before it, the opens after it keep the latest close time
+typedef struct {
+    uint32_t command_id; // the latest, 0 if none
+    uint32_t unlock_id; // the latest unlock, 0 if none
+    int64_t close_at; // us, 0 if no open
+    int64_t user_id; // of the open
+} submitted_t;
+
+// A submitted command, at its ID modulo GATE_COMMAND_HISTORY_LEN. An open is resolved once the gate task publishes
+// the press that carried it out or the close that ended it, an unlock once the task has taken it
+typedef struct {
+    uint32_t id; // 0 if none
+    gate_t gate;
+    bool unlock;
+    gate_command_outcome_t outcome;
+    int64_t pressed_at; // us, of a done open
+} command_record_t;
+
+static portMUX_TYPE submit_lock = portMUX_INITIALIZER_UNLOCKED;
+static submitted_t submitted[MAX_GATES];
+static command_record_t command_records[GATE_COMMAND_HISTORY_LEN];
+static uint32_t last_command_id;
+static TaskHandle_t gate_task;
+static uint32_t active_high_mask; // the outputs pressed at high level
+static uint32_t edge_count;
+static int64_t edge_lateness_sum; // us
+static int64_t edge_max_lateness; // us
+
+static uint32_t evaluate(pulse_state_t* pulse, int64_t now, int64_t* next_change_at);
+static void set_levels(uint32_t levels);
+static void pulse_timer_callback(void* arg);
+static void publish_status();
+static bool resolve_commands();
+static void take_command(gate_t gate, const submitted_t* command, int64_t now);
 
 config_name_value_t config_name_value_default[] = {
-    {.name = CFG_NAME_POLL, .value = &config.gate_poll, .default_value = pdMS_TO_TICKS(20)},
     {.name = CFG_NAME_OPEN_PULSE_DURATION, .value = &config.gate_open_pulse_duration,.default_value = pdMS_TO_TICKS(500)},
-    {.name = CFG_NAME_OPEN_DURATION, .value = &config.gate_open_duration,.default_value = pdMS_TO_TICKS(2000)},
-    {.name = CFG_NAME_LOCK_DURATION, .value = &config.gate_lock_duration, .default_value = pdMS_TO_TICKS(3600 * 1000)},
-    {.name = CFG_NAME_OPEN_LEVEL, .value = &config.open_gate_level, .default_value = 1},
+    {.name = CFG_NAME_STALE_WINDOW, .value = &config.stale_window, .default_value = 120},
+    {.name = CFG_NAME_STALE_POLICY, .value = &config.stale_policy, .default_value = 1},
+    {.name = CFG_NAME_USER_RATE_BURST, .value = &config.user_rate_burst, .default_value = 5},
+    {.name = CFG_NAME_USER_RATE_PERIOD, .value = &config.user_rate_period, .default_value = 30},
+    {.name = CFG_NAME_GATE_RATE_BURST, .value = &config.gate_rate_burst, .default_value = 10},
+    {.name = CFG_NAME_GATE_RATE_PERIOD, .value = &config.gate_rate_period, .default_value = 6},
 };
 
+// The gates of the single remote the table replaces, with its durations and level if they were configured
+static esp_err_t load_default_gates(nvs_handle_t nvs_handle) {
+    uint32_t open_duration = pdMS_TO_TICKS(2000);
+    uint32_t lock_duration = pdMS_TO_TICKS(3600 * 1000);
+    uint32_t open_level = 1;
+
+    if (nvs_handle != 0) {
+        uint32_t* values[] = { &open_duration, &lock_duration, &open_level };
+        const char* names[] = { CFG_NAME_OPEN_DURATION, CFG_NAME_LOCK_DURATION, CFG_NAME_OPEN_LEVEL };
+        for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+            esp_err_t err = nvs_get_u32(nvs_handle, names[i], values[i]);
+            if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) return err;
+        }
+    }
+
+    gates[0] = (gate_config_t){ .name = "Upper gate", .pin = GPIO_NUM_4, .open_level = open_level, .open_duration = open_duration };
+    gates[1] = (gate_config_t){ .name = "Lower gate", .pin = GPIO_NUM_15, .open_level = open_level, .open_duration = open_duration, .lock_duration = lock_duration };
+    gates_count = 2;
+
+    return ESP_OK;
+}
+
+static esp_err_t load_gates(nvs_handle_t nvs_handle) {
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+    size_t size = sizeof(gates);
+
+    if (nvs_handle != 0) {
+        err = nvs_get_blob(nvs_handle, CFG_NAME_GATES, gates, &size);
+    }
+    if (err == ESP_OK && (size == 0 || size % sizeof(gate_config_t) != 0)) {
+        ESP_LOGE(TAG, "Gate table of %u bytes ignored", size);
+        err = ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    // A table saved before the reserved pins were rejected would keep the device from booting
+    for (size_t i = 0; err == ESP_OK && i < size / sizeof(gate_config_t); i++) {
+        if (gates[i].pin >= 32 || (GATE_RESERVED_PINS >> gates[i].pin) & 1) {
+            ESP_LOGE(TAG, "Gate table with GPIO %u ignored", gates[i].pin);
+            err = ESP_ERR_NVS_NOT_FOUND;
+        }
+    }
+
+    if (err == ESP_OK) {
+        gates_count = size / sizeof(gate_config_t);
+    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+        err = load_default_gates(nvs_handle);
+    }
+
+    memcpy(saved_gates, gates, sizeof(gates));
+    saved_gates_count = gates_count;
+
+    return err;
+}
+
 esp_err_t load_gate_config() {
     nvs_handle_t nvs_handle = 0;
     esp_err_t err;
 
+    // The defaults stand for the values never stored, the namespace itself is missing until the first save
+    for (size_t i = 0; i < sizeof(config_name_value_default) / sizeof(config_name_value_default[0]); i++) {
+        *(config_name_value_default[i].value) = config_name_value_default[i].default_value;
+    }
+
     err = nvs_open(STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        err = load_gates(0);
+        goto exit;
+    }
     if (err != ESP_OK) {
         goto exit;
     }
 
     for (size_t i = 0; i < sizeof(config_name_value_default) / sizeof(config_name_value_default[0]); i++) {
         err = nvs_get_u32(nvs_handle, config_name_value_default[i].name, config_name_value_default[i].value);
-        if (err == ESP_ERR_NVS_NOT_FOUND) {
-            *(config_name_value_default[i].value) = config_name_value_default[i].default_value;
-        } else if (err != ESP_OK) {
+        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
             goto exit;
         }
     }
 
-    err = ESP_OK;
+    err = load_gates(nvs_handle);
 exit:
     if (err == ESP_ERR_NVS_NOT_FOUND) {
         err = ESP_OK;
@@ -90,35 +225,32 @@ exit:
     return err;
 }
 
-uint32_t cfg_get_gate_poll() {
-    return config.gate_poll;
-}
-
 uint32_t cfg_get_gate_open_pulse_duration() {
     return config.gate_open_pulse_duration;
 }
 
-uint32_t cfg_get_gate_open_duration() {
-    return config.gate_open_duration;
+uint32_t cfg_get_stale_window() {
+    return config.stale_window;
 }
 
-uint32_t cfg_get_gate_lock_duration() {
-    return config.gate_lock_duration;
+uint32_t cfg_get_stale_policy() {
+    return config.stale_policy;
 }
 
-uint32_t cfg_get_open_gate_level() {
-    return config.open_gate_level;
+uint32_t cfg_get_user_rate_burst() {
+    return config.user_rate_burst;
 }
 
-esp_err_t cfg_set_gate_poll(uint32_t value) {
-    if (value == config.gate_poll) return ESP_OK;
+uint32_t cfg_get_user_rate_period() {
+    return config.user_rate_period;
+}
 
-    esp_err_t err = store(CFG_NAME_POLL, value);
-    if (err == ESP_OK) {
-        config.gate_poll = value;
-    }
+uint32_t cfg_get_gate_rate_burst() {
+    return config.gate_rate_burst;
+}
 
-    return err;
+uint32_t cfg_get_gate_rate_period() {
+    return config.gate_rate_period;
 }
 
 esp_err_t cfg_set_gate_open_pulse_duration(uint32_t value) {
@@ -132,98 +264,506 @@ esp_err_t cfg_set_gate_open_pulse_duration(uint32_t value) {
     return err;
 }
 
-esp_err_t cfg_set_gate_open_duration(uint32_t value) {
-    if (value == config.gate_open_duration) return ESP_OK;
+esp_err_t cfg_set_stale_window(uint32_t value) {
+    if (value == config.stale_window) return ESP_OK;
+
+    esp_err_t err = store(CFG_NAME_STALE_WINDOW, value);
+    if (err == ESP_OK) {
+        config.stale_window = value;
+    }
+
+    return err;
+}
+
+esp_err_t cfg_set_stale_policy(uint32_t value) {
+    if (value == config.stale_policy) return ESP_OK;
 
-    esp_err_t err = store(CFG_NAME_OPEN_DURATION, value);
+    esp_err_t err = store(CFG_NAME_STALE_POLICY, value);
     if (err == ESP_OK) {
-        config.gate_open_duration = value;
+        config.stale_policy = value;
     }
 
     return err;
 }
 
-esp_err_t cfg_set_gate_lock_duration(uint32_t value) {
-    if (value == config.gate_lock_duration) return ESP_OK;
+esp_err_t cfg_set_user_rate_burst(uint32_t value) {
+    if (value == config.user_rate_burst) return ESP_OK;
 
-    esp_err_t err = store(CFG_NAME_LOCK_DURATION, value);
+    esp_err_t err = store(CFG_NAME_USER_RATE_BURST, value);
     if (err == ESP_OK) {
-        config.gate_lock_duration = value;
+        config.user_rate_burst = value;
     }
 
     return err;
 }
 
-esp_err_t cfg_set_open_gate_level(uint32_t value) {
-    if (value == config.open_gate_level) return ESP_OK;
+esp_err_t cfg_set_user_rate_period(uint32_t value) {
+    if (value == config.user_rate_period) return ESP_OK;
 
-    esp_err_t err = store(CFG_NAME_OPEN_LEVEL, value);
+    esp_err_t err = store(CFG_NAME_USER_RATE_PERIOD, value);
     if (err == ESP_OK) {
-        config.open_gate_level = value;
+        config.user_rate_period = value;
     }
 
     return err;
 }
 
-void startGateControl(QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    TickType_t change_level_at = 0;
-    gate_delay_t gate_delay;
-    size_t active_output_idx = ACTIVE_OUTPUT_IDX_DISABLE_ALL;
+esp_err_t cfg_set_gate_rate_burst(uint32_t value) {
+    if (value == config.gate_rate_burst) return ESP_OK;
+
+    esp_err_t err = store(CFG_NAME_GATE_RATE_BURST, value);
+    if (err == ESP_OK) {
+        config.gate_rate_burst = value;
+    }
+
+    return err;
+}
+
+esp_err_t cfg_set_gate_rate_period(uint32_t value) {
+    if (value == config.gate_rate_period) return ESP_OK;
+
+    esp_err_t err = store(CFG_NAME_GATE_RATE_PERIOD, value);
+    if (err == ESP_OK) {
+        config.gate_rate_period = value;
+    }
+
+    return err;
+}
+
+size_t gate_count() {
+    return gates_count;
+}
+
+const gate_config_t* gate_get(gate_t gate) {
+    return gate < gates_count ? &gates[gate] : NULL;
+}
+
+size_t gate_saved_count() {
+    return saved_gates_count;
+}
+
+const gate_config_t* gate_saved_get(gate_t gate) {
+    return gate < saved_gates_count ? &saved_gates[gate] : NULL;
+}
+
+// The name goes into the keyboard buttons as is, so it is kept to letters, digits, spaces and dashes
+static bool valid_gate_name(const char* name) {
+    if (!isalpha((unsigned char)name[0])) return false;
+
+    size_t len = strnlen(name, GATE_NAME_MAX_LEN);
+    if (len == GATE_NAME_MAX_LEN) return false;
+
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != ' ' && name[i] != '-') return false;
+    }
+
+    return true;
+}
+
+// Changes the gate, or appends one when the gate is the saved count
+esp_err_t gate_save(gate_t gate, const gate_config_t* gate_config) {
+    if (gate > saved_gates_count || gate >= MAX_GATES) return ESP_ERR_INVALID_ARG;
+    if (!valid_gate_name(gate_config->name)) return ESP_ERR_INVALID_ARG;
+    if (gate_config->pin >= 32 || !GPIO_IS_VALID_OUTPUT_GPIO(gate_config->pin) || (GATE_RESERVED_PINS >> gate_config->pin) & 1) return ESP_ERR_INVALID_ARG;
+
+    for (size_t i = 0; i < saved_gates_count; i++) {
+        if (i == gate) continue;
+        if (saved_gates[i].pin == gate_config->pin || strcasecmp(saved_gates[i].name, gate_config->name) == 0) return ESP_ERR_INVALID_STATE;
+    }
+
+    saved_gates[gate] = *gate_config;
+    saved_gates[gate].open_level = gate_config->open_level != 0;
+    if (gate == saved_gates_count) {
+        saved_gates_count++;
+    }
+    gates_dirty = true;
+    change_count++;
+
+    return ESP_OK;
+}
+
+esp_err_t gate_drop(gate_t gate) {
+    if (gate >= saved_gates_count) return ESP_ERR_NOT_FOUND;
+    if (saved_gates_count == 1) return ESP_ERR_INVALID_STATE;
+
+    memmove(&saved_gates[gate], &saved_gates[gate + 1], (saved_gates_count - gate - 1) * sizeof(gate_config_t));
+    saved_gates_count--;
+    gates_dirty = true;
+    change_count++;
+
+    return ESP_OK;
+}
+
+bool gate_restart_pending() {
+    return saved_gates_count != gates_count || memcmp(saved_gates, gates, gates_count * sizeof(gate_config_t)) != 0;
+}
+
+// Sets the outputs released before they are enabled, so that no button is pressed at boot
+void gate_outputs_init() {
+    output_mask = 1 << GPIO_LED_NUM;
+    active_high_mask = 1 << GPIO_LED_NUM;
+    for (size_t i = 0; i < gates_count; i++) {
+        output_mask |= 1 << gates[i].pin;
+        if (gates[i].open_level) {
+            active_high_mask |= 1 << gates[i].pin;
+        }
+    }
+
+    set_levels(evaluate(&state, esp_timer_get_time(), NULL));
+
+    gpio_config_t gate_gpio = {
+        .pin_bit_mask = output_mask,
+        .pull_up_en = true,
+        .pull_down_en = false,
+        .mode = GPIO_MODE_OUTPUT,
+    };
+    gpio_config(&gate_gpio);
+}
+
+// Never blocks: the command is merged with what is waiting for the gate task, which is woken up. The task that
+// submits gets a notification whenever the gate states change
+gate_submit_result_t gate_submit(gate_t gate, int32_t delay, int64_t user_id, uint32_t* command_id) {
+    if (gate >= gates_count || (delay <= 0 && delay != GATE_DELAY_UNLOCK)) return GATE_SUBMIT_REJECTED;
+
+    int64_t close_at = esp_timer_get_time() + TICKS_TO_US(delay);
+
+    portENTER_CRITICAL(&submit_lock);
+    submitted_t* command = &submitted[gate];
+    gate_submit_result_t result = command->command_id != 0 ? GATE_SUBMIT_MERGED : GATE_SUBMIT_ACCEPTED;
+    command->command_id = ++last_command_id;
+    if (delay == GATE_DELAY_UNLOCK) {
+        command->unlock_id = command->command_id;
+        command->close_at = 0;
+    } else if (close_at > command->close_at) {
+        command->close_at = close_at;
+        command->user_id = user_id;
+    }
+    *command_id = command->command_id;
+    notify_task = xTaskGetCurrentTaskHandle();
+
+    command_record_t* record = &command_records[command->command_id % GATE_COMMAND_HISTORY_LEN];
+    record->id = command->command_id;
+    record->gate = gate;
+    record->unlock = delay == GATE_DELAY_UNLOCK;
+    record->outcome = GATE_COMMAND_PENDING;
+    record->pressed_at = 0;
+    portEXIT_CRITICAL(&submit_lock);
+
+    if (gate_task != NULL) {
+        xTaskNotifyGive(gate_task);
+    }
+
+    return result;
+}
+
+// Never blocks. The task that submitted the command is notified when the outcome is known
+gate_command_outcome_t gate_command_outcome(uint32_t command_id, int64_t* pressed_at) {
+    portENTER_CRITICAL(&submit_lock);
+    command_record_t* record = &command_records[command_id % GATE_COMMAND_HISTORY_LEN];
+    gate_command_outcome_t outcome = record->id == command_id ? record->outcome : GATE_COMMAND_UNKNOWN;
+    *pressed_at = record->pressed_at;
+    portEXIT_CRITICAL(&submit_lock);
+
+    return outcome;
+}
+
+// The button pulses are timed by esp_timer, which sets the output levels worked out here in advance. The task only
+// wakes for gate commands and after each edge, to program the next one
+void startGateControl() {
+    TickType_t timeout = 0; // the outputs are set right away
+    gate_task = xTaskGetCurrentTaskHandle();
+
+    esp_timer_handle_t pulse_timer;
+    const esp_timer_create_args_t pulse_timer_args = {
+        .callback = &pulse_timer_callback,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "gate_pulse",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&pulse_timer_args, &pulse_timer));
 
     while (42) {
-        TickType_t now = xTaskGetTickCount();
-
-        if (xQueueReceive(open_queue, &gate_delay, cfg_get_gate_poll())) {
-            ESP_LOGI(TAG, "gate %i: got delay of %li", gate_delay.gate, gate_delay.delay);
-
-            if (gate_delay.delay < 0) {
-                gates[gate_delay.gate].close_gate_at = now - 1;
-                change_level_at = now + 1;
-            } else {
-                TickType_t new_close_time = now + gate_delay.delay;
-                // In order to make sure wraparound won't affect timestamp difference, the values are casted to signed integer
-                if (((int32_t)new_close_time - (int32_t)gates[gate_delay.gate].close_gate_at) > 0) {
-                    gates[gate_delay.gate].close_gate_at = new_close_time;
-                }
+        ulTaskNotifyTake(pdTRUE, timeout);
+
+        // Take the edge back from the timer. If it has been set already, carry on from there
+        portENTER_CRITICAL(&edge_lock);
+        bool done = edge_done;
+        edge_done = false;
+        edge_at = 0;
+        portEXIT_CRITICAL(&edge_lock);
+
+        esp_timer_stop(pulse_timer);
+        if (done) {
+            state = edge_state;
+        }
+
+        int64_t now = esp_timer_get_time();
+
+        submitted_t commands[MAX_GATES];
+        portENTER_CRITICAL(&submit_lock);
+        memcpy(commands, submitted, sizeof(commands));
+        memset(submitted, 0, sizeof(submitted));
+        portEXIT_CRITICAL(&submit_lock);
+
+        for (size_t i = 0; i < gates_count; i++) {
+            if (commands[i].command_id != 0) {
+                take_command(i, &commands[i], now);
             }
         }
 
-        // The remote doesn't allow pressing both keys simultaneously so press the buttons one at a time
-        // Build array of open gate requests: active = 1, inactive = 0
-        uint32_t outputs = 0;
-        for (size_t i = 0; i < TOTAL_GATES; i++) {
-            if ((int32_t)now - (int32_t)gates[i].close_gate_at > 0) {
-                gates[i].close_gate_at = now;
-                continue;
+        int64_t next_change_at;
+        set_levels(evaluate(&state, now, &next_change_at));
+
+        publish_status();
+
+        timeout = portMAX_DELAY;
+        if (next_change_at != 0) {
+            edge_state = state;
+            edge_levels = evaluate(&edge_state, next_change_at, NULL);
+
+            portENTER_CRITICAL(&edge_lock);
+            edge_at = next_change_at;
+            portEXIT_CRITICAL(&edge_lock);
+            ESP_ERROR_CHECK(esp_timer_start_once(pulse_timer, next_change_at - now));
+        } else if (edge_count > 0) {
+            // The lateness of the esp_timer dispatch, the pulse jitter on the device
+            ESP_LOGI(TAG, "%lu pulse edges, late by %lli us on average and %lli us at most", edge_count,
+                edge_lateness_sum / edge_count, edge_max_lateness);
+            edge_count = 0;
+            edge_lateness_sum = 0;
+            edge_max_lateness = 0;
+            ESP_LOGI(TAG, "%u bytes of stack never used", uxTaskGetStackHighWaterMark(NULL));
+        }
+    }
+}
+
+static void take_command(gate_t gate_idx, const submitted_t* command, int64_t now) {
+    ESP_LOGI(TAG, "gate %u: command %lu%s, close in %lli ms", gate_idx, command->command_id, command->unlock_id ? " after unlock" : "",
+        command->close_at != 0 ? (command->close_at - now) / 1000 : 0);
+    gate_control_t* gate = &state.gates[gate_idx];
+
+    if (command->unlock_id != 0) {
+        gate->open = false;
+        gate->pending_id = 0;
+        state.change_level_at = now;
+
+        // The gate is closed, which is what the unlocks asked for, and the opens before them are not carried out
+        portENTER_CRITICAL(&submit_lock);
+        for (size_t i = 0; i < GATE_COMMAND_HISTORY_LEN; i++) {
+            command_record_t* record = &command_records[i];
+            if (record->id == 0 || record->id > command->unlock_id || record->gate != gate_idx || record->outcome != GATE_COMMAND_PENDING) continue;
+
+            record->outcome = record->unlock ? GATE_COMMAND_DONE : GATE_COMMAND_CANCELLED;
+        }
+        portEXIT_CRITICAL(&submit_lock);
+    }
+
+    if (command->close_at != 0) {
+        gate->pending_id = command->command_id;
+        gate->opened_by = command->user_id;
+        if (!gate->open || command->close_at > gate->close_gate_at) {
+            gate->close_gate_at = command->close_at;
+            gate->open = true;
+        }
+    }
+}
+
+// Advances the pulse train to the given time and returns the output levels, a bit per GPIO. The time of the next
+// change is 0 once all the gates are closed
+static uint32_t evaluate(pulse_state_t* pulse, int64_t now, int64_t* next_change_at) {
+    // The remote doesn't allow pressing two keys simultaneously so the gates take turns, a press followed by a
+    // release. Every gate keeps its turn whether it is open or not, so a gate is pressed once in 2 * gates_count
+    // pulses, as it always was
+    bool any_open = false;
+    for (size_t i = 0; i < gates_count; i++) {
+        if (pulse->gates[i].open && now >= pulse->gates[i].close_gate_at) {
+            pulse->gates[i].open = false;
+            if (pulse->gates[i].pending_id != 0) {
+                pulse->gates[i].failed_id = pulse->gates[i].pending_id;
+                pulse->gates[i].pending_id = 0;
+            }
+        }
+        any_open |= pulse->gates[i].open;
+    }
+
+    bool slot_started = false;
+    if (!any_open) {
+        pulse->slot = 0;
+        pulse->change_level_at = now;
+    } else if (now >= pulse->change_level_at) {
+        pulse->change_level_at = now + TICKS_TO_US(cfg_get_gate_open_pulse_duration());
+        pulse->slot = (pulse->slot + 1) % (2 * gates_count);
+        slot_started = true;
+    }
+
+    // A gate opened during its own turn is pressed for the rest of it
+    gate_t pressed_gate = pulse->slot / 2;
+    bool pressing = pulse->slot % 2 == 1 && pulse->gates[pressed_gate].open;
+    if (pressing) {
+        gate_control_t* gate = &pulse->gates[pressed_gate];
+        if (slot_started || gate->pending_id != 0) {
+            gate->pressed_at = now;
+        }
+        if (gate->pending_id != 0) {
+            gate->done_id = gate->pending_id;
+            gate->pending_id = 0;
+        }
+    }
+
+    if (next_change_at != NULL) {
+        *next_change_at = 0;
+        if (any_open) {
+            *next_change_at = pulse->change_level_at;
+            for (size_t i = 0; i < gates_count; i++) {
+                if (pulse->gates[i].open && pulse->gates[i].close_gate_at < *next_change_at) {
+                    *next_change_at = pulse->gates[i].close_gate_at;
+                }
             }
-            outputs |= 1 << (2 * i + 1);
         }
+    }
 
-        if (outputs == 0) {
-            active_output_idx = ACTIVE_OUTPUT_IDX_DISABLE_ALL;
-            change_level_at = now + 1;
+    // A gate closing halfway through its press is released right away
+    uint32_t levels = 0;
+    if (pressing) {
+        levels |= 1 << GPIO_LED_NUM;
+    }
+    for (size_t i = 0; i < gates_count; i++) {
+        bool press = pressing && i == pressed_gate;
+        if (gates[i].open_level ? press : !press) {
+            levels |= 1 << gates[i].pin;
         }
+    }
+
+    return levels;
+}
+
+// Writes only the pins that change, all of them through the set and clear registers. Buttons are released before
+// the next one is pressed, so that two of them are never pressed at once. The pins must be below GPIO 32
+static void set_levels(uint32_t levels) {
+    uint32_t changed = written ? (levels ^ written_levels) & output_mask : output_mask;
+    uint32_t press = changed & ~(levels ^ active_high_mask);
+    uint32_t release = changed & ~press;
+
+    if (release & levels) REG_WRITE(GPIO_OUT_W1TS_REG, release & levels);
+    if (release & ~levels) REG_WRITE(GPIO_OUT_W1TC_REG, release & ~levels);
+    if (press & levels) REG_WRITE(GPIO_OUT_W1TS_REG, press & levels);
+    if (press & ~levels) REG_WRITE(GPIO_OUT_W1TC_REG, press & ~levels);
 
-        if (((int32_t)now - (int32_t)change_level_at) > 0) {
-            change_level_at = now + cfg_get_gate_open_pulse_duration();
-            active_output_idx = (active_output_idx + 1) % ACTIVE_OUTPUT_IDX_MAX;
+    written_levels = levels;
+    written = true;
+}
+
+// Resolves the opens carried out or ended since the last call. The done and failed IDs only keep the latest, so an
+// open is resolved by the earlier of them that covers it: opens merged into a later one share its fate
+static bool resolve_commands() {
+    bool resolved = false;
+
+    portENTER_CRITICAL(&submit_lock);
+    for (size_t i = 0; i < GATE_COMMAND_HISTORY_LEN; i++) {
+        command_record_t* record = &command_records[i];
+        if (record->id == 0 || record->unlock || record->outcome != GATE_COMMAND_PENDING || record->gate >= gates_count) continue;
+
+        gate_control_t* gate = &state.gates[record->gate];
+        bool done = record->id <= gate->done_id;
+        bool failed = record->id <= gate->failed_id;
+        if (done && (!failed || gate->done_id < gate->failed_id)) {
+            record->outcome = GATE_COMMAND_DONE;
+            record->pressed_at = gate->pressed_at;
+            resolved = true;
+        } else if (failed) {
+            record->outcome = GATE_COMMAND_FAILED;
+            resolved = true;
         }
+    }
+    portEXIT_CRITICAL(&submit_lock);
+
+    return resolved;
+}
+
+// Only the gate task writes the states, so it can compare them with the published ones without the seqlock. The
+// task that submitted the latest command is notified of new states and of commands resolved
+static void publish_status() {
+    bool changed = resolve_commands();
+
+    gate_state_t next[MAX_GATES];
+    memset(next, 0, sizeof(next));
+    for (size_t i = 0; i < gates_count; i++) {
+        next[i].open = state.gates[i].open;
+        next[i].close_at = state.gates[i].close_gate_at;
+        next[i].opened_by = state.gates[i].opened_by;
+        next[i].pressed_at = state.gates[i].pressed_at;
+    }
+
+    if (memcmp(next, status, sizeof(status)) != 0) {
+        unsigned seq = atomic_load_explicit(&status_seq, memory_order_relaxed);
+        atomic_store_explicit(&status_seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        memcpy(status, next, sizeof(status));
+        atomic_store_explicit(&status_seq, seq + 2, memory_order_release);
+        changed = true;
+    }
+
+    if (changed && notify_task != NULL) {
+        xTaskNotifyGive(notify_task);
+    }
+}
+
+// Copies the states of all MAX_GATES gates. It never blocks, a copy that overlaps a write is only taken again
+void gate_status_get(gate_state_t* states) {
+    unsigned seq;
+    do {
+        seq = atomic_load_explicit(&status_seq, memory_order_acquire);
+        memcpy(states, status, sizeof(status));
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&status_seq, memory_order_relaxed));
+}
 
-        gpio_set_level(GPIO_LED_NUM, outputs & (1 << active_output_idx));
-        for (size_t i = 0; i < TOTAL_GATES; i++) {
-            uint32_t gate_mask = 1 << (2 * i + 1);
-            uint_fast8_t gate_level = outputs & (1 << active_output_idx) & gate_mask;
-            gpio_set_level(gates[i].pin, cfg_get_open_gate_level() ? gate_level : !gate_level);
+// A callback already on its way when the task stopped the timer may run after the next edge is programmed, so
+// only an edge that is due is set
+static void pulse_timer_callback(void* arg) {
+    portENTER_CRITICAL(&edge_lock);
+    int64_t now = esp_timer_get_time();
+    bool done = edge_at != 0 && now >= edge_at;
+    if (done) {
+        set_levels(edge_levels);
+        edge_done = true;
+
+        if (now - edge_at > edge_max_lateness) {
+            edge_max_lateness = now - edge_at;
         }
+        edge_lateness_sum += now - edge_at;
+        edge_count++;
+        edge_at = 0;
+    }
+    portEXIT_CRITICAL(&edge_lock);
 
-        int32_t lower_gate_time_left = (int32_t)now - (int32_t)gates[LOWER_GATE].close_gate_at;
-        xQueueOverwrite(status_queue, &lower_gate_time_left);
+    // The task programs the next edge, which may be due right after this one
+    if (done) {
+        xTaskNotifyGive(gate_task);
     }
 }
 
+// Only marks the value for cfg_flush(), so that several changes are written to NVS together
 static esp_err_t store(char* name, uint32_t value) {
     if (name == NULL) return ESP_ERR_INVALID_ARG;
 
+    for (size_t i = 0; i < sizeof(config_name_value_default) / sizeof(config_name_value_default[0]); i++) {
+        if (strcmp(config_name_value_default[i].name, name) == 0) {
+            dirty_config |= 1 << i;
+            change_count++;
+            return ESP_OK;
+        }
+    }
+
+    return ESP_ERR_NOT_FOUND;
+}
+
+uint32_t cfg_change_count() {
+    return change_count;
+}
+
+esp_err_t cfg_flush() {
+    if (dirty_config == 0 && !gates_dirty) return ESP_OK;
+
     nvs_handle_t nvs_handle = 0;
     esp_err_t err;
 
@@ -232,9 +772,20 @@ static esp_err_t store(char* name, uint32_t value) {
         goto exit;
     }
 
-    err = nvs_set_u32(nvs_handle, name, value);
-    if (err != ESP_OK) {
-        goto exit;
+    for (size_t i = 0; i < sizeof(config_name_value_default) / sizeof(config_name_value_default[0]); i++) {
+        if (!(dirty_config & (1 << i))) continue;
+
+        err = nvs_set_u32(nvs_handle, config_name_value_default[i].name, *(config_name_value_default[i].value));
+        if (err != ESP_OK) {
+            goto exit;
+        }
+    }
+
+    if (gates_dirty) {
+        err = nvs_set_blob(nvs_handle, CFG_NAME_GATES, saved_gates, saved_gates_count * sizeof(gate_config_t));
+        if (err != ESP_OK) {
+            goto exit;
+        }
     }
 
     err = nvs_commit(nvs_handle);
@@ -242,15 +793,18 @@ static esp_err_t store(char* name, uint32_t value) {
         goto exit;
     }
 
+    dirty_config = 0;
+    gates_dirty = false;
+
 exit:
     if (nvs_handle != 0) {
         nvs_close(nvs_handle);
     }
 
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error updating config '%s' in NVS: %i (%#x)", name, err, err);
+        ESP_LOGE(TAG, "Error updating config in NVS: %i (%#x)", err, err);
     } else {
-        ESP_LOGI(TAG, "Updated config '%s' in NVS", name);
+        ESP_LOGI(TAG, "Updated config in NVS");
     }
     return err;
-}
\ No newline at end of file
+}
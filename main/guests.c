@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "nvs.h"
+#include "guests.h"
+#include "users.h"
+
+#define STORAGE_PARTITION "users"
+#define STORAGE_NAMESPACE "guests"
+#define GUEST_KEY_PREFIX 'g'
+#define USER_ID_MAX ((1LL << 52) - 1)
+
+// Open addressing with linear probing, at most half full so that probe sequences stay short
+#define TABLE_SIZE (2 * MAX_GUESTS)
+#define TABLE_MASK (TABLE_SIZE - 1)
+#define ERASE_PENDING_LEN 16
+
+#if CONFIG_SPIRAM
+#define TABLE_MALLOC_CAPS (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#else
+#define TABLE_MALLOC_CAPS MALLOC_CAP_8BIT
+#endif
+
+typedef struct {
+    int64_t id; // 0 for a free slot
+    uint32_t expires_at;
+    uint16_t opens_left;
+    uint16_t heap_pos; // position in the expiry heap
+    bool dirty;
+} guest_t;
+
+// What is stored in NVS under the guest key
+typedef struct {
+    uint32_t expires_at;
+    uint16_t opens_left;
+} guest_record_t;
+
+static const char TAG[] = "guests";
+
+static guest_t* table; // allocated with the first guest
+// Min-heap of table slots ordered by expiry, so that expiring guests costs nothing until one is due
+static uint16_t heap[MAX_GUESTS];
+static size_t heap_len;
+static bool dirty; // some guest needs to be written
+static uint32_t change_count;
+
+// Guests removed since the last flush, whose keys are still in NVS
+static int64_t erase_pending[ERASE_PENDING_LEN];
+static size_t erase_pending_len;
+
+static esp_err_t table_alloc();
+static size_t slot_of(int64_t id);
+static guest_t* find(int64_t id);
+static guest_t* insert(int64_t id);
+static void remove_slot(size_t slot);
+static void heap_swap(size_t a, size_t b);
+static void heap_up(size_t pos);
+static void heap_down(size_t pos);
+static esp_err_t heap_remove(size_t pos);
+static void get_nvs_key(char key[NVS_KEY_NAME_MAX_SIZE], int64_t id);
+
+esp_err_t load_guests() {
+    nvs_iterator_t it = NULL;
+    nvs_handle_t nvs_handle = 0;
+    esp_err_t err;
+    size_t loaded = 0;
+
+    err = nvs_open_from_partition(STORAGE_PARTITION, STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK) {
+        goto exit;
+    }
+
+    err = nvs_entry_find(STORAGE_PARTITION, STORAGE_NAMESPACE, NVS_TYPE_BLOB, &it);
+    while (err == ESP_OK) {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+
+        char* end;
+        int64_t id = strtoll(&info.key[1], &end, 16);
+        guest_record_t record;
+        size_t record_size = sizeof(record);
+        if (info.key[0] == GUEST_KEY_PREFIX && *end == '\0'
+            && nvs_get_blob(nvs_handle, info.key, &record, &record_size) == ESP_OK && record_size == sizeof(record)) {
+            guest_t* guest = insert(id);
+            if (guest != NULL) {
+                guest->expires_at = record.expires_at;
+                guest->opens_left = record.opens_left;
+                heap_up(guest->heap_pos);
+                loaded++;
+            }
+        }
+
+        err = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+
+exit:
+    if (nvs_handle != 0) {
+        nvs_close(nvs_handle);
+    }
+
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        err = ESP_OK;
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error reading guests from NVS: %i (%#x)", err, err);
+    } else if (loaded > 0) {
+        ESP_LOGI(TAG, "Loaded %u guests", loaded);
+    }
+    return err;
+}
+
+// Part of the authorization path: a hash lookup and a comparison, the expired guests are removed later
+bool is_guest(int64_t id) {
+    guest_t* guest = find(id);
+
+    return guest != NULL && guest->opens_left > 0 && guest->expires_at > time(NULL);
+}
+
+esp_err_t guest_add(int64_t id, uint32_t duration, uint16_t opens) {
+    if (id <= 0 || id > USER_ID_MAX) return ESP_ERR_USR_WRONG_ID;
+    if (opens == 0) return ESP_ERR_INVALID_ARG;
+
+    guest_t* guest = find(id);
+    if (guest == NULL) {
+        if (heap_len >= MAX_GUESTS || table_alloc() != ESP_OK) {
+            return ESP_ERR_USR_NO_SPACE;
+        }
+
+        guest = insert(id);
+        for (size_t i = 0; i < erase_pending_len; i++) {
+            if (erase_pending[i] == id) {
+                erase_pending[i] = erase_pending[--erase_pending_len];
+                break;
+            }
+        }
+    }
+
+    // Granting again replaces the previous grant
+    guest->expires_at = time(NULL) + duration;
+    guest->opens_left = opens;
+    guest->dirty = true;
+    dirty = true;
+    change_count++;
+
+    heap_up(guest->heap_pos);
+    heap_down(guest->heap_pos);
+
+    return ESP_OK;
+}
+
+esp_err_t guest_drop(int64_t id) {
+    guest_t* guest = find(id);
+    if (guest == NULL) return ESP_ERR_NOT_FOUND;
+
+    // A guest that can't be removed yet is expired instead, guests_expire() removes it later
+    if (heap_remove(guest->heap_pos) != ESP_OK) {
+        guest->expires_at = time(NULL);
+        guest->dirty = true;
+        dirty = true;
+        change_count++;
+        heap_up(guest->heap_pos);
+    }
+    return ESP_OK;
+}
+
+bool guest_can_open(int64_t id) {
+    guest_t* guest = find(id);
+    return guest != NULL && guest->opens_left > 0;
+}
+
+// Takes one gate opening from the guest's allowance. The guest is removed with the last one
+bool guest_use_open(int64_t id) {
+    guest_t* guest = find(id);
+    if (guest == NULL || guest->opens_left == 0) return false;
+
+    if (guest->opens_left != GUEST_UNLIMITED_OPENS) {
+        guest->opens_left--;
+        guest->dirty = true;
+        dirty = true;
+        change_count++;
+
+        if (guest->opens_left == 0) {
+            ESP_LOGI(TAG, "Guest %lli used the last opening", id);
+            heap_remove(guest->heap_pos); // if it fails, the guest is kept without openings until it expires
+        }
+    }
+
+    return true;
+}
+
+size_t guest_count() {
+    return heap_len;
+}
+
+// Iterates over the guests in no particular order, starting with *pos = 0
+bool guest_list_next(size_t* pos, guest_info_t* info) {
+    if (table == NULL) return false;
+
+    for (; *pos < TABLE_SIZE; (*pos)++) {
+        guest_t* guest = &table[*pos];
+        if (guest->id == 0) continue;
+
+        info->id = guest->id;
+        info->expires_at = guest->expires_at;
+        info->opens_left = guest->opens_left;
+        (*pos)++;
+        return true;
+    }
+
+    return false;
+}
+
+// Removes the guests whose grant has expired. Only the due part of the heap is looked at
+size_t guests_expire() {
+    uint32_t now = time(NULL);
+    size_t expired = 0;
+
+    while (heap_len > 0 && table[heap[0]].expires_at <= now) {
+        int64_t id = table[heap[0]].id;
+        if (heap_remove(0) != ESP_OK) break; // tried again with the next batch
+        ESP_LOGI(TAG, "Guest %lli expired", id);
+        expired++;
+    }
+
+    return expired;
+}
+
+uint32_t guests_change_count() {
+    return change_count;
+}
+
+esp_err_t guests_flush() {
+    if (table == NULL) return ESP_OK;
+
+    if (!dirty && erase_pending_len == 0) return ESP_OK;
+
+    nvs_handle_t nvs_handle = 0;
+    esp_err_t err;
+
+    err = nvs_open_from_partition(STORAGE_PARTITION, STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        goto exit;
+    }
+
+    for (; erase_pending_len > 0; erase_pending_len--) {
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        get_nvs_key(key, erase_pending[erase_pending_len - 1]);
+
+        err = nvs_erase_key(nvs_handle, key);
+        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+            goto exit;
+        }
+    }
+
+    for (size_t slot = 0; slot < TABLE_SIZE; slot++) {
+        guest_t* guest = &table[slot];
+        if (guest->id == 0 || !guest->dirty) continue;
+
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        get_nvs_key(key, guest->id);
+        guest_record_t record = { .expires_at = guest->expires_at, .opens_left = guest->opens_left };
+
+        err = nvs_set_blob(nvs_handle, key, &record, sizeof(record));
+        if (err != ESP_OK) {
+            goto exit;
+        }
+        guest->dirty = false;
+    }
+
+    err = nvs_commit(nvs_handle);
+    if (err == ESP_OK) {
+        dirty = false;
+    }
+
+exit:
+    if (nvs_handle != 0) {
+        nvs_close(nvs_handle);
+    }
+
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGE(TAG, "Error updating guests in NVS: %i (%#x)", err, err);
+    }
+    return err;
+}
+
+static esp_err_t table_alloc() {
+    if (table != NULL) return ESP_OK;
+
+    table = heap_caps_calloc(TABLE_SIZE, sizeof(guest_t), TABLE_MALLOC_CAPS);
+    if (table == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate guest table");
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+static size_t slot_of(int64_t id) {
+    uint64_t h = (uint64_t)id * 0x9E3779B97F4A7C15ULL;
+    return (h >> 32) & TABLE_MASK;
+}
+
+static guest_t* find(int64_t id) {
+    if (table == NULL || id == 0) return NULL;
+
+    for (size_t slot = slot_of(id); table[slot].id != 0; slot = (slot + 1) & TABLE_MASK) {
+        if (table[slot].id == id) return &table[slot];
+    }
+
+    return NULL;
+}
+
+// Adds the guest to the table and, as already expired, to the end of the heap
+static guest_t* insert(int64_t id) {
+    if (heap_len >= MAX_GUESTS || table_alloc() != ESP_OK) return NULL;
+
+    size_t slot = slot_of(id);
+    while (table[slot].id != 0) {
+        if (table[slot].id == id) return &table[slot];
+        slot = (slot + 1) & TABLE_MASK;
+    }
+
+    table[slot] = (guest_t){ .id = id, .heap_pos = heap_len };
+    heap[heap_len++] = slot;
+
+    return &table[slot];
+}
+
+// Deletes the slot and moves back the entries of its probe sequence, so that no tombstones are needed
+static void remove_slot(size_t slot) {
+    erase_pending[erase_pending_len++] = table[slot].id;
+    change_count++;
+
+    size_t hole = slot;
+    for (size_t next = (slot + 1) & TABLE_MASK; table[next].id != 0; next = (next + 1) & TABLE_MASK) {
+        size_t home = slot_of(table[next].id);
+        // The entry may fill the hole only if its home slot isn't cyclically between the hole and its position
+        if (((next - home) & TABLE_MASK) >= ((next - hole) & TABLE_MASK)) {
+            table[hole] = table[next];
+            heap[table[hole].heap_pos] = hole;
+            hole = next;
+        }
+    }
+
+    table[hole].id = 0;
+}
+
+static void heap_swap(size_t a, size_t b) {
+    uint16_t slot = heap[a];
+    heap[a] = heap[b];
+    heap[b] = slot;
+    table[heap[a]].heap_pos = a;
+    table[heap[b]].heap_pos = b;
+}
+
+static void heap_up(size_t pos) {
+    while (pos > 0) {
+        size_t parent = (pos - 1) / 2;
+        if (table[heap[parent]].expires_at <= table[heap[pos]].expires_at) break;
+
+        heap_swap(pos, parent);
+        pos = parent;
+    }
+}
+
+static void heap_down(size_t pos) {
+    while (true) {
+        size_t smallest = pos;
+        size_t left = 2 * pos + 1;
+        size_t right = left + 1;
+
+        if (left < heap_len && table[heap[left]].expires_at < table[heap[smallest]].expires_at) smallest = left;
+        if (right < heap_len && table[heap[right]].expires_at < table[heap[smallest]].expires_at) smallest = right;
+        if (smallest == pos) break;
+
+        heap_swap(pos, smallest);
+        pos = smallest;
+    }
+}
+
+// Fails without removing the guest when the erase of its key can't be queued. Dropping the erase would bring the
+// guest back after a restart
+static esp_err_t heap_remove(size_t pos) {
+    if (erase_pending_len == ERASE_PENDING_LEN) {
+        guests_flush();
+        if (erase_pending_len == ERASE_PENDING_LEN) return ESP_ERR_NO_MEM;
+    }
+
+    size_t slot = heap[pos];
+
+    heap_len--;
+    if (pos != heap_len) {
+        heap_swap(pos, heap_len);
+        heap_down(pos);
+        heap_up(pos);
+    }
+
+    remove_slot(slot);
+    return ESP_OK;
+}
+
+static void get_nvs_key(char key[NVS_KEY_NAME_MAX_SIZE], int64_t id) {
+    snprintf(key, NVS_KEY_NAME_MAX_SIZE, "%c%llx", GUEST_KEY_PREFIX, id);
+}
@@ -0,0 +1,25 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bump allocator. Allocations live until the arena is reset, which releases all of them at once
+typedef struct {
+    uint8_t* base;
+    size_t size;
+    size_t used;
+    uint32_t failures; // allocations that didn't fit since the reset
+} arena_t;
+
+void arena_init(arena_t* arena, void* buf, size_t size);
+void arena_reset(arena_t* arena);
+void* arena_alloc(arena_t* arena, size_t size);
+void* arena_calloc(arena_t* arena, size_t count, size_t size);
+char* arena_strdup(arena_t* arena, const char* str);
+char* arena_sprintf(arena_t* arena, const char* format, ...) __attribute__((format(printf, 2, 3)));
+// Appends to the string, in place when it is the last allocation. Returns NULL if either is NULL or it doesn't fit
+char* arena_append(arena_t* arena, char* str, const char* format, ...) __attribute__((format(printf, 3, 4)));
+size_t arena_available(arena_t* arena);
+
+#endif // _ARENA_H_
@@ -0,0 +1,65 @@
+#ifndef _EVTLOG_H_
+#define _EVTLOG_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include "esp_err.h"
+
+#define EVTLOG_READ_CHUNK_LEN 16 // records
+
+typedef enum {
+    EVENT_ACTION_OPEN,
+    EVENT_ACTION_LOCK,
+    EVENT_ACTION_UNLOCK,
+} event_action_t;
+
+typedef enum {
+    EVENT_RESULT_DONE,
+    EVENT_RESULT_FAILED, // the gate closed or the wait timed out before the button was pressed
+    EVENT_RESULT_REJECTED,
+    EVENT_RESULT_STALE,
+    EVENT_RESULT_CANCELLED, // by an unlock sent after it
+} event_result_t;
+
+// A gate command and what became of it
+typedef struct {
+    time_t time; // of sending the command
+    int64_t user_id;
+    uint8_t gate;
+    event_action_t action;
+    event_result_t result;
+    uint32_t latency; // msec from receipt to the press, 0 unless done
+} event_t;
+
+// Record of the event log. Erased flash reads as all ones, which marks the end of the records in a sector
+typedef struct {
+    int64_t entry; // see EVENT_ENTRY()
+    uint32_t time;
+    uint16_t latency; // msec, saturated
+    uint16_t crc; // of the fields above
+} event_record_t;
+
+// Reads the events of a time range in the order they were logged. Sectors outside the range are skipped by their
+// time range kept in RAM, without reading them
+typedef struct {
+    time_t from;
+    time_t to; // exclusive
+    int64_t user_id; // 0 for everyone
+    size_t first_sector; // the oldest when the cursor was set
+    size_t visited; // sectors
+    size_t offset; // in the partition, of the next record to read
+    size_t end; // of the sector being read
+    event_record_t chunk[EVTLOG_READ_CHUNK_LEN];
+    size_t chunk_len;
+    size_t chunk_pos;
+} evtlog_cursor_t;
+
+esp_err_t load_evtlog();
+void evtlog_add(const event_t* event);
+esp_err_t evtlog_flush(bool force);
+void evtlog_seek(evtlog_cursor_t* cursor, time_t from, time_t to, int64_t user_id);
+bool evtlog_next(evtlog_cursor_t* cursor, event_t* event);
+
+#endif // _EVTLOG_H_
@@ -2,52 +2,91 @@
 #define _GATE_CONTROL_H_
 
 #include <stdint.h>
-#include "freertos/queue.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #define GPIO_LED_NUM GPIO_NUM_2
-#define GPIO_GATE_UPPER_NUM GPIO_NUM_15
-#define GPIO_GATE_LOWER_NUM GPIO_NUM_4
-#define GPIO_GATE_MASK ((1 << GPIO_GATE_UPPER_NUM) | (1 << GPIO_GATE_LOWER_NUM) | (1 << GPIO_LED_NUM))
+
+#define MAX_GATES 6
+#define GATE_NAME_MAX_LEN 20
+
+typedef uint8_t gate_t; // index in the gate table
+
+// A remote button driving a gate. The buttons are pressed one at a time
+typedef struct {
+    char name[GATE_NAME_MAX_LEN]; // capitalized, e.g. "Lower gate"
+    uint8_t pin; // below GPIO 32
+    uint8_t open_level;
+    uint32_t open_duration; // ticks
+    uint32_t lock_duration; // ticks, 0 if the gate can't be locked
+} gate_config_t;
+
+#define GATE_DELAY_UNLOCK -1
+#define GATE_COMMAND_HISTORY_LEN 32 // the latest commands, whose outcomes are kept
 
 typedef enum {
-    LOWER_GATE,
-    UPPER_GATE,
-    //----
-    TOTAL_GATES,
-} gate_t;
+    GATE_SUBMIT_ACCEPTED, // taken by the gate task at its next wakeup
+    GATE_SUBMIT_MERGED, // into a command for the gate the task hasn't taken yet
+    GATE_SUBMIT_REJECTED,
+} gate_submit_result_t;
 
+// Published by the gate task when it changes, see gate_status_get()
 typedef struct {
-    int32_t delay;
-    gate_t gate;
-} gate_delay_t;
+    bool open;
+    int64_t close_at; // esp_timer time, valid while open
+    int64_t opened_by; // user ID of the latest open, 0 if none since boot
+    int64_t pressed_at; // esp_timer time of the latest button press, 0 if none since boot
+} gate_state_t;
 
-#define GK_OPEN_QUEUE_LENGTH 10
-#define GK_OPEN_ITEM_SIZE sizeof(gate_delay_t)
-#define GK_STATUS_QUEUE_LENGTH 1
-#define GK_STATUS_ITEM_SIZE sizeof(int32_t)
+// What became of a submitted command, see gate_command_outcome()
+typedef enum {
+    GATE_COMMAND_PENDING,
+    GATE_COMMAND_DONE, // the button pressed after an open, the gate closed for an unlock
+    GATE_COMMAND_FAILED, // the gate closed before the button could be pressed
+    GATE_COMMAND_CANCELLED, // by an unlock submitted after it
+    GATE_COMMAND_UNKNOWN, // no longer kept
+} gate_command_outcome_t;
 
 typedef struct {
-    uint32_t gate_poll;
     uint32_t gate_open_pulse_duration;
-    uint32_t gate_open_duration;
-    uint32_t gate_lock_duration;
-    uint32_t open_gate_level;
+    uint32_t stale_window; // seconds
+    uint32_t stale_policy;
+    uint32_t user_rate_burst; // opens
+    uint32_t user_rate_period; // seconds per open
+    uint32_t gate_rate_burst;
+    uint32_t gate_rate_period;
 } gate_control_config_t;
 
-extern QueueHandle_t gk_open_queue;
-extern QueueHandle_t gk_status_queue;
-
 esp_err_t load_gate_config();
-uint32_t cfg_get_gate_poll();
 uint32_t cfg_get_gate_open_pulse_duration();
-uint32_t cfg_get_gate_open_duration();
-uint32_t cfg_get_gate_lock_duration();
-uint32_t cfg_get_open_gate_level();
-esp_err_t cfg_set_gate_poll(uint32_t value);
+uint32_t cfg_get_stale_window();
+uint32_t cfg_get_stale_policy();
+uint32_t cfg_get_user_rate_burst();
+uint32_t cfg_get_user_rate_period();
+uint32_t cfg_get_gate_rate_burst();
+uint32_t cfg_get_gate_rate_period();
 esp_err_t cfg_set_gate_open_pulse_duration(uint32_t value);
-esp_err_t cfg_set_gate_open_duration(uint32_t value);
-esp_err_t cfg_set_gate_lock_duration(uint32_t value);
-esp_err_t cfg_set_open_gate_level(uint32_t value);
-void startGateControl(QueueHandle_t open_queue, QueueHandle_t status_queue);
+esp_err_t cfg_set_stale_window(uint32_t value);
+esp_err_t cfg_set_stale_policy(uint32_t value);
+esp_err_t cfg_set_user_rate_burst(uint32_t value);
+esp_err_t cfg_set_user_rate_period(uint32_t value);
+esp_err_t cfg_set_gate_rate_burst(uint32_t value);
+esp_err_t cfg_set_gate_rate_period(uint32_t value);
+uint32_t cfg_change_count();
+esp_err_t cfg_flush();
+size_t gate_count();
+const gate_config_t* gate_get(gate_t gate);
+size_t gate_saved_count();
+const gate_config_t* gate_saved_get(gate_t gate);
+esp_err_t gate_save(gate_t gate, const gate_config_t* gate_config);
+esp_err_t gate_drop(gate_t gate);
+bool gate_restart_pending();
+void gate_outputs_init();
+void gate_status_get(gate_state_t* states);
+gate_submit_result_t gate_submit(gate_t gate, int32_t delay, int64_t user_id, uint32_t* command_id);
+gate_command_outcome_t gate_command_outcome(uint32_t command_id, int64_t* pressed_at);
+void startGateControl();
 
 #endif // _GATE_CONTROL_H_
\ No newline at end of file
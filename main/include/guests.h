@@ -0,0 +1,31 @@
+#ifndef _GUESTS_H_
+#define _GUESTS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include "esp_err.h"
+
+#define MAX_GUESTS 256
+#define GUEST_UNLIMITED_OPENS UINT16_MAX
+
+typedef struct {
+    int64_t id;
+    time_t expires_at;
+    uint16_t opens_left; // GUEST_UNLIMITED_OPENS if not limited
+} guest_info_t;
+
+esp_err_t load_guests();
+bool is_guest(int64_t id);
+esp_err_t guest_add(int64_t id, uint32_t duration, uint16_t opens);
+esp_err_t guest_drop(int64_t id);
+bool guest_can_open(int64_t id);
+bool guest_use_open(int64_t id);
+size_t guest_count();
+bool guest_list_next(size_t* pos, guest_info_t* info);
+size_t guests_expire();
+uint32_t guests_change_count();
+esp_err_t guests_flush();
+
+#endif // _GUESTS_H_
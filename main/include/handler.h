@@ -1,9 +1,11 @@
 #ifndef _HANDLER_H_
 #define _HANDLER_H_
 
-#include "freertos/queue.h"
+#include "arena.h"
 #include "tg.h"
 
-handler_response_t* gk_handler(char*, tg_update_t*, QueueHandle_t, QueueHandle_t);
+handler_response_t* gk_handler(char*, tg_update_t*, arena_t*);
+handler_response_t* gk_batch_handler(arena_t*);
+const char* gk_keyboard();
 
 #endif // _HANDLER_H_
\ No newline at end of file
@@ -0,0 +1,19 @@
+#ifndef _RATE_LIMIT_H_
+#define _RATE_LIMIT_H_
+
+#include <stdint.h>
+#include "gate_control.h"
+
+#define RATE_LIMIT_USERS 32
+
+typedef enum {
+    RATE_LIMIT_PASSED,
+    RATE_LIMIT_THROTTLED, // the first throttled request since the sender's last passed one
+    RATE_LIMIT_THROTTLED_AGAIN,
+} rate_limit_result_t;
+
+rate_limit_result_t rate_limit_take(int64_t user_id, gate_t gate, uint32_t* retry_after);
+void rate_limit_refund(int64_t user_id, gate_t gate);
+uint32_t rate_limit_throttled();
+
+#endif // _RATE_LIMIT_H_
@@ -0,0 +1,21 @@
+#ifndef _SCHEDULE_H_
+#define _SCHEDULE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define WEEK_HOURS (7 * 24)
+
+// Hours of the week, bit day * 24 + hour is set if the hour is allowed. Sunday is day 0 as in struct tm
+typedef struct {
+    uint8_t hours[WEEK_HOURS / 8];
+} week_schedule_t;
+
+esp_err_t schedule_compile(const char* spec, week_schedule_t* week);
+size_t schedule_format(const week_schedule_t* week, char* buf, size_t buf_size);
+int schedule_week_hour();
+bool schedule_allows(const week_schedule_t* week, int week_hour);
+
+#endif // _SCHEDULE_H_
@@ -4,11 +4,14 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#include "freertos/queue.h"
 #include "esp_err.h"
 
 #define JSMN_HEADER
 #include "jsmn.h"
+#include "arena.h"
+
+#define TG_KEYBOARD_MAX_LEN 1280 // the reply markup sent with every message
+#define TG_CHAT_ID_MAX_LEN 24
 
 typedef struct {
     jsmntok_t* id;
@@ -28,6 +31,7 @@ typedef struct {
 
 struct tg_message {
     jsmntok_t* id;
+    jsmntok_t* date;
     tg_user_t* from;
     tg_chat_t* chat;
     struct tg_message* reply_to_message;
@@ -41,16 +45,30 @@ typedef struct {
     tg_message_t* message;
 } tg_update_t;
 
+// Produces a long text line by line while it's being sent, so that it's never held in RAM as a whole.
+// next() writes the following line into buf and returns its length, 0 when there are no more lines
+typedef struct tg_line_source {
+    size_t (*next)(struct tg_line_source* source, char* buf, size_t buf_size);
+} tg_line_source_t;
+
 typedef struct {
     const char* chat_id;
     const char* text;
+    tg_line_source_t* lines; // follow the text, split into as many messages as needed
+    bool broadcast; // sent concurrently with the other broadcast responses of the batch
+    bool delivery_report; // the number of delivered broadcasts is appended to the text
 } handler_response_t;
 
+typedef handler_response_t* (*tg_update_handler_t)(char*, tg_update_t*, arena_t*);
+typedef handler_response_t* (*tg_batch_handler_t)(arena_t*);
+
 void tg_log_token(char*, char*, jsmntok_t*);
 esp_err_t tg_init(char*);
 void tg_deinit();
+void tg_set_keyboard(const char* reply_markup);
 int tg_send_message(const char* chat_id, const char* text);
+int tg_send_lines(const char* chat_id, const char* text, tg_line_source_t* lines);
 int tg_get_messages(char* bot_token, int32_t update_id);
-void tg_start(handler_response_t* (char*, tg_update_t*, QueueHandle_t, QueueHandle_t), QueueHandle_t, QueueHandle_t);
+void tg_start(tg_update_handler_t, tg_batch_handler_t);
 
 #endif // _TG_H_
\ No newline at end of file
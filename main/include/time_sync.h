@@ -1,7 +1,13 @@
 #ifndef _TIME_SYNC_H_
 #define _TIME_SYNC_H_
 
+// POSIX TZ string of the gate's location, access schedules are in its local time. Can be set in secrets.h
+#ifndef LOCAL_TIMEZONE
+#define LOCAL_TIMEZONE "UTC0"
+#endif
+
 void initialize_sntp(void);
+void set_local_timezone(const char* tz);
 esp_err_t fetch_and_store_time_in_nvs(void*);
 esp_err_t update_time_from_nvs(void);
 
@@ -2,15 +2,31 @@
 #define _USERS_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include "esp_err.h"
+#include "schedule.h"
 
 #define MAX_ADMINS 10
-#define MAX_USERS 100
+// The users partition holds the ID table, 9 bytes per user, twice while it is rewritten and MAX_GUESTS guests. The
+// profiles partition packs the names of about 36 bytes per user. Each user takes 13 bytes of RAM, kept in PSRAM
+// when there is some
+#define MAX_USERS 5000
+#define MAX_SCHEDULES 8
+#define SCHEDULE_ALWAYS 0 // the schedule of users not given another one
+#define USER_LIST_PAGE_SIZE 25 // a page of the longest entries still fits a Telegram message
 
 #define ESP_ERR_USR_ALREADY_EXISTS (-1)
 #define ESP_ERR_USR_NO_SPACE (-2)
 #define ESP_ERR_USR_WRONG_ID (-3)
 
+typedef enum {
+    ROLE_NONE,
+    ROLE_GUEST,
+    ROLE_USER,
+    ROLE_ADMIN,
+} user_role_t;
+
 typedef struct {
     int64_t id; // 52-bit value
     char username[32];
@@ -18,18 +34,35 @@ typedef struct {
     char last_name[32];
 } user_t;
 
+typedef struct {
+    bool admins;
+    const char* prefix; // of the username, first or last name, NULL lists everyone
+    size_t pos; // in the ID index, of the next entry to look at
+} user_list_cursor_t;
+
 esp_err_t load_users();
 bool is_admin(int64_t id);
 bool is_user(int64_t id);
 bool is_authorized(int64_t id);
+user_role_t user_role(int64_t id);
 esp_err_t user_add(int64_t id);
+esp_err_t user_import(int64_t id);
 esp_err_t user_drop(int64_t id);
-char* users_list(char* buf, size_t buf_size);
 size_t user_count();
 esp_err_t admin_add(int64_t id);
 esp_err_t admin_drop(int64_t id);
-char* admins_list(char* buf, size_t buf_size);
 size_t admin_count();
 size_t get_admin_ids(int64_t* buf, size_t buf_size);
+size_t user_list_pages(bool admins);
+bool user_list_seek(user_list_cursor_t* cursor, size_t page);
+size_t user_list_next(user_list_cursor_t* cursor, char* buf, size_t buf_size);
+size_t user_export_next(user_list_cursor_t* cursor, char* buf, size_t buf_size);
+void user_profile_update(const user_t* usr);
+const week_schedule_t* schedule_get(uint8_t schedule);
+esp_err_t schedule_set(uint8_t schedule, const week_schedule_t* week);
+int user_get_schedule(int64_t id);
+esp_err_t user_set_schedule(int64_t id, uint8_t schedule);
+uint32_t users_change_count();
+esp_err_t users_flush();
 
 #endif // _USERS_H_
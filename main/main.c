@@ -5,7 +5,6 @@
 #include "esp_timer.h"
 #include "esp_log.h"
 #include "nvs_flash.h"
-#include "driver/gpio.h"
 
 #include "sdkconfig.h"
 
@@ -16,20 +15,28 @@
 #include "handler.h"
 #include "gate_control.h"
 #include "users.h"
+#include "guests.h"
+#include "evtlog.h"
 
 static const char TAG[] = "gatekeeper";
 
 #define TIME_PERIOD (86400000000ULL)
+#define GATE_CONTROL_STACK_SIZE 3072 // mostly taken by the log lines, the task logs how much it has never used
 
 static void gatekeeper_gate_control_task(void* pvparameters) {
     ESP_LOGI(TAG, "Starting gate control task");
-    startGateControl(gk_open_queue, gk_status_queue);
+    startGateControl();
 }
 
 static void gatekeeper_telegram_task(void* pvparameters) {
     ESP_LOGI(TAG, "Starting Telegram task");
+    if (esp_reset_reason() == ESP_RST_POWERON) {
+        // The time restored from NVS can be up to a day behind and gate commands are rejected by their age
+        fetch_and_store_time_in_nvs(NULL);
+    }
     tg_init(BOT_TOKEN);
-    tg_start(gk_handler, gk_open_queue, gk_status_queue);
+    tg_set_keyboard(gk_keyboard());
+    tg_start(gk_handler, gk_batch_handler);
 }
 
 void app_main(void) {
@@ -54,21 +61,14 @@ void app_main(void) {
         ESP_ERROR_CHECK(update_time_from_nvs());
     }
 
+    set_local_timezone(LOCAL_TIMEZONE);
+
     ESP_ERROR_CHECK(load_users());
+    ESP_ERROR_CHECK(load_guests());
     ESP_ERROR_CHECK(load_gate_config());
+    ESP_ERROR_CHECK(load_evtlog());
 
-    gpio_config_t gate_gpio = {
-        .pin_bit_mask = GPIO_GATE_MASK,
-        .pull_up_en = true,
-        .pull_down_en = false,
-        .mode = GPIO_MODE_OUTPUT,
-    };
-    gpio_config(&gate_gpio);
-
-    uint32_t level = !cfg_get_open_gate_level();
-    gpio_set_level(GPIO_GATE_UPPER_NUM, level);
-    gpio_set_level(GPIO_GATE_LOWER_NUM, level);
-    gpio_set_level(GPIO_LED_NUM, level);
+    gate_outputs_init();
 
     const esp_timer_create_args_t nvs_update_timer_args = {
         .callback = (void*)&fetch_and_store_time_in_nvs,
@@ -78,9 +78,6 @@ void app_main(void) {
     ESP_ERROR_CHECK(esp_timer_create(&nvs_update_timer_args, &nvs_update_timer));
     ESP_ERROR_CHECK(esp_timer_start_periodic(nvs_update_timer, TIME_PERIOD));
 
-    gk_open_queue = xQueueCreate(GK_OPEN_QUEUE_LENGTH, GK_OPEN_ITEM_SIZE);
-    gk_status_queue = xQueueCreate(GK_STATUS_QUEUE_LENGTH, GK_STATUS_ITEM_SIZE);
-
-    xTaskCreate(&gatekeeper_gate_control_task, "gkControl", 2048, NULL, 5, NULL);
+    xTaskCreate(&gatekeeper_gate_control_task, "gkControl", GATE_CONTROL_STACK_SIZE, NULL, 5, NULL);
     xTaskCreate(&gatekeeper_telegram_task, "gkTelegram", 8192, NULL, 5, NULL);
 }
\ No newline at end of file
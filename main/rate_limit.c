@@ -0,0 +1,118 @@
+#include <stdbool.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "rate_limit.h"
+
+#define US_PER_SEC 1000000LL
+
+// A token bucket is kept as the time it was empty at, so that it needs no refilling: it holds one token for every
+// period since then, up to the burst
+typedef struct {
+    int64_t empty_at; // us
+} bucket_t;
+
+typedef struct {
+    int64_t user_id; // 0 for a free entry
+    bucket_t bucket;
+    uint32_t used_at; // LRU stamp
+    bool notified; // the sender was told about the throttling
+} user_bucket_t;
+
+static const char TAG[] = "rate_limit";
+
+static user_bucket_t user_buckets[RATE_LIMIT_USERS];
+static bucket_t gate_buckets[MAX_GATES];
+static uint32_t lru_clock;
+static uint32_t throttled;
+
+static user_bucket_t* get_user_bucket(int64_t user_id);
+static int64_t bucket_tokens(bucket_t* bucket, int64_t now, uint32_t burst, int64_t period);
+static int64_t bucket_wait(bucket_t* bucket, int64_t now, int64_t period);
+
+// Takes a token from both the user's and the gate's bucket, or from neither
+rate_limit_result_t rate_limit_take(int64_t user_id, gate_t gate, uint32_t* retry_after) {
+    int64_t now = esp_timer_get_time();
+    int64_t user_period = cfg_get_user_rate_period() * US_PER_SEC;
+    int64_t gate_period = cfg_get_gate_rate_period() * US_PER_SEC;
+
+    user_bucket_t* user = get_user_bucket(user_id);
+    bucket_t* gate_bucket = &gate_buckets[gate];
+
+    int64_t user_tokens = bucket_tokens(&user->bucket, now, cfg_get_user_rate_burst(), user_period);
+    int64_t gate_tokens = bucket_tokens(gate_bucket, now, cfg_get_gate_rate_burst(), gate_period);
+
+    if (user_tokens > 0 && gate_tokens > 0) {
+        user->bucket.empty_at += user_period;
+        gate_bucket->empty_at += gate_period;
+        user->notified = false;
+        return RATE_LIMIT_PASSED;
+    }
+
+    throttled++;
+
+    int64_t wait = 0;
+    if (user_tokens == 0) {
+        wait = bucket_wait(&user->bucket, now, user_period);
+    }
+    if (gate_tokens == 0 && bucket_wait(gate_bucket, now, gate_period) > wait) {
+        wait = bucket_wait(gate_bucket, now, gate_period);
+    }
+    *retry_after = (wait + US_PER_SEC - 1) / US_PER_SEC;
+
+    ESP_LOGW(TAG, "gate %i: throttled request of %lli, retry in %lu s", gate, user_id, *retry_after);
+
+    if (user->notified) return RATE_LIMIT_THROTTLED_AGAIN;
+
+    user->notified = true;
+    return RATE_LIMIT_THROTTLED;
+}
+
+// Gives back the tokens taken for a command that was never carried out
+void rate_limit_refund(int64_t user_id, gate_t gate) {
+    for (size_t i = 0; i < RATE_LIMIT_USERS; i++) {
+        if (user_buckets[i].user_id == user_id) {
+            user_buckets[i].bucket.empty_at -= cfg_get_user_rate_period() * US_PER_SEC;
+            break;
+        }
+    }
+    gate_buckets[gate].empty_at -= cfg_get_gate_rate_period() * US_PER_SEC;
+}
+
+uint32_t rate_limit_throttled() {
+    return throttled;
+}
+
+// Finds the user's bucket or takes over the least recently used one. A new bucket starts full
+static user_bucket_t* get_user_bucket(int64_t user_id) {
+    user_bucket_t* lru = &user_buckets[0];
+
+    for (size_t i = 0; i < RATE_LIMIT_USERS; i++) {
+        user_bucket_t* entry = &user_buckets[i];
+        if (entry->user_id == user_id) {
+            entry->used_at = ++lru_clock;
+            return entry;
+        }
+
+        if (entry->user_id == 0 || (lru->user_id != 0 && (int32_t)(entry->used_at - lru->used_at) < 0)) {
+            lru = entry;
+        }
+    }
+
+    *lru = (user_bucket_t){ .user_id = user_id, .bucket = { .empty_at = INT64_MIN / 2 }, .used_at = ++lru_clock };
+    return lru;
+}
+
+static int64_t bucket_tokens(bucket_t* bucket, int64_t now, uint32_t burst, int64_t period) {
+    if (period <= 0) return 1;
+
+    // Tokens beyond the burst are dropped by moving the empty time forward
+    if (now - bucket->empty_at > burst * period) {
+        bucket->empty_at = now - burst * period;
+    }
+
+    return (now - bucket->empty_at) / period;
+}
+
+static int64_t bucket_wait(bucket_t* bucket, int64_t now, int64_t period) {
+    return bucket->empty_at + period - now;
+}
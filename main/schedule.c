@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "schedule.h"
+
+#define FULL_DAY ((1UL << 24) - 1)
+#define CLOCK_SET_AFTER 1700000000 // earlier times mean the clock was never set
+
+static const char* const day_names[] = { "sun", "mon", "tue", "wed", "thu", "fri", "sat" };
+
+static const char* parse_day(const char* p, int* day);
+static const char* parse_hour(const char* p, int* hour);
+static uint32_t get_day_hours(const week_schedule_t* week, int day);
+static void set_day_hours(week_schedule_t* week, int day, uint32_t hours);
+
+// Compiles a spec like "mon-fri/8-18,sat/10-14" into the week bitmap. A day without hours is allowed all day,
+// "*" stands for every day and "none" for a schedule that never allows access
+esp_err_t schedule_compile(const char* spec, week_schedule_t* week) {
+    memset(week, 0, sizeof(*week));
+    if (strcasecmp(spec, "none") == 0) return ESP_OK;
+
+    const char* p = spec;
+    while (true) {
+        int first_day = 0;
+        int last_day = 6;
+        if (*p == '*') {
+            p++;
+        } else {
+            p = parse_day(p, &first_day);
+            if (p == NULL) return ESP_ERR_INVALID_ARG;
+
+            last_day = first_day;
+            if (*p == '-') {
+                p = parse_day(p + 1, &last_day);
+                if (p == NULL) return ESP_ERR_INVALID_ARG;
+            }
+        }
+
+        uint32_t hours = *p == '/' ? 0 : FULL_DAY;
+        while (*p == '/') {
+            int from;
+            int to;
+            p = parse_hour(p + 1, &from);
+            if (p == NULL || *p != '-') return ESP_ERR_INVALID_ARG;
+
+            p = parse_hour(p + 1, &to);
+            if (p == NULL || from >= to) return ESP_ERR_INVALID_ARG;
+
+            hours |= ((1UL << to) - 1) & ~((1UL << from) - 1);
+        }
+
+        // Day ranges may wrap around the end of the week, e.g. fri-mon
+        for (int day = first_day; ; day = (day + 1) % 7) {
+            set_day_hours(week, day, get_day_hours(week, day) | hours);
+            if (day == last_day) break;
+        }
+
+        if (*p == '\0') return ESP_OK;
+        if (*p++ != ',') return ESP_ERR_INVALID_ARG;
+    }
+}
+
+// The reverse of schedule_compile(), with the days from Monday on and equal days merged into ranges
+size_t schedule_format(const week_schedule_t* week, char* buf, size_t buf_size) {
+    size_t len = 0;
+    buf[0] = '\0';
+
+    for (int k = 0; k < 7; ) {
+        int first_day = (k + 1) % 7;
+        uint32_t hours = get_day_hours(week, first_day);
+
+        int end = k + 1;
+        while (end < 7 && get_day_hours(week, (end + 1) % 7) == hours) end++;
+        int last_day = end % 7;
+
+        if (hours != 0 && len < buf_size) {
+            int n;
+            if (k == 0 && end == 7) {
+                n = snprintf(&buf[len], buf_size - len, "*");
+            } else if (first_day == last_day) {
+                n = snprintf(&buf[len], buf_size - len, "%s%s", len ? "," : "", day_names[first_day]);
+            } else {
+                n = snprintf(&buf[len], buf_size - len, "%s%s-%s", len ? "," : "", day_names[first_day], day_names[last_day]);
+            }
+            len += n < 0 ? 0 : n;
+
+            for (int hour = 0; hours != FULL_DAY && hour < 24 && len < buf_size; ) {
+                if (!(hours & (1UL << hour))) {
+                    hour++;
+                    continue;
+                }
+
+                int from = hour;
+                while (hour < 24 && (hours & (1UL << hour))) hour++;
+                n = snprintf(&buf[len], buf_size - len, "/%i-%i", from, hour);
+                len += n < 0 ? 0 : n;
+            }
+        }
+
+        k = end;
+    }
+
+    if (len == 0) {
+        len = snprintf(buf, buf_size, "none");
+    }
+
+    return len < buf_size ? len : buf_size - 1;
+}
+
+// Local hour of the week, or -1 if the clock isn't set. The local time is only recalculated once an hour
+int schedule_week_hour() {
+    static time_t valid_from;
+    static time_t valid_until;
+    static int week_hour = -1;
+
+    time_t now = time(NULL);
+    if (now < CLOCK_SET_AFTER) return -1;
+
+    if (now < valid_from || now >= valid_until) {
+        struct tm local;
+        localtime_r(&now, &local);
+
+        week_hour = local.tm_wday * 24 + local.tm_hour;
+        valid_from = now - local.tm_min * 60 - local.tm_sec;
+        valid_until = valid_from + 3600;
+    }
+
+    return week_hour;
+}
+
+bool schedule_allows(const week_schedule_t* week, int week_hour) {
+    if (week_hour < 0) return false;
+
+    return (week->hours[week_hour >> 3] >> (week_hour & 7)) & 1;
+}
+
+static const char* parse_day(const char* p, int* day) {
+    for (int i = 0; i < 7; i++) {
+        if (strncasecmp(p, day_names[i], 3) == 0) {
+            *day = i;
+            return p + 3;
+        }
+    }
+
+    return NULL;
+}
+
+static const char* parse_hour(const char* p, int* hour) {
+    if (*p < '0' || *p > '9') return NULL;
+
+    char* end;
+    long value = strtol(p, &end, 10);
+    if (value > 24) return NULL;
+
+    *hour = value;
+    return end;
+}
+
+// A day takes three whole bytes of the bitmap
+static uint32_t get_day_hours(const week_schedule_t* week, int day) {
+    const uint8_t* p = &week->hours[day * 3];
+
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16);
+}
+
+static void set_day_hours(week_schedule_t* week, int day, uint32_t hours) {
+    uint8_t* p = &week->hours[day * 3];
+
+    p[0] = hours;
+    p[1] = hours >> 8;
+    p[2] = hours >> 16;
+}
@@ -1,564 +1,1750 @@
+#include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
+#include "freertos/task.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
 #include "handler.h"
 #include "gate_control.h"
 #include "users.h"
+#include "guests.h"
+#include "rate_limit.h"
+#include "evtlog.h"
 
-#define GK_OPEN_QUEUE_TIMEOUT pdMS_TO_TICKS(10000)
+#define GK_MAX_ARGS 4
 
 #define CMD_START "/start"
 #define CMD_ADDUSER "/adduser"
 #define CMD_DROPUSER "/dropuser"
 #define CMD_USERS "/users"
+#define CMD_IMPORTUSERS "/importusers"
+#define CMD_EXPORTUSERS "/exportusers"
+#define CMD_ADDGUEST "/addguest"
+#define CMD_DROPGUEST "/dropguest"
+#define CMD_GUESTS "/guests"
 #define CMD_ADDADMIN "/addadmin"
 #define CMD_DROPADMIN "/dropadmin"
 #define CMD_ADMINS "/admins"
-#define CMD_CFGGATEPOLL "/cfggatepoll"
 #define CMD_CFGOPENPULSEDURATION "/cfgopenpulseduration"
-#define CMD_CFGOPENDURATION "/cfgopenduration"
-#define CMD_CFGLOCKDURATION "/cfglockduration"
-#define CMD_CFGOPENLEVEL "/cfgopenlevel"
+#define CMD_GATES "/gates"
+#define CMD_CFGGATE "/cfggate"
+#define CMD_CFGGATETIMING "/cfggatetiming"
+#define CMD_DROPGATE "/dropgate"
+#define CMD_CFGSTALEWINDOW "/cfgstalewindow"
+#define CMD_CFGSTALEPOLICY "/cfgstalepolicy"
+#define CMD_CFGUSERRATELIMIT "/cfguserratelimit"
+#define CMD_CFGGATERATELIMIT "/cfggateratelimit"
+#define CMD_CFGSCHEDULE "/cfgschedule"
+#define CMD_USERSCHEDULE "/userschedule"
+#define CMD_EVENTS "/events"
 
 static const char TAG[] = "handler";
 
-static handler_response_t resp_batch_buf[MAX_ADMINS + 2];
-static char resp_buf[512];
-static char admin_ids[MAX_ADMINS][20];
+typedef enum {
+    GATE_ACTION_OPEN,
+    GATE_ACTION_LOCK,
+    GATE_ACTION_UNLOCK,
+    //----
+    TOTAL_GATE_ACTIONS,
+} gate_action_t;
 
-typedef handler_response_t* (*message_handler_t)(const char* const, tg_message_t*, QueueHandle_t, QueueHandle_t);
+#define ACK_BIT(gate, action) (1 << ((gate) * TOTAL_GATE_ACTIONS + (action)))
+
+// Keyboard buttons of a gate, their texts are built from the gate name
+typedef enum {
+    GATE_BUTTON_OPEN,
+    GATE_BUTTON_LOCK,
+    GATE_BUTTON_UNLOCK,
+    GATE_BUTTON_STATUS,
+    //----
+    TOTAL_GATE_BUTTONS,
+} gate_button_t;
+
+#define GATE_BUTTON_MAX_LEN (GATE_NAME_MAX_LEN + 16)
+
+#define REPLY_FAILED_TEXT "Failed to handle the command. Try again"
+#define ACK_FAILED_TEXT "Failed to report the gate commands. Check the gate status"
+
+#define GUEST_MAX_HOURS (24 * 90)
+#define SCHEDULE_TEXT_MAX_LEN 256
+
+#define STALE_POLICY_DROP 0
+#define STALE_POLICY_CONFIRM 1
+
+#define GATE_COMPLETION_MARGIN_US 1000000
+#define AWAITING_MAX_LEN 16 // below GATE_COMMAND_HISTORY_LEN
+#define WAITER_MAX_LEN 48
+
+#define EVENT_LIST_MAX_LEN 200
+#define EVENT_DEFAULT_HOURS 24
+
+// A submission waiting for the gate task to carry it out or give up. Later commands of the same kind for the gate
+// join it while it's pending, the gate task carries them out with the same press or ends them together
+typedef struct {
+    uint32_t command_id; // the latest joined, 0 if the slot is free
+    gate_t gate;
+    bool unlock;
+    int64_t deadline; // us
+} awaiting_t;
+
+// A submitted gate command, acknowledged by a later batch once the outcome of its submission is known
+typedef struct {
+    awaiting_t* awaiting; // NULL if the slot is free
+    uint32_t command_id;
+    gate_action_t action;
+    int64_t user_id;
+    time_t date;
+    int64_t received_at; // us
+    char chat_id[TG_CHAT_ID_MAX_LEN + 1];
+} waiter_t;
+
+// Acknowledgements of a batch merged per chat
+typedef struct chat_ack {
+    const char* chat_id;
+    uint32_t actions;
+    uint32_t failed_actions;
+    int64_t stale_age; // age in seconds of the oldest command that wasn't executed
+    bool changed; // a command of the chat left changes to store
+    struct chat_ack* next;
+} chat_ack_t;
+
+typedef struct gate_command {
+    gate_t gate;
+    gate_action_t action;
+    int64_t user_id;
+    time_t date;
+    int64_t received_at; // us
+    bool guest;
+    chat_ack_t* ack;
+    struct gate_command* next;
+} gate_command_t;
+
+typedef struct {
+    tg_message_t* message;
+    arena_t* arena;
+    int64_t user_id;
+    time_t date;
+    const char* chat_id;
+    user_role_t role;
+    int argc;
+    char* argv[GK_MAX_ARGS];
+} request_ctx_t;
+
+// Lines of the guest listing
+typedef struct {
+    tg_line_source_t source;
+    size_t pos;
+} guest_source_t;
+
+// Lines of a listing page, read from the user store while the reply is being sent
+typedef struct {
+    tg_line_source_t source;
+    user_list_cursor_t cursor;
+    size_t remaining; // entries left on the page
+} list_source_t;
+
+// Lines of the event listing, read from the event log while the reply is being sent
+typedef struct {
+    tg_line_source_t source;
+    evtlog_cursor_t cursor;
+    event_t next;
+    bool has_next;
+    size_t remaining; // events left to list
+} event_source_t;
+
+typedef handler_response_t* (*message_handler_t)(const char* const, request_ctx_t*);
 
 typedef struct {
     const char* const command;
     message_handler_t handler;
 } command_handler_t;
 
+static const event_action_t event_actions[TOTAL_GATE_ACTIONS] = {
+    [GATE_ACTION_OPEN] = EVENT_ACTION_OPEN,
+    [GATE_ACTION_LOCK] = EVENT_ACTION_LOCK,
+    [GATE_ACTION_UNLOCK] = EVENT_ACTION_UNLOCK,
+};
+
+static char keyboard[TG_KEYBOARD_MAX_LEN];
+
+static gate_command_t* gate_commands;
+static gate_command_t** gate_commands_tail = &gate_commands;
+static chat_ack_t* chat_acks;
+static awaiting_t awaiting[AWAITING_MAX_LEN];
+static awaiting_t* latest_awaiting[MAX_GATES];
+static waiter_t waiters[WAITER_MAX_LEN];
+
+// Latency from receiving a gate command to the first press of the button, upper bounds of the buckets in msec
+static const uint32_t latency_bounds[] = { 250, 500, 1000, 2000, 5000, 10000 };
+static uint32_t latency_counts[sizeof(latency_bounds) / sizeof(latency_bounds[0]) + 1];
+static time_t latest_date;
+
 static uint32_t tick_to_min(uint32_t tick) {
     return ((pdTICKS_TO_MS(tick) / 1000) + 30) / 60;
 }
 
-static handler_response_t compose_response(const char* buf, tg_message_t* message, char* text) {
-    handler_response_t response = {
-        .chat_id = &buf[message->chat->id->start],
-        .text = text,
-    };
+// The first letter of a gate name in the middle of a sentence, "Lower gate" is "lower gate" but "EV gate" stays
+static char name_initial(const char* name) {
+    return isupper((unsigned char)name[1]) ? name[0] : tolower((unsigned char)name[0]);
+}
 
-    return response;
+static int format_gate_button(char* buf, size_t buf_size, gate_t gate, gate_button_t button) {
+    const char* name = gate_get(gate)->name;
+
+    switch (button) {
+    case GATE_BUTTON_OPEN:
+        return snprintf(buf, buf_size, "Open %c%s", name_initial(name), &name[1]);
+    case GATE_BUTTON_LOCK:
+        return snprintf(buf, buf_size, "Open and lock %c%s", name_initial(name), &name[1]);
+    case GATE_BUTTON_UNLOCK:
+        return snprintf(buf, buf_size, "Unlock %c%s", name_initial(name), &name[1]);
+    default:
+        return snprintf(buf, buf_size, "%s status", name);
+    }
 }
 
-static handler_response_t* start_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t user = 0;
-    sscanf(&buf[token->start], "%lli", &user);
+static bool match_gate_button(const char* text, int text_size, gate_t* gate, gate_button_t* button) {
+    char buf[GATE_BUTTON_MAX_LEN];
 
-    if (!is_authorized(user)) {
-        int64_t admins[MAX_ADMINS];
-        size_t admin_count = get_admin_ids(admins, MAX_ADMINS);
+    for (size_t i = 0; i < gate_count(); i++) {
+        for (gate_button_t b = 0; b < TOTAL_GATE_BUTTONS; b++) {
+            if (format_gate_button(buf, sizeof(buf), i, b) == text_size && !strncmp(buf, text, text_size)) {
+                *gate = i;
+                *button = b;
+                return true;
+            }
+        }
+    }
 
-        const char* first_name = &buf[message->from->first_name->start]; // mandatory field
-        const char* last_name = message->from->last_name ? &buf[message->from->last_name->start] : ""; // optional field
-        const char* username = message->from->username ? &buf[message->from->username->start] : ""; // optional field
+    return false;
+}
 
-        sprintf(resp_buf, "🚨 Unauthorized user has started Gate Keeper bot:\nUser ID: %lli\nUsername: %s\nFirst name: %s\nLast name: %s\n\n⚠️ Verify the user before authorizing them.",
-            user, username, first_name, last_name);
+static int64_t arg_i64(request_ctx_t* req, int idx) {
+    if (idx >= req->argc) return 0;
 
-        for (size_t i = 0; i < admin_count; i++) {
-            sprintf(admin_ids[i], "%lli", admins[i]);
-            handler_response_t resp = { admin_ids[i], resp_buf };
-            resp_batch_buf[i] = resp;
+    return strtoll(req->argv[idx], NULL, 0);
+}
+
+static uint32_t arg_u32(request_ctx_t* req, int idx) {
+    if (idx >= req->argc) return 0;
+
+    return strtoul(req->argv[idx], NULL, 10);
+}
+
+// Returns a single response terminated by an empty entry, allocated in the batch arena
+static handler_response_t* compose_response(request_ctx_t* req, const char* text) {
+    if (text == NULL) return NULL;
+
+    handler_response_t* resp = arena_calloc(req->arena, 2, sizeof(handler_response_t));
+    if (resp == NULL) return NULL;
+
+    resp->chat_id = req->chat_id;
+    resp->text = text;
+
+    return resp;
+}
+
+static size_t list_next_line(tg_line_source_t* source, char* buf, size_t buf_size) {
+    list_source_t* list = (list_source_t*)source;
+    if (list->remaining == 0) return 0;
+
+    list->remaining--;
+    return user_list_next(&list->cursor, buf, buf_size);
+}
+
+// Responds to "/users [page] [name prefix]" and the same for admins. Only the heading is composed here,
+// the entries are streamed by tg_send_lines()
+static handler_response_t* compose_list(request_ctx_t* req, bool admins) {
+    const char* title = admins ? "Admins" : "Users";
+
+    list_source_t* list = arena_calloc(req->arena, 1, sizeof(list_source_t));
+    if (list == NULL) return NULL;
+
+    list->source.next = list_next_line;
+    list->cursor.admins = admins;
+    list->remaining = USER_LIST_PAGE_SIZE;
+
+    unsigned long page = 1;
+    int prefix_idx = 0;
+    if (req->argc > 0) {
+        char* end;
+        unsigned long n = strtoul(req->argv[0], &end, 10);
+        if (*end == '\0' && n > 0) {
+            page = n;
+            prefix_idx = 1;
         }
+    }
 
-        resp_batch_buf[admin_count] = compose_response(buf, message, "You're not authorized. Your details have been sent to house committee");
+    if (prefix_idx < req->argc) {
+        list->cursor.prefix = req->argv[prefix_idx];
+    }
+
+    if (!user_list_seek(&list->cursor, page - 1)) {
+        if (page == 1 && list->cursor.prefix == NULL) {
+            return compose_response(req, admins ? "No admins" : "No users");
+        }
+        return compose_response(req, arena_sprintf(req->arena, "No %s on page %lu", admins ? "admins" : "users", page));
+    }
+
+    char* text;
+    if (list->cursor.prefix == NULL) {
+        text = arena_sprintf(req->arena, "%s, page %lu of %u:\n", title, page, user_list_pages(admins));
     } else {
-        uint32_t min = tick_to_min(cfg_get_gate_lock_duration());
-        sprintf(resp_buf, "Welcome to Gate Keeper!\nHere you can:\n- open upper and lower gates\n- open and lock opened lower gate for %lu minutes. Don't forget to unlock it when you're done", min);
-        *resp_batch_buf = compose_response(buf, message, resp_buf);
+        text = arena_sprintf(req->arena, "%s starting with %s, page %lu:\n", title, list->cursor.prefix, page);
     }
 
-    return resp_batch_buf;
+    handler_response_t* resp = compose_response(req, text);
+    if (resp != NULL) {
+        resp->lines = &list->source;
+    }
+
+    return resp;
 }
 
-static handler_response_t* help_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t user = 0;
-    sscanf(&buf[token->start], "%lli", &user);
+// Telegram dates come from its servers, so the newest one is a lower bound of the current time
+// in case the clock restored from NVS at power on hasn't been corrected by SNTP yet
+static int64_t command_age(time_t date) {
+    if (date == 0) return 0;
 
-    if (!is_authorized(user)) {
-        *resp_batch_buf = compose_response(buf, message, "You're not authorized. Contact house committee");
-    } else {
-        sprintf(resp_buf, "Gate Keeper allows you to:\n- open upper gate\n- open lower gate\n- lock the lower gate opened and unlock later\n- get status of the lower gate.\n\nIf you have any questions contact house committee.");
-        *resp_batch_buf = compose_response(buf, message, resp_buf);
+    time_t now = time(NULL);
+    if (latest_date > now) {
+        now = latest_date;
     }
 
-    return resp_batch_buf;
+    return now - date;
 }
 
-static handler_response_t* settings_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t user = 0;
-    sscanf(&buf[token->start], "%lli", &user);
+static chat_ack_t* get_chat_ack(arena_t* arena, const char* chat_id) {
+    chat_ack_t* ack = chat_acks;
+    while (ack != NULL && strcmp(ack->chat_id, chat_id)) {
+        ack = ack->next;
+    }
 
-    if (!is_authorized(user)) {
-        *resp_batch_buf = compose_response(buf, message, "You're not authorized. Contact house committee");
-    } else {
-        uint32_t min = tick_to_min(cfg_get_gate_lock_duration());
-        int32_t n = sprintf(resp_buf, "Gate Keeper settings:\n- lower gate lock period: %lu min", min);
-        if (is_admin(user)) {
-            sprintf(&resp_buf[n], "\n- polling period (" CMD_CFGGATEPOLL "): %lu msec\n- open pulse duration (" CMD_CFGOPENPULSEDURATION "): %lu msec\n- open cycle duration (" CMD_CFGOPENDURATION "): %lu msec\n- lock period duration (" CMD_CFGLOCKDURATION "): %lu msec\n- open level (" CMD_CFGOPENLEVEL "): %s",
-                pdTICKS_TO_MS(cfg_get_gate_poll()), pdTICKS_TO_MS(cfg_get_gate_open_pulse_duration()), pdTICKS_TO_MS(cfg_get_gate_open_duration()), pdTICKS_TO_MS(cfg_get_gate_lock_duration()), cfg_get_open_gate_level() ? "high" : "low");
+    if (ack == NULL) {
+        ack = arena_calloc(arena, 1, sizeof(chat_ack_t));
+        if (ack == NULL) return NULL;
+
+        ack->chat_id = chat_id;
+        ack->next = chat_acks;
+        chat_acks = ack;
+    }
+
+    return ack;
+}
+
+// Queues the gate command for the batch. The gate is driven and the command acknowledged by gk_batch_handler()
+static handler_response_t* request_gate(request_ctx_t* req, gate_t gate, gate_action_t action) {
+    if (req->role == ROLE_USER && action != GATE_ACTION_UNLOCK && !is_authorized(req->user_id)) {
+        return compose_response(req, "Your access is limited to scheduled hours. Contact house committee");
+    }
+
+    // Unlocking only shortens what an earlier command did, so it is never throttled
+    if (action != GATE_ACTION_UNLOCK) {
+        uint32_t retry_after;
+        switch (rate_limit_take(req->user_id, gate, &retry_after)) {
+        case RATE_LIMIT_PASSED:
+            break;
+        case RATE_LIMIT_THROTTLED:
+            return compose_response(req, arena_sprintf(req->arena, "Too many gate commands. Try again in %lu sec", retry_after));
+        case RATE_LIMIT_THROTTLED_AGAIN:
+            return NULL; // the sender has been told already
         }
-        *resp_batch_buf = compose_response(buf, message, resp_buf);
     }
 
-    return resp_batch_buf;
+    // The opening is only taken from the guest's allowance once the command is submitted
+    if (req->role == ROLE_GUEST && action != GATE_ACTION_UNLOCK && !guest_can_open(req->user_id)) {
+        rate_limit_refund(req->user_id, gate);
+        return compose_response(req, "Your guest access has ended. Contact house committee");
+    }
+
+    gate_command_t* command = arena_calloc(req->arena, 1, sizeof(gate_command_t));
+    if (command == NULL) {
+        if (action != GATE_ACTION_UNLOCK) rate_limit_refund(req->user_id, gate);
+        return NULL;
+    }
+
+    command->gate = gate;
+    command->action = action;
+    command->user_id = req->user_id;
+    command->date = req->date;
+    command->received_at = esp_timer_get_time();
+    command->guest = req->role == ROLE_GUEST;
+    command->ack = get_chat_ack(req->arena, req->chat_id);
+    if (command->ack == NULL) {
+        if (action != GATE_ACTION_UNLOCK) rate_limit_refund(req->user_id, gate);
+        return NULL;
+    }
+
+    *gate_commands_tail = command;
+    gate_commands_tail = &command->next;
+
+    return NULL;
 }
 
-static handler_response_t* open_upper_gate_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t user = 0;
-    sscanf(&buf[token->start], "%lli", &user);
+static char* compose_ack(arena_t* arena, chat_ack_t* ack, bool store_failed) {
+    uint32_t actions = ack->actions;
+    char* text = "";
+    for (size_t gate = 0; gate < gate_count() && text != NULL; gate++) {
+        const gate_config_t* gate_config = gate_get(gate);
+        char initial = name_initial(gate_config->name);
+        const char* rest = &gate_config->name[1];
+        if (actions & ACK_BIT(gate, GATE_ACTION_UNLOCK)) {
+            text = arena_append(arena, text, "%s%s has been unlocked", *text ? "\n" : "", gate_config->name);
+        } else if (ack->failed_actions & ACK_BIT(gate, GATE_ACTION_UNLOCK)) {
+            text = arena_append(arena, text, "%sFailed to unlock %c%s. Try again", *text ? "\n" : "", initial, rest);
+        }
+        if (text == NULL) break;
+
+        const char* sep = *text ? "\n" : "";
+        if (actions & ACK_BIT(gate, GATE_ACTION_LOCK)) {
+            uint32_t min = tick_to_min(gate_config->lock_duration);
+            text = arena_append(arena, text, "%s%s has been opened and locked for %lu minutes. Don't forget to unlock it when you're done", sep, gate_config->name, min);
+        } else if (actions & ACK_BIT(gate, GATE_ACTION_OPEN)) {
+            text = arena_append(arena, text, "%s%s has been opened", sep, gate_config->name);
+        } else if (ack->failed_actions & (ACK_BIT(gate, GATE_ACTION_OPEN) | ACK_BIT(gate, GATE_ACTION_LOCK))) {
+            text = arena_append(arena, text, "%sFailed to open %c%s. Try again", sep, initial, rest);
+        }
+    }
+
+    if (text != NULL && ack->stale_age > 0) {
+        text = arena_append(arena, text, "%sGate command sent %lli min ago was not executed. Send it again if you still need it",
+            *text ? "\n" : "", (ack->stale_age + 30) / 60);
+    }
+    if (text != NULL && ack->changed && store_failed) {
+        text = arena_append(arena, text, "%sFailed to store the changes, they will be lost on restart", *text ? "\n" : "");
+    }
+
+    return text;
+}
+
+static handler_response_t* start_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
+
+    if (req->role == ROLE_NONE) {
+        int64_t admins[MAX_ADMINS];
+        size_t admin_count = get_admin_ids(admins, MAX_ADMINS);
+
+        const char* first_name = &buf[req->message->from->first_name->start]; // mandatory field
+        const char* last_name = req->message->from->last_name ? &buf[req->message->from->last_name->start] : ""; // optional field
+        const char* username = req->message->from->username ? &buf[req->message->from->username->start] : ""; // optional field
 
-    if (!is_authorized(user)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized");
+        char* alert = arena_sprintf(req->arena, "🚨 Unauthorized user has started Gate Keeper bot:\nUser ID: %lli\nUsername: %s\nFirst name: %s\nLast name: %s\n\n⚠️ Verify the user before authorizing them.",
+            req->user_id, username, first_name, last_name);
+
+        resp = arena_calloc(req->arena, admin_count + 2, sizeof(handler_response_t));
+        if (resp == NULL || alert == NULL) return NULL;
+
+        for (size_t i = 0; i < admin_count; i++) {
+            resp[i].chat_id = arena_sprintf(req->arena, "%lli", admins[i]);
+            resp[i].text = alert;
+            resp[i].broadcast = true;
+            if (resp[i].chat_id == NULL) return NULL;
+        }
+
+        resp[admin_count].chat_id = req->chat_id;
+        resp[admin_count].text = "You're not authorized. Your details have been sent to house committee";
+        resp[admin_count].delivery_report = true;
     } else {
-        gate_delay_t gate_delay = {
-            .delay = cfg_get_gate_open_duration(),
-            .gate = UPPER_GATE,
-        };
-        xQueueSend(open_queue, &gate_delay, GK_OPEN_QUEUE_TIMEOUT);
+        char* text = arena_sprintf(req->arena, "Welcome to Gate Keeper!\nHere you can:\n- open the gates");
+        for (size_t gate = 0; gate < gate_count() && text != NULL; gate++) {
+            const gate_config_t* gate_config = gate_get(gate);
+            if (gate_config->lock_duration == 0) continue;
 
-        *resp_batch_buf = compose_response(buf, message, "Upper gate has been opened");
+            text = arena_append(req->arena, text, "\n- open and lock %c%s for %lu minutes. Don't forget to unlock it when you're done",
+                name_initial(gate_config->name), &gate_config->name[1], tick_to_min(gate_config->lock_duration));
+        }
+        resp = compose_response(req, text);
     }
 
-    return resp_batch_buf;
+    return resp;
 }
 
-static handler_response_t* open_lower_gate_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t user = 0;
-    sscanf(&buf[token->start], "%lli", &user);
+static handler_response_t* help_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
 
-    if (!is_authorized(user)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized");
+    if (req->role == ROLE_NONE) {
+        resp = compose_response(req, "You're not authorized. Contact house committee");
     } else {
-        gate_delay_t gate_delay = {
-            .delay = cfg_get_gate_open_duration(),
-            .gate = LOWER_GATE,
-        };
-        xQueueSend(open_queue, &gate_delay, GK_OPEN_QUEUE_TIMEOUT);
-        *resp_batch_buf = compose_response(buf, message, "Lower gate has been opened");
+        char* text = arena_sprintf(req->arena, "Gate Keeper allows you to:");
+        for (size_t gate = 0; gate < gate_count() && text != NULL; gate++) {
+            const gate_config_t* gate_config = gate_get(gate);
+            char initial = name_initial(gate_config->name);
+            const char* rest = &gate_config->name[1];
+
+            text = arena_append(req->arena, text, "\n- open %c%s", initial, rest);
+            if (gate_config->lock_duration != 0) {
+                text = arena_append(req->arena, text, "\n- lock the %c%s opened and unlock later\n- get status of the %c%s", initial, rest, initial, rest);
+            }
+        }
+        text = arena_append(req->arena, text, "\n\nIf you have any questions contact house committee.");
+        resp = compose_response(req, text);
     }
 
-    return resp_batch_buf;
+    return resp;
 }
 
-static handler_response_t* open_and_lock_lower_gate_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t user = 0;
-    sscanf(&buf[token->start], "%lli", &user);
+static handler_response_t* settings_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
 
-    if (!is_authorized(user)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized");
+    if (req->role == ROLE_NONE) {
+        resp = compose_response(req, "You're not authorized. Contact house committee");
     } else {
-        gate_delay_t gate_delay = {
-            .delay = cfg_get_gate_lock_duration(),
-            .gate = LOWER_GATE,
-        };
-        xQueueSend(open_queue, &gate_delay, GK_OPEN_QUEUE_TIMEOUT);
-        uint32_t min = tick_to_min(cfg_get_gate_lock_duration());
-        sprintf(resp_buf, "Lower gate has been opened and locked for %lu minutes. Don't forget to unlock it when you're done", min);
-        *resp_batch_buf = compose_response(buf, message, resp_buf);
+        char* text = arena_sprintf(req->arena, "Gate Keeper settings:");
+        for (size_t gate = 0; gate < gate_count() && text != NULL; gate++) {
+            const gate_config_t* gate_config = gate_get(gate);
+            if (gate_config->lock_duration == 0) continue;
+
+            text = arena_append(req->arena, text, "\n- %c%s lock period: %lu min",
+                name_initial(gate_config->name), &gate_config->name[1], tick_to_min(gate_config->lock_duration));
+        }
+        if (req->role == ROLE_ADMIN) {
+            text = arena_append(req->arena, text, "\n- gates (" CMD_GATES "): %u%s\n- open pulse duration (" CMD_CFGOPENPULSEDURATION "): %lu msec\n- gate command stale window (" CMD_CFGSTALEWINDOW "): %lu sec\n- stale gate command policy (" CMD_CFGSTALEPOLICY "): %s",
+                gate_count(), gate_restart_pending() ? ", changed after restart" : "", pdTICKS_TO_MS(cfg_get_gate_open_pulse_duration()), cfg_get_stale_window(),
+                cfg_get_stale_policy() == STALE_POLICY_CONFIRM ? "confirm" : "drop");
+            text = arena_append(req->arena, text, "\n- user rate limit (" CMD_CFGUSERRATELIMIT "): %lu opens, 1 per %lu sec\n- gate rate limit (" CMD_CFGGATERATELIMIT "): %lu opens, 1 per %lu sec\n- throttled gate commands: %lu",
+                cfg_get_user_rate_burst(), cfg_get_user_rate_period(), cfg_get_gate_rate_burst(), cfg_get_gate_rate_period(), rate_limit_throttled());
+            text = arena_append(req->arena, text, "\n- gate commands by time from receipt to press:");
+            for (size_t i = 0; i < sizeof(latency_counts) / sizeof(latency_counts[0]) && text != NULL; i++) {
+                if (i < sizeof(latency_bounds) / sizeof(latency_bounds[0])) {
+                    text = arena_append(req->arena, text, "%s%lu under %lu ms", i ? ", " : " ", latency_counts[i], latency_bounds[i]);
+                } else {
+                    text = arena_append(req->arena, text, ", %lu longer", latency_counts[i]);
+                }
+            }
+        }
+        resp = compose_response(req, text);
     }
 
-    return resp_batch_buf;
+    return resp;
 }
 
-static handler_response_t* status_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t user = 0;
-    sscanf(&buf[token->start], "%lli", &user);
+// Returns the unit the age is counted in, with the count
+static const char* age_unit(int64_t us, int64_t* count) {
+    int64_t sec = us / 1000000;
+    if (sec < 120) {
+        *count = sec;
+        return "s";
+    }
+    if (sec < 7200) {
+        *count = sec / 60;
+        return "min";
+    }
+    *count = sec / 3600;
+    return "h";
+}
 
-    if (!is_authorized(user)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized");
-    } else {
-        int32_t lower_gate_time_left;
-        xQueuePeek(status_queue, &lower_gate_time_left, GK_OPEN_QUEUE_TIMEOUT);
-        if (lower_gate_time_left < 0) {
-            int32_t seconds_left = pdTICKS_TO_MS(-lower_gate_time_left) / 1000;
+// Reports every gate from the published snapshot, so it never waits for the gate task
+static handler_response_t* compose_status(request_ctx_t* req) {
+    gate_state_t states[MAX_GATES];
+    gate_status_get(states);
+
+    int64_t now = esp_timer_get_time();
+    char* text = "";
+    for (size_t gate = 0; gate < gate_count() && text != NULL; gate++) {
+        const char* name = gate_get(gate)->name;
+        gate_state_t* state = &states[gate];
+        const char* sep = *text ? "\n" : "";
+
+        int64_t time_left = state->close_at - now;
+        if (state->open && time_left > 0) {
+            int32_t seconds_left = time_left / 1000000;
             int32_t min = seconds_left / 60;
             int32_t sec = seconds_left % 60;
-            sprintf(resp_buf, "Lower gate status: %li m %li s left till closing\n", min, sec);
-            *resp_batch_buf = compose_response(buf, message, resp_buf);
+            text = arena_append(req->arena, text, "%s%s status: %li m %li s left till closing", sep, name, min, sec);
         } else {
-            *resp_batch_buf = compose_response(buf, message, "Lower gate is closed");
+            text = arena_append(req->arena, text, "%s%s is closed", sep, name);
+        }
+
+        if (state->pressed_at != 0) {
+            int64_t age;
+            const char* unit = age_unit(now - state->pressed_at, &age);
+            text = arena_append(req->arena, text, ", last pressed %lli %s ago", age, unit);
+        }
+        if (state->opened_by != 0 && req->role == ROLE_ADMIN) {
+            text = arena_append(req->arena, text, ", opened by %lli", state->opened_by);
         }
     }
 
-    return resp_batch_buf;
+    return compose_response(req, text);
 }
 
-static handler_response_t* unlock_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t user = 0;
-    sscanf(&buf[token->start], "%lli", &user);
+static handler_response_t* status_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
 
-    if (!is_authorized(user)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized");
+    if (req->role == ROLE_NONE) {
+        resp = compose_response(req, "Unauthorized");
     } else {
-        gate_delay_t unlock_gate = {
-            .delay = -1,
-            .gate = LOWER_GATE,
-        };
-        xQueueSend(open_queue, &unlock_gate, GK_OPEN_QUEUE_TIMEOUT);
-        *resp_batch_buf = compose_response(buf, message, "Gate has been unlocked");
+        resp = compose_status(req);
     }
 
-    return resp_batch_buf;
+    return resp;
 }
 
-static handler_response_t* add_user_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t admin_id = 0;
-    sscanf(&buf[token->start], "%lli", &admin_id);
+static handler_response_t* gate_button_handler(request_ctx_t* req, gate_t gate, gate_button_t button) {
+    handler_response_t* resp;
 
-    if (!is_admin(admin_id)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized to add user");
+    if (req->role == ROLE_NONE) {
+        resp = compose_response(req, "Unauthorized");
     } else {
-        token = message->text;
-        int64_t id = 0;
-        sscanf(&buf[token->start], CMD_ADDUSER " %lli", &id);
+        switch (button) {
+        case GATE_BUTTON_OPEN:
+            resp = request_gate(req, gate, GATE_ACTION_OPEN);
+            break;
+        case GATE_BUTTON_LOCK:
+            if (gate_get(gate)->lock_duration == 0) {
+                resp = compose_response(req, arena_sprintf(req->arena, "%s can't be locked", gate_get(gate)->name));
+            } else {
+                resp = request_gate(req, gate, GATE_ACTION_LOCK);
+            }
+            break;
+        case GATE_BUTTON_UNLOCK:
+            resp = request_gate(req, gate, GATE_ACTION_UNLOCK);
+            break;
+        default:
+            resp = compose_status(req);
+            break;
+        }
+    }
+
+    return resp;
+}
+
+static handler_response_t* add_user_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
+
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to add user");
+    } else {
+        int64_t id = arg_i64(req, 0);
 
         switch (user_add(id)) {
         case ESP_OK:
-            *resp_batch_buf = compose_response(buf, message, "Added user");
+            resp = compose_response(req, "Added user");
             break;
         case ESP_ERR_USR_ALREADY_EXISTS:
-            *resp_batch_buf = compose_response(buf, message, "User exists");
+            resp = compose_response(req, "User exists");
             break;
         case ESP_ERR_USR_NO_SPACE:
-            *resp_batch_buf = compose_response(buf, message, "Failed to add user: too many users");
+            resp = compose_response(req, arena_sprintf(req->arena, "Failed to add user: the store is full at %u users", MAX_USERS));
             break;
         default:
-            *resp_batch_buf = compose_response(buf, message, "Unknown error");
+            resp = compose_response(req, "Unknown error");
             break;
         }
     }
 
-    return resp_batch_buf;
+    return resp;
 }
 
-static handler_response_t* drop_user_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t admin_id = 0;
-    sscanf(&buf[token->start], "%lli", &admin_id);
+static handler_response_t* drop_user_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
 
-    if (!is_admin(admin_id)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized to drop user");
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to drop user");
     } else {
-        token = message->text;
-        int64_t id = 0;
-        sscanf(&buf[token->start], CMD_DROPUSER " %lli", &id);
+        int64_t id = arg_i64(req, 0);
 
         switch (user_drop(id)) {
         case ESP_OK:
-            sprintf(resp_buf, "Dropped user %lli", id);
-            *resp_batch_buf = compose_response(buf, message, resp_buf);
+            resp = compose_response(req, arena_sprintf(req->arena, "Dropped user %lli", id));
+            break;
+        case ESP_ERR_NOT_FOUND:
+            resp = compose_response(req, "User not found");
+            break;
+        default:
+            resp = compose_response(req, "Unknown error");
+            break;
+        }
+    }
+
+    return resp;
+}
+
+static handler_response_t* list_users_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
+
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to list users");
+    } else {
+        resp = compose_list(req, false);
+    }
+
+    return resp;
+}
+
+// Adds every ID of the message in one go: the IDs may be separated by spaces, commas or new lines. The users are
+// persisted together by the flush at the end of the batch
+static handler_response_t* import_users_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
+
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to import users");
+    } else {
+        jsmntok_t* text = req->message->text;
+        const char* p = &buf[text->start + sizeof(CMD_IMPORTUSERS) - 1];
+        const char* end = &buf[text->end];
+        size_t added = 0, skipped = 0, invalid = 0, no_space = 0;
+
+        while (p < end) {
+            // The text is raw JSON, so new lines come as escape sequences. Arguments are split by '\0' already
+            if (*p == ' ' || *p == ',' || *p == ';' || *p == '\0') {
+                p++;
+                continue;
+            }
+            if (*p == '\\' && p + 1 < end) {
+                p += 2;
+                continue;
+            }
+
+            const char* token = p;
+            while (p < end && *p != ' ' && *p != ',' && *p != ';' && *p != '\0' && *p != '\\') p++;
+
+            char* token_end;
+            int64_t id = strtoll(token, &token_end, 10);
+            if (token_end != p) {
+                invalid++;
+                continue;
+            }
+
+            switch (user_import(id)) {
+            case ESP_OK:
+                added++;
+                break;
+            case ESP_ERR_USR_ALREADY_EXISTS:
+                skipped++;
+                break;
+            case ESP_ERR_USR_NO_SPACE:
+                no_space++;
+                break;
+            default:
+                invalid++;
+                break;
+            }
+        }
+
+        char* report = arena_sprintf(req->arena, "Imported users: %u added, %u skipped, %u invalid", added, skipped, invalid);
+        if (no_space > 0) {
+            report = arena_append(req->arena, report, ", %u not added: the store is full at %u users", no_space, MAX_USERS);
+        }
+        resp = compose_response(req, report);
+    }
+
+    return resp;
+}
+
+static size_t export_next_line(tg_line_source_t* source, char* buf, size_t buf_size) {
+    list_source_t* list = (list_source_t*)source;
+
+    return user_export_next(&list->cursor, buf, buf_size);
+}
+
+// Sends the IDs of all users in the format /importusers takes
+static handler_response_t* export_users_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
+
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to export users");
+    } else if (user_count() == 0) {
+        resp = compose_response(req, "No users");
+    } else {
+        list_source_t* list = arena_calloc(req->arena, 1, sizeof(list_source_t));
+        resp = list ? compose_response(req, CMD_IMPORTUSERS "\n") : NULL;
+        if (resp != NULL) {
+            list->source.next = export_next_line;
+            resp->lines = &list->source;
+        }
+    }
+
+    return resp;
+}
+
+// Grants access for the given number of hours and optionally a limited number of gate openings
+static handler_response_t* add_guest_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
+
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to add guest");
+    } else {
+        int64_t id = arg_i64(req, 0);
+        uint32_t hours = arg_u32(req, 1);
+        uint32_t opens = req->argc > 2 ? arg_u32(req, 2) : GUEST_UNLIMITED_OPENS;
+
+        if (hours == 0 || hours > GUEST_MAX_HOURS) {
+            resp = compose_response(req, arena_sprintf(req->arena, "Usage: " CMD_ADDGUEST " <id> <hours, up to %u> [gate openings]", GUEST_MAX_HOURS));
+        } else if (opens == 0 || opens > GUEST_UNLIMITED_OPENS) {
+            resp = compose_response(req, "Wrong number of gate openings");
+        } else if (is_admin(id) || is_user(id)) {
+            resp = compose_response(req, "User exists");
+        } else {
+            switch (guest_add(id, hours * 3600, opens)) {
+            case ESP_OK:
+                resp = compose_response(req, arena_sprintf(req->arena, "Added guest %lli for %lu h", id, hours));
+                break;
+            case ESP_ERR_USR_NO_SPACE:
+                resp = compose_response(req, "Failed to add guest: too many guests");
+                break;
+            case ESP_ERR_USR_WRONG_ID:
+                resp = compose_response(req, "Wrong user ID");
+                break;
+            default:
+                resp = compose_response(req, "Unknown error");
+                break;
+            }
+        }
+    }
+
+    return resp;
+}
+
+static handler_response_t* drop_guest_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
+
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to drop guest");
+    } else {
+        int64_t id = arg_i64(req, 0);
+
+        switch (guest_drop(id)) {
+        case ESP_OK:
+            resp = compose_response(req, arena_sprintf(req->arena, "Dropped guest %lli", id));
             break;
         case ESP_ERR_NOT_FOUND:
-            *resp_batch_buf = compose_response(buf, message, "User not found");
+            resp = compose_response(req, "Guest not found");
             break;
         default:
-            *resp_batch_buf = compose_response(buf, message, "Unknown error");
+            resp = compose_response(req, "Unknown error");
             break;
         }
     }
 
-    return resp_batch_buf;
+    return resp;
+}
+
+static size_t guest_next_line(tg_line_source_t* source, char* buf, size_t buf_size) {
+    guest_source_t* guests = (guest_source_t*)source;
+    guest_info_t info;
+
+    if (!guest_list_next(&guests->pos, &info)) return 0;
+
+    int64_t left = (info.expires_at - time(NULL)) / 60;
+    if (left < 0) {
+        left = 0;
+    }
+
+    int n;
+    if (info.opens_left == GUEST_UNLIMITED_OPENS) {
+        n = snprintf(buf, buf_size, "id: %lli, expires in %lli h %lli min\n", info.id, left / 60, left % 60);
+    } else {
+        n = snprintf(buf, buf_size, "id: %lli, expires in %lli h %lli min, openings left: %u\n", info.id, left / 60, left % 60, info.opens_left);
+    }
+
+    return n < 0 ? 0 : n < buf_size ? n : buf_size - 1;
 }
 
-static handler_response_t* list_users_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t admin_id = 0;
-    sscanf(&buf[token->start], "%lli", &admin_id);
+static handler_response_t* list_guests_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
 
-    if (!is_admin(admin_id)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized to list users");
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to list guests");
+    } else if (guest_count() == 0) {
+        resp = compose_response(req, "No guests");
     } else {
-        *resp_batch_buf = compose_response(buf, message, users_list(resp_buf, sizeof(resp_buf)));
+        guest_source_t* guests = arena_calloc(req->arena, 1, sizeof(guest_source_t));
+        resp = guests ? compose_response(req, arena_sprintf(req->arena, "Guests (%u):\n", guest_count())) : NULL;
+        if (resp != NULL) {
+            guests->source.next = guest_next_line;
+            resp->lines = &guests->source;
+        }
     }
 
-    return resp_batch_buf;
+    return resp;
 }
 
-static handler_response_t* add_admin_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t admin_id = 0;
-    sscanf(&buf[token->start], "%lli", &admin_id);
+static handler_response_t* add_admin_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
 
-    if (!is_admin(admin_id)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized to add admin");
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to add admin");
     } else {
-        token = message->text;
-        int64_t id = 0;
-        sscanf(&buf[token->start], CMD_ADDADMIN " %lli", &id);
+        int64_t id = arg_i64(req, 0);
 
         switch (admin_add(id)) {
         case ESP_OK:
-            *resp_batch_buf = compose_response(buf, message, "Added admin");
+            resp = compose_response(req, "Added admin");
             break;
         case ESP_ERR_USR_ALREADY_EXISTS:
-            *resp_batch_buf = compose_response(buf, message, "Admin exists");
+            resp = compose_response(req, "Admin exists");
             break;
         case ESP_ERR_USR_NO_SPACE:
-            *resp_batch_buf = compose_response(buf, message, "Failed to add admin: too many admins");
+            resp = compose_response(req, "Failed to add admin: too many admins");
             break;
         case ESP_ERR_USR_WRONG_ID:
-            *resp_batch_buf = compose_response(buf, message, "Wrong ID");
+            resp = compose_response(req, "Wrong ID");
             break;
         default:
-            *resp_batch_buf = compose_response(buf, message, "Unknown error");
+            resp = compose_response(req, "Unknown error");
             break;
         }
     }
 
-    return resp_batch_buf;
+    return resp;
 }
 
-static handler_response_t* drop_admin_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t admin_id = 0;
-    sscanf(&buf[token->start], "%lli", &admin_id);
+static handler_response_t* drop_admin_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
 
-    if (!is_admin(admin_id)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized to drop admin");
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to drop admin");
     } else {
-        token = message->text;
-        int64_t id = 0;
-        sscanf(&buf[token->start], CMD_DROPADMIN " %lli", &id);
+        int64_t id = arg_i64(req, 0);
 
         if (admin_count() < 2) {
-            *resp_batch_buf = compose_response(buf, message, "At least one admin should remain");
+            resp = compose_response(req, "At least one admin should remain");
         } else {
             switch (admin_drop(id)) {
             case ESP_OK:
-                sprintf(resp_buf, "Dropped admin %lli", id);
-                *resp_batch_buf = compose_response(buf, message, resp_buf);
+                resp = compose_response(req, arena_sprintf(req->arena, "Dropped admin %lli", id));
                 break;
             case ESP_ERR_NOT_FOUND:
-                *resp_batch_buf = compose_response(buf, message, "Admin not found");
+                resp = compose_response(req, "Admin not found");
                 break;
             default:
-                *resp_batch_buf = compose_response(buf, message, "Unknown error");
+                resp = compose_response(req, "Unknown error");
                 break;
             }
         }
     }
 
-    return resp_batch_buf;
+    return resp;
 }
 
-static handler_response_t* list_admins_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t admin_id = 0;
-    sscanf(&buf[token->start], "%lli", &admin_id);
+static handler_response_t* list_admins_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
 
-    if (!is_admin(admin_id)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized to list admins");
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to list admins");
     } else {
-        *resp_batch_buf = compose_response(buf, message, admins_list(resp_buf, sizeof(resp_buf)));
+        resp = compose_list(req, true);
     }
 
-    return resp_batch_buf;
+    return resp;
 }
 
-static handler_response_t* gate_poll_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t admin_id = 0;
-    sscanf(&buf[token->start], "%lli", &admin_id);
+static handler_response_t* open_pulse_duration_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
 
-    if (!is_admin(admin_id)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized to set duration");
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to set duration");
     } else {
-        token = message->text;
-        uint32_t period = 0;
-        sscanf(&buf[token->start], CMD_CFGGATEPOLL " %lu", &period);
+        uint32_t duration = arg_u32(req, 0);
 
-        if (period == 0) {
-            sprintf(resp_buf, "Gate polling period: %lu msec", pdTICKS_TO_MS(cfg_get_gate_poll()));
-            *resp_batch_buf = compose_response(buf, message, resp_buf);
+        if (duration == 0) {
+            resp = compose_response(req, arena_sprintf(req->arena, "Gate open pulse duration: %lu msec", pdTICKS_TO_MS(cfg_get_gate_open_pulse_duration())));
         } else {
-            if (cfg_set_gate_poll(pdMS_TO_TICKS(period)) == ESP_OK) {
-                sprintf(resp_buf, "Gate polling period set %lu msec", period);
-                *resp_batch_buf = compose_response(buf, message, resp_buf);
+            if (cfg_set_gate_open_pulse_duration(pdMS_TO_TICKS(duration)) == ESP_OK) {
+                resp = compose_response(req, arena_sprintf(req->arena, "Gate open pulse duration set %lu msec", duration));
             } else {
-                *resp_batch_buf = compose_response(buf, message, "Failed to set duration");
+                resp = compose_response(req, "Failed to set duration");
             }
         }
     }
 
-    return resp_batch_buf;
+    return resp;
 }
 
-static handler_response_t* open_pulse_duration_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t admin_id = 0;
-    sscanf(&buf[token->start], "%lli", &admin_id);
+static handler_response_t* stale_window_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
 
-    if (!is_admin(admin_id)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized to set duration");
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to set duration");
     } else {
-        token = message->text;
-        uint32_t duration = 0;
-        sscanf(&buf[token->start], CMD_CFGOPENPULSEDURATION " %lu", &duration);
+        uint32_t window = arg_u32(req, 0);
 
-        if (duration == 0) {
-            sprintf(resp_buf, "Gate open pulse duration: %lu msec", pdTICKS_TO_MS(cfg_get_gate_open_pulse_duration()));
-            *resp_batch_buf = compose_response(buf, message, resp_buf);
+        if (window == 0) {
+            resp = compose_response(req, arena_sprintf(req->arena, "Gate command stale window: %lu sec", cfg_get_stale_window()));
         } else {
-            if (cfg_set_gate_open_pulse_duration(pdMS_TO_TICKS(duration)) == ESP_OK) {
-                sprintf(resp_buf, "Gate open pulse duration set %lu msec", duration);
-                *resp_batch_buf = compose_response(buf, message, resp_buf);
+            if (cfg_set_stale_window(window) == ESP_OK) {
+                resp = compose_response(req, arena_sprintf(req->arena, "Gate command stale window set %lu sec", window));
             } else {
-                *resp_batch_buf = compose_response(buf, message, "Failed to set duration");
+                resp = compose_response(req, "Failed to set duration");
             }
         }
     }
 
-    return resp_batch_buf;
+    return resp;
 }
 
-static handler_response_t* open_duration_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t admin_id = 0;
-    sscanf(&buf[token->start], "%lli", &admin_id);
+static handler_response_t* stale_policy_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
 
-    if (!is_admin(admin_id)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized to set duration");
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to set policy");
     } else {
-        token = message->text;
-        uint32_t duration = 0;
-        sscanf(&buf[token->start], CMD_CFGOPENDURATION " %lu", &duration);
+        uint32_t policy = arg_u32(req, 0) > 0 ? STALE_POLICY_CONFIRM : STALE_POLICY_DROP;
 
-        if (duration == 0) {
-            sprintf(resp_buf, "Gate open cycle duration: %lu msec", pdTICKS_TO_MS(cfg_get_gate_open_duration()));
-            *resp_batch_buf = compose_response(buf, message, resp_buf);
+        if (req->argc == 0) {
+            resp = compose_response(req, arena_sprintf(req->arena, "Stale gate command policy: %s", cfg_get_stale_policy() == STALE_POLICY_CONFIRM ? "confirm" : "drop"));
         } else {
-            if (cfg_set_gate_open_duration(pdMS_TO_TICKS(duration)) == ESP_OK) {
-                sprintf(resp_buf, "Gate open cycle duration set %lu msec", duration);
-                *resp_batch_buf = compose_response(buf, message, resp_buf);
+            if (cfg_set_stale_policy(policy) == ESP_OK) {
+                resp = compose_response(req, arena_sprintf(req->arena, "Stale gate command policy set %s", policy == STALE_POLICY_CONFIRM ? "confirm" : "drop"));
             } else {
-                *resp_batch_buf = compose_response(buf, message, "Failed to set duration");
+                resp = compose_response(req, "Failed to set policy");
             }
         }
     }
 
-    return resp_batch_buf;
+    return resp;
 }
 
-static handler_response_t* lock_duration_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t admin_id = 0;
-    sscanf(&buf[token->start], "%lli", &admin_id);
+// Shows or sets a rate limit: the number of opens that may be sent at once and the period one of them is regained in
+static handler_response_t* rate_limit_handler(request_ctx_t* req, const char* name, uint32_t burst, uint32_t period,
+    esp_err_t (*set_burst)(uint32_t), esp_err_t (*set_period)(uint32_t)) {
+    handler_response_t* resp;
 
-    if (!is_admin(admin_id)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized to set duration");
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to set rate limit");
+    } else if (req->argc == 0) {
+        resp = compose_response(req, arena_sprintf(req->arena, "%s rate limit: %lu opens, 1 per %lu sec\nThrottled gate commands: %lu", name, burst, period, rate_limit_throttled()));
     } else {
-        token = message->text;
-        uint32_t duration = 0;
-        sscanf(&buf[token->start], CMD_CFGLOCKDURATION " %lu", &duration);
+        uint32_t new_burst = arg_u32(req, 0);
+        uint32_t new_period = req->argc > 1 ? arg_u32(req, 1) : period;
 
-        if (duration == 0) {
-            sprintf(resp_buf, "Gate lock period duration: %lu msec", pdTICKS_TO_MS(cfg_get_gate_lock_duration()));
-            *resp_batch_buf = compose_response(buf, message, resp_buf);
+        if (new_burst == 0) {
+            resp = compose_response(req, "Burst must be at least 1 open");
+        } else if (set_burst(new_burst) == ESP_OK && set_period(new_period) == ESP_OK) {
+            resp = compose_response(req, arena_sprintf(req->arena, "%s rate limit set %lu opens, 1 per %lu sec", name, new_burst, new_period));
         } else {
-            if (cfg_set_gate_lock_duration(pdMS_TO_TICKS(duration)) == ESP_OK) {
-                sprintf(resp_buf, "Gate lock period duration set %lu msec", duration);
-                *resp_batch_buf = compose_response(buf, message, resp_buf);
-            } else {
-                *resp_batch_buf = compose_response(buf, message, "Failed to set duration");
+            resp = compose_response(req, "Failed to set rate limit");
+        }
+    }
+
+    return resp;
+}
+
+static handler_response_t* user_rate_limit_handler(const char* const buf, request_ctx_t* req) {
+    return rate_limit_handler(req, "User", cfg_get_user_rate_burst(), cfg_get_user_rate_period(), cfg_set_user_rate_burst, cfg_set_user_rate_period);
+}
+
+static handler_response_t* gate_rate_limit_handler(const char* const buf, request_ctx_t* req) {
+    return rate_limit_handler(req, "Gate", cfg_get_gate_rate_burst(), cfg_get_gate_rate_period(), cfg_set_gate_rate_burst, cfg_set_gate_rate_period);
+}
+
+// Shows or sets the hours of a schedule, see schedule_compile() for the format
+static handler_response_t* schedule_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
+
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to set schedule");
+    } else {
+        uint32_t schedule = arg_u32(req, 0);
+        week_schedule_t week;
+
+        if (schedule == SCHEDULE_ALWAYS || schedule >= MAX_SCHEDULES) {
+            resp = compose_response(req, arena_sprintf(req->arena, "Usage: " CMD_CFGSCHEDULE " <schedule, 1 to %u> [days/hours, e.g. mon-fri/8-18,sat/10-14]", MAX_SCHEDULES - 1));
+        } else if (req->argc == 1) {
+            char* text = arena_alloc(req->arena, SCHEDULE_TEXT_MAX_LEN);
+            if (text == NULL) return NULL;
+
+            schedule_format(schedule_get(schedule), text, SCHEDULE_TEXT_MAX_LEN);
+            resp = compose_response(req, arena_sprintf(req->arena, "Schedule %lu: %s", schedule, text));
+        } else if (schedule_compile(req->argv[1], &week) != ESP_OK) {
+            resp = compose_response(req, "Wrong schedule format");
+        } else if (schedule_set(schedule, &week) == ESP_OK) {
+            resp = compose_response(req, arena_sprintf(req->arena, "Schedule %lu set %s", schedule, req->argv[1]));
+        } else {
+            resp = compose_response(req, "Failed to set schedule");
+        }
+    }
+
+    return resp;
+}
+
+static handler_response_t* user_schedule_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
+
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to set schedule");
+    } else {
+        int64_t id = arg_i64(req, 0);
+        uint32_t schedule = arg_u32(req, 1);
+        int current = user_get_schedule(id);
+
+        if (current < 0) {
+            resp = compose_response(req, "Usage: " CMD_USERSCHEDULE " <user id> [schedule, 0 for any time]");
+        } else if (req->argc == 1) {
+            resp = compose_response(req, current == SCHEDULE_ALWAYS
+                ? arena_sprintf(req->arena, "User %lli isn't scheduled", id)
+                : arena_sprintf(req->arena, "User %lli has schedule %i", id, current));
+        } else if (schedule >= MAX_SCHEDULES) {
+            resp = compose_response(req, "Wrong schedule");
+        } else if (user_set_schedule(id, schedule) == ESP_OK) {
+            resp = compose_response(req, arena_sprintf(req->arena, "User %lli schedule set %lu", id, schedule));
+        } else {
+            resp = compose_response(req, "Failed to set schedule");
+        }
+    }
+
+    return resp;
+}
+
+// Lists the stored gate table, which is the one in use unless it has been changed since the restart
+static handler_response_t* list_gates_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
+
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to list gates");
+    } else {
+        char* text = arena_sprintf(req->arena, "Gates%s:", gate_restart_pending() ? " after restart" : "");
+        for (size_t gate = 0; gate < gate_saved_count() && text != NULL; gate++) {
+            const gate_config_t* gate_config = gate_saved_get(gate);
+            text = arena_append(req->arena, text, "\n%u. %s: GPIO %u, open level %s, open %lu msec, lock %lu msec", gate + 1, gate_config->name, gate_config->pin,
+                gate_config->open_level ? "high" : "low", pdTICKS_TO_MS(gate_config->open_duration), pdTICKS_TO_MS(gate_config->lock_duration));
+        }
+        resp = compose_response(req, text);
+    }
+
+    return resp;
+}
+
+// Changes a gate or adds one after the last. Spaces can't be sent in an argument, so the name has underscores instead
+static handler_response_t* gate_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
+
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to set gate");
+    } else {
+        uint32_t gate = arg_u32(req, 0);
+
+        if (gate == 0 || gate > gate_saved_count() + 1 || gate > MAX_GATES || req->argc < 4 || strlen(req->argv[3]) >= GATE_NAME_MAX_LEN) {
+            resp = compose_response(req, arena_sprintf(req->arena, "Usage: " CMD_CFGGATE " <gate, 1 to %u> <GPIO> <open level, 0 or 1> <name, _ for spaces>", gate_saved_count() + 1));
+        } else {
+            gate_config_t gate_config = {
+                .open_duration = pdMS_TO_TICKS(2000),
+            };
+            if (gate <= gate_saved_count()) {
+                gate_config = *gate_saved_get(gate - 1);
+            }
+            uint32_t pin = arg_u32(req, 1);
+            gate_config.pin = pin < UINT8_MAX ? pin : UINT8_MAX; // not truncated onto a valid pin
+            gate_config.open_level = arg_u32(req, 2) > 0;
+            strcpy(gate_config.name, req->argv[3]);
+            for (char* p = gate_config.name; *p; p++) {
+                if (*p == '_') *p = ' ';
+            }
+
+            switch (gate_save(gate - 1, &gate_config)) {
+            case ESP_OK:
+                resp = compose_response(req, arena_sprintf(req->arena, "Gate %lu set %s on GPIO %u. Restart to apply", gate, gate_config.name, gate_config.pin));
+                break;
+            case ESP_ERR_INVALID_STATE:
+                resp = compose_response(req, "Another gate has this name or GPIO");
+                break;
+            default:
+                resp = compose_response(req, "Wrong GPIO or name, use letters, digits and dashes");
+                break;
             }
         }
     }
 
-    return resp_batch_buf;
+    return resp;
 }
 
-static handler_response_t* open_level_handler(const char* const buf, tg_message_t* message, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    jsmntok_t* token = message->from->id;
-    int64_t admin_id = 0;
-    sscanf(&buf[token->start], "%lli", &admin_id);
+static handler_response_t* gate_timing_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
 
-    if (!is_admin(admin_id)) {
-        *resp_batch_buf = compose_response(buf, message, "Unauthorized to set duration");
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to set duration");
     } else {
-        token = message->text;
-        uint32_t level = 0;
-        sscanf(&buf[token->start], CMD_CFGOPENLEVEL " %lu", &level);
-        level = level > 0;
-
-        if (token->end - token->start <= sizeof(CMD_CFGOPENLEVEL)) {
-            sprintf(resp_buf, "Gate open level: %s", cfg_get_open_gate_level() ? "high" : "low");
-            *resp_batch_buf = compose_response(buf, message, resp_buf);
+        uint32_t gate = arg_u32(req, 0);
+        uint32_t open_duration = arg_u32(req, 1);
+
+        if (gate == 0 || gate > gate_saved_count() || open_duration == 0) {
+            resp = compose_response(req, "Usage: " CMD_CFGGATETIMING " <gate> <open msec> [lock msec, 0 for none]");
         } else {
-            if (cfg_set_open_gate_level(level) == ESP_OK) {
-                sprintf(resp_buf, "Gate open level set %s", level ? "high" : "low");
-                *resp_batch_buf = compose_response(buf, message, resp_buf);
+            gate_config_t gate_config = *gate_saved_get(gate - 1);
+            gate_config.open_duration = pdMS_TO_TICKS(open_duration);
+            if (req->argc > 2) {
+                gate_config.lock_duration = pdMS_TO_TICKS(arg_u32(req, 2));
+            }
+
+            if (gate_save(gate - 1, &gate_config) == ESP_OK) {
+                resp = compose_response(req, arena_sprintf(req->arena, "%s open %lu msec, lock %lu msec. Restart to apply", gate_config.name,
+                    pdTICKS_TO_MS(gate_config.open_duration), pdTICKS_TO_MS(gate_config.lock_duration)));
             } else {
-                *resp_batch_buf = compose_response(buf, message, "Failed to set level");
+                resp = compose_response(req, "Failed to set duration");
             }
         }
     }
 
-    return resp_batch_buf;
+    return resp;
+}
+
+static handler_response_t* drop_gate_handler(const char* const buf, request_ctx_t* req) {
+    handler_response_t* resp;
+
+    if (req->role != ROLE_ADMIN) {
+        resp = compose_response(req, "Unauthorized to drop gate");
+    } else {
+        uint32_t gate = arg_u32(req, 0);
+
+        if (gate == 0 || gate > gate_saved_count()) {
+            resp = compose_response(req, "Usage: " CMD_DROPGATE " <gate>");
+        } else if (gate_drop(gate - 1) == ESP_OK) {
+            resp = compose_response(req, arena_sprintf(req->arena, "Gate %lu dropped. Restart to apply", gate));
+        } else {
+            resp = compose_response(req, "The last gate can't be dropped");
+        }
+    }
+
+    return resp;
+}
+
+// Parses a local date as YYYY-MM-DD and returns the start of the day the given number of days later
+static bool parse_date(const char* arg, int days, time_t* t) {
+    struct tm local = {};
+    int len = 0;
+    if (sscanf(arg, "%d-%d-%d%n", &local.tm_year, &local.tm_mon, &local.tm_mday, &len) != 3 || arg[len] != '\0') return false;
+
+    local.tm_year -= 1900;
+    local.tm_mon -= 1;
+    local.tm_mday += days;
+    local.tm_isdst = -1;
+    *t = mktime(&local);
+    return *t != -1;
+}
+
+static size_t event_next_line(tg_line_source_t* source, char* buf, size_t buf_size) {
+    static const char* const actions[] = { "open", "open and lock", "unlock" };
+    static const char* const results[] = { "done", "failed", "rejected", "stale", "cancelled" };
+    event_source_t* events = (event_source_t*)source;
+    if (!events->has_next) return 0;
+
+    if (events->remaining == 0) {
+        events->has_next = false;
+        return snprintf(buf, buf_size, "More events follow, narrow the range\n");
+    }
+    events->remaining--;
+
+    event_t* event = &events->next;
+    struct tm local;
+    char date[24];
+    localtime_r(&event->time, &local);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &local);
+
+    char gate[GATE_NAME_MAX_LEN];
+    if (event->gate < gate_count()) {
+        snprintf(gate, sizeof(gate), "%s", gate_get(event->gate)->name);
+    } else {
+        snprintf(gate, sizeof(gate), "Gate %u", event->gate + 1);
+    }
+
+    size_t len;
+    if (event->result == EVENT_RESULT_DONE && event->action != EVENT_ACTION_UNLOCK) {
+        len = snprintf(buf, buf_size, "%s %s %s by %lli: done in %lu ms\n", date, gate, actions[event->action % 3], event->user_id, event->latency);
+    } else {
+        len = snprintf(buf, buf_size, "%s %s %s by %lli: %s\n", date, gate, actions[event->action % 3], event->user_id, results[event->result % 5]);
+    }
+
+    events->has_next = evtlog_next(&events->cursor, &events->next);
+    return len < buf_size ? len : buf_size - 1;
+}
+
+// Lists the gate events of the last hours or of a range of days, of everyone or of a user
+static handler_response_t* events_handler(const char* const buf, request_ctx_t* req) {
+    if (req->role != ROLE_ADMIN) {
+        return compose_response(req, "Unauthorized to list events");
+    }
+
+    time_t now = time(NULL);
+    time_t from = now - EVENT_DEFAULT_HOURS * 3600;
+    time_t to = UINT32_MAX;
+    int idx = 0;
+    bool valid = true;
+    char* range = arena_sprintf(req->arena, "in the last %u hours", EVENT_DEFAULT_HOURS);
+
+    if (idx < req->argc && parse_date(req->argv[idx], 0, &from)) {
+        const char* last_day = req->argv[idx++];
+        if (idx < req->argc && strchr(req->argv[idx], '-') != NULL) {
+            last_day = req->argv[idx++];
+        }
+        valid = parse_date(last_day, 1, &to) && to > from;
+        range = arena_sprintf(req->arena, "from %s to %s", req->argv[0], last_day);
+    } else if (idx < req->argc) {
+        uint32_t hours = arg_u32(req, idx++);
+        valid = hours > 0 && strchr(req->argv[0], '-') == NULL;
+        from = now - hours * 3600LL;
+        range = arena_sprintf(req->arena, "in the last %lu hours", hours);
+    }
+
+    int64_t user_id = 0;
+    if (idx < req->argc) {
+        user_id = arg_i64(req, idx++);
+        valid = valid && user_id > 0;
+    }
+
+    if (!valid || idx < req->argc) {
+        return compose_response(req, "Usage: " CMD_EVENTS " [hours, 24 by default | first day YYYY-MM-DD [last day]] [user ID]");
+    }
+
+    event_source_t* events = arena_calloc(req->arena, 1, sizeof(event_source_t));
+    if (events == NULL || range == NULL) return NULL;
+
+    // The events waiting in RAM are written first, so that the listing is complete
+    evtlog_flush(true);
+    evtlog_seek(&events->cursor, from, to, user_id);
+    events->source.next = event_next_line;
+    events->remaining = EVENT_LIST_MAX_LEN;
+    events->has_next = evtlog_next(&events->cursor, &events->next);
+
+    char* user = user_id ? arena_sprintf(req->arena, " of %lli", user_id) : "";
+    if (user == NULL) return NULL;
+    if (!events->has_next) {
+        return compose_response(req, arena_sprintf(req->arena, "No gate events%s %s", user, range));
+    }
+
+    handler_response_t* resp = compose_response(req, arena_sprintf(req->arena, "Gate events%s %s:\n", user, range));
+    if (resp != NULL) {
+        resp->lines = &events->source;
+    }
+
+    return resp;
 }
 
 command_handler_t command_handlers[] = {
-    {"Open upper gate", open_upper_gate_handler},
-    {"Open lower gate", open_lower_gate_handler},
-    {"Open and lock lower gate", open_and_lock_lower_gate_handler},
-    {"Unlock lower gate", unlock_handler},
-    {"Lower gate status", status_handler},
 
     {CMD_START, start_handler},
     {CMD_ADDUSER, add_user_handler},
     {CMD_DROPUSER, drop_user_handler},
     {CMD_USERS, list_users_handler},
+    {CMD_IMPORTUSERS, import_users_handler},
+    {CMD_EXPORTUSERS, export_users_handler},
+    {CMD_ADDGUEST, add_guest_handler},
+    {CMD_DROPGUEST, drop_guest_handler},
+    {CMD_GUESTS, list_guests_handler},
     {CMD_ADDADMIN, add_admin_handler},
     {CMD_DROPADMIN, drop_admin_handler},
     {CMD_ADMINS, list_admins_handler},
-    {CMD_CFGGATEPOLL, gate_poll_handler},
     {CMD_CFGOPENPULSEDURATION, open_pulse_duration_handler},
-    {CMD_CFGOPENDURATION, open_duration_handler},
-    {CMD_CFGLOCKDURATION, lock_duration_handler},
-    {CMD_CFGOPENLEVEL, open_level_handler},
+    {CMD_GATES, list_gates_handler},
+    {CMD_CFGGATE, gate_handler},
+    {CMD_CFGGATETIMING, gate_timing_handler},
+    {CMD_DROPGATE, drop_gate_handler},
+    {CMD_CFGSTALEWINDOW, stale_window_handler},
+    {CMD_CFGSTALEPOLICY, stale_policy_handler},
+    {CMD_CFGUSERRATELIMIT, user_rate_limit_handler},
+    {CMD_CFGGATERATELIMIT, gate_rate_limit_handler},
+    {CMD_CFGSCHEDULE, schedule_handler},
+    {CMD_USERSCHEDULE, user_schedule_handler},
+    {CMD_EVENTS, events_handler},
     {"/help", help_handler},
     {"/settings", settings_handler},
+    {"/status", status_handler},
 };
 
-handler_response_t* gk_handler(char* buf, tg_update_t* update, QueueHandle_t open_queue, QueueHandle_t status_queue) {
-    tg_log_token(buf, "handling update", update->id);
+// Length of the character the JSON string text starts with: an escape sequence, taken with the low surrogate that
+// follows a high one, or a UTF-8 sequence
+static size_t json_char_len(const char* p, size_t len) {
+    size_t n = 1;
+    if (p[0] == '\\') {
+        n = len > 1 && p[1] == 'u' ? 6 : 2;
+        if (n == 6 && len >= 12 && (p[2] == 'd' || p[2] == 'D') && strchr("89abAB", p[3]) != NULL && p[6] == '\\' && p[7] == 'u') {
+            n = 12;
+        }
+    } else {
+        while (n < len && ((unsigned char)p[n] & 0xc0) == 0x80) n++;
+    }
 
-    jsmntok_t* text = update->message->text;
-    if (text == NULL) return NULL;
+    return n < len ? n : len;
+}
+
+// Copies a string token, truncated to the destination size. Profiles keep the raw JSON, they are sent back in JSON,
+// so the text is only cut between characters and never inside an escape sequence. A missing token gives an empty string
+static void copy_token(const char* buf, jsmntok_t* token, char* dst, size_t dst_size) {
+    size_t len = 0;
+    if (token != NULL) {
+        const char* src = &buf[token->start];
+        size_t src_len = token->end - token->start;
+        while (len < src_len) {
+            size_t n = json_char_len(&src[len], src_len - len);
+            if (len + n > dst_size - 1) break;
+            len += n;
+        }
+        memcpy(dst, src, len);
+    }
+    dst[len] = '\0';
+}
+
+static void build_request(char* buf, tg_message_t* message, arena_t* arena, request_ctx_t* req) {
+    req->message = message;
+    req->arena = arena;
+    req->user_id = 0;
+    if (message->from->id != NULL) {
+        req->user_id = strtoll(&buf[message->from->id->start], NULL, 10);
+    }
+    req->date = 0;
+    if (message->date != NULL) {
+        req->date = strtoll(&buf[message->date->start], NULL, 10);
+        if (req->date > latest_date) {
+            latest_date = req->date;
+        }
+    }
+    req->chat_id = &buf[message->chat->id->start];
+    req->role = user_role(req->user_id);
+    req->argc = 0;
+
+    if (req->role != ROLE_NONE) {
+        user_t usr = { .id = req->user_id };
+        copy_token(buf, message->from->username, usr.username, sizeof(usr.username));
+        copy_token(buf, message->from->first_name, usr.first_name, sizeof(usr.first_name));
+        copy_token(buf, message->from->last_name, usr.last_name, sizeof(usr.last_name));
+        user_profile_update(&usr);
+    }
+}
 
-    // Delete previous responses
-    memset(resp_batch_buf, 0, sizeof(resp_batch_buf));
+// Splits the text following the command into space separated arguments in place
+static void tokenize_args(char* buf, jsmntok_t* text, int offset, request_ctx_t* req) {
+    char* p = &buf[text->start + offset];
+    char* end = &buf[text->end];
 
+    while (p < end && req->argc < GK_MAX_ARGS) {
+        while (p < end && *p == ' ') p++;
+        if (p == end) break;
+
+        req->argv[req->argc++] = p;
+        while (p < end && *p != ' ') p++;
+        *p++ = '\0';
+    }
+}
+
+static handler_response_t* handle_request(char* buf, jsmntok_t* text, request_ctx_t* req) {
     int message_size = text->end - text->start;
+    gate_t gate;
+    gate_button_t button;
+    if (match_gate_button(&buf[text->start], message_size, &gate, &button)) {
+        return gate_button_handler(req, gate, button);
+    }
+
     for (int i = 0; i < sizeof(command_handlers) / sizeof(command_handlers[0]); i++) {
         int command_size = strlen(command_handlers[i].command);
 
-        if (!strncmp(command_handlers[i].command, &buf[text->start], command_size) && (command_size == message_size || buf[text->start + command_size] == ' ')) {
-            return command_handlers[i].handler(buf, update->message, open_queue, status_queue);
+        if (!strncmp(command_handlers[i].command, &buf[text->start], command_size) && (command_size == message_size || buf[text->start + command_size] == ' ' || buf[text->start + command_size] == '\\')) {
+            tokenize_args(buf, text, command_size, req);
+            uint32_t change_count = users_change_count() + guests_change_count() + cfg_change_count();
+            handler_response_t* resp = command_handlers[i].handler(buf, req);
+
+            // The changes are stored by gk_batch_handler(), which tells the chat if that fails. Changes left by
+            // earlier commands or by a failed flush are not this command's
+            if (users_change_count() + guests_change_count() + cfg_change_count() != change_count) {
+                chat_ack_t* ack = get_chat_ack(req->arena, req->chat_id);
+                if (ack != NULL) {
+                    ack->changed = true;
+                }
+            }
+            return resp;
         }
     }
 
     ESP_LOGE(TAG, "unknown command %.*s", message_size, &buf[text->start]);
 
-    *resp_batch_buf = compose_response(buf, update->message, "Unknown command");
+    return compose_response(req, "Unknown command");
+}
+
+handler_response_t* gk_handler(char* buf, tg_update_t* update, arena_t* arena) {
+    tg_log_token(buf, "handling update", update->id);
+
+    jsmntok_t* text = update->message->text;
+    if (text == NULL || update->message->chat->id == NULL) return NULL;
+
+    // Taken before the request is handled, so that a request left without a reply by a full arena gets a short error
+    handler_response_t* fallback = arena_calloc(arena, 2, sizeof(handler_response_t));
+    if (fallback == NULL) return NULL;
+
+    request_ctx_t req;
+    build_request(buf, update->message, arena, &req);
+
+    uint32_t failures = arena->failures;
+    handler_response_t* resp = handle_request(buf, text, &req);
+    if (resp == NULL && arena->failures != failures) {
+        fallback->chat_id = req.chat_id;
+        fallback->text = REPLY_FAILED_TEXT;
+        resp = fallback;
+    }
+
+    return resp;
+}
+
+static void record_latency(int64_t latency) {
+    size_t i = 0;
+    while (i < sizeof(latency_bounds) / sizeof(latency_bounds[0]) && latency >= latency_bounds[i] * 1000LL) {
+        i++;
+    }
+    latency_counts[i]++;
+
+    ESP_LOGI(TAG, "gate command pressed %lli ms after receipt", latency / 1000);
+}
+
+static void log_event(gate_t gate, gate_action_t action, int64_t user_id, time_t date, event_result_t result, uint32_t latency) {
+    event_t event = {
+        .time = date ? date : time(NULL),
+        .user_id = user_id,
+        .gate = gate,
+        .action = event_actions[action],
+        .result = result,
+        .latency = latency,
+    };
+    evtlog_add(&event);
+}
+
+// Submits the command to the gate task and keeps it until its outcome is known. Returns false if it can't be
+static bool submit_command(gate_command_t* command) {
+    bool charged = command->action != GATE_ACTION_UNLOCK;
+    bool unlock = command->action == GATE_ACTION_UNLOCK;
+
+    waiter_t* waiter = NULL;
+    for (size_t i = 0; i < WAITER_MAX_LEN && waiter == NULL; i++) {
+        if (waiters[i].awaiting == NULL) {
+            waiter = &waiters[i];
+        }
+    }
+
+    // A pending submission of the same kind for the gate shares its outcome with the command
+    awaiting_t* awaiting_command = latest_awaiting[command->gate];
+    int64_t pressed_at;
+    if (awaiting_command != NULL && (awaiting_command->command_id == 0 || awaiting_command->gate != command->gate || awaiting_command->unlock != unlock
+        || gate_command_outcome(awaiting_command->command_id, &pressed_at) != GATE_COMMAND_PENDING)) {
+        awaiting_command = NULL;
+    }
+    for (size_t i = 0; i < AWAITING_MAX_LEN && awaiting_command == NULL; i++) {
+        if (awaiting[i].command_id == 0) {
+            awaiting_command = &awaiting[i];
+        }
+    }
+
+    if (waiter == NULL || awaiting_command == NULL || strlen(command->ack->chat_id) > TG_CHAT_ID_MAX_LEN) {
+        ESP_LOGE(TAG, "gate %i: no room for command %i", command->gate, command->action);
+        return false;
+    }
+    // Earlier commands of the batch may have used up the allowance since the command was received
+    if (charged && command->guest && !guest_can_open(command->user_id)) {
+        ESP_LOGW(TAG, "gate %i: guest %lli has no openings left", command->gate, command->user_id);
+        return false;
+    }
+
+    int32_t delay = GATE_DELAY_UNLOCK;
+    if (command->action == GATE_ACTION_OPEN) {
+        delay = gate_get(command->gate)->open_duration;
+    } else if (command->action == GATE_ACTION_LOCK) {
+        delay = gate_get(command->gate)->lock_duration;
+    }
+
+    uint32_t command_id;
+    gate_submit_result_t result = gate_submit(command->gate, delay, command->user_id, &command_id);
+    if (result == GATE_SUBMIT_REJECTED) {
+        ESP_LOGE(TAG, "gate %i: command %i rejected", command->gate, command->action);
+        return false;
+    }
+    ESP_LOGI(TAG, "gate %i: command %lu %s", command->gate, command_id, result == GATE_SUBMIT_MERGED ? "merged" : "accepted");
+    if (charged && command->guest) {
+        guest_use_open(command->user_id);
+    }
+
+    // The gates take turns, so the first press of an open is due within a round of presses
+    int64_t pulse = pdTICKS_TO_MS(cfg_get_gate_open_pulse_duration()) * 1000LL;
+    awaiting_command->command_id = command_id;
+    awaiting_command->gate = command->gate;
+    awaiting_command->unlock = unlock;
+    awaiting_command->deadline = esp_timer_get_time() + 2 * gate_count() * pulse + GATE_COMPLETION_MARGIN_US;
+    latest_awaiting[command->gate] = awaiting_command;
+
+    waiter->awaiting = awaiting_command;
+    waiter->command_id = command_id;
+    waiter->action = command->action;
+    waiter->user_id = command->user_id;
+    waiter->date = command->date;
+    waiter->received_at = command->received_at;
+    strcpy(waiter->chat_id, command->ack->chat_id);
+
+    return true;
+}
+
+// Acknowledges the command with its own outcome, or with the one of its submission once its own is no longer kept.
+// Returns false if the acknowledgement doesn't fit the arena
+static bool ack_waiter(arena_t* arena, waiter_t* waiter, gate_command_outcome_t outcome, int64_t pressed_at) {
+    gate_t gate = waiter->awaiting->gate;
+
+    // The chat ID is copied, the slot may be taken again before the acknowledgement is sent
+    char* chat_id = arena_sprintf(arena, "%s", waiter->chat_id);
+    chat_ack_t* ack = chat_id != NULL ? get_chat_ack(arena, chat_id) : NULL;
+    if (ack == NULL) return false;
+
+    int64_t own_pressed_at;
+    gate_command_outcome_t own_outcome = gate_command_outcome(waiter->command_id, &own_pressed_at);
+    if (own_outcome != GATE_COMMAND_PENDING && own_outcome != GATE_COMMAND_UNKNOWN) {
+        outcome = own_outcome;
+        pressed_at = own_pressed_at;
+    }
+
+    uint32_t latency = 0;
+    event_result_t result = EVENT_RESULT_FAILED;
+    switch (outcome) {
+    case GATE_COMMAND_DONE:
+        ack->actions |= ACK_BIT(gate, waiter->action);
+        result = EVENT_RESULT_DONE;
+        // Merged commands share the press, which may have been before this one was received
+        if (waiter->action != GATE_ACTION_UNLOCK && pressed_at >= waiter->received_at) {
+            record_latency(pressed_at - waiter->received_at);
+            latency = (pressed_at - waiter->received_at) / 1000;
+        }
+        break;
+    case GATE_COMMAND_CANCELLED:
+        ESP_LOGI(TAG, "gate %u: command %lu cancelled by an unlock", gate, waiter->command_id);
+        result = EVENT_RESULT_CANCELLED;
+        break;
+    case GATE_COMMAND_PENDING:
+        ESP_LOGE(TAG, "gate %u: command %lu timed out", gate, waiter->command_id);
+        ack->failed_actions |= ACK_BIT(gate, waiter->action);
+        break;
+    default:
+        ESP_LOGW(TAG, "gate %u: closed before command %lu was carried out", gate, waiter->command_id);
+        ack->failed_actions |= ACK_BIT(gate, waiter->action);
+        break;
+    }
+
+    if (outcome != GATE_COMMAND_DONE && waiter->action != GATE_ACTION_UNLOCK) {
+        rate_limit_refund(waiter->user_id, gate);
+    }
+    log_event(gate, waiter->action, waiter->user_id, waiter->date, result, latency);
+    waiter->awaiting = NULL;
+
+    return true;
+}
+
+// Acknowledges the commands of the submissions whose outcome is known or that have waited too long. An open
+// cancelled by an unlock sent after it is left to the acknowledgement of the unlock
+static void ack_commands(arena_t* arena) {
+    int64_t now = esp_timer_get_time();
+    for (size_t i = 0; i < AWAITING_MAX_LEN; i++) {
+        awaiting_t* awaiting_command = &awaiting[i];
+        if (awaiting_command->command_id == 0) continue;
+
+        int64_t pressed_at;
+        gate_command_outcome_t outcome = gate_command_outcome(awaiting_command->command_id, &pressed_at);
+        if (outcome == GATE_COMMAND_PENDING && now < awaiting_command->deadline) continue;
+
+        bool acked = true;
+        for (size_t j = 0; j < WAITER_MAX_LEN; j++) {
+            if (waiters[j].awaiting == awaiting_command && !ack_waiter(arena, &waiters[j], outcome, pressed_at)) {
+                acked = false; // acknowledged with a later batch
+            }
+        }
+        if (acked) {
+            awaiting_command->command_id = 0;
+        }
+    }
+}
+
+// Runs after every batch of updates and whenever the gate task notifies the Telegram task between polls, so that
+// the commands carried out are acknowledged without waiting for them
+handler_response_t* gk_batch_handler(arena_t* arena) {
+    for (gate_command_t* command = gate_commands; command != NULL; command = command->next) {
+        int64_t age = command_age(command->date);
+        if (age > cfg_get_stale_window()) {
+            ESP_LOGI(TAG, "gate %i: stale command %i sent %lli s ago", command->gate, command->action, age);
+            if (cfg_get_stale_policy() == STALE_POLICY_CONFIRM && age > command->ack->stale_age) {
+                command->ack->stale_age = age;
+            }
+            log_event(command->gate, command->action, command->user_id, command->date, EVENT_RESULT_STALE, 0);
+        } else if (!submit_command(command)) {
+            command->ack->failed_actions |= ACK_BIT(command->gate, command->action);
+            log_event(command->gate, command->action, command->user_id, command->date, EVENT_RESULT_REJECTED, 0);
+        } else {
+            continue;
+        }
+
+        // The rate limit charged when the command was received is only kept for the commands submitted
+        if (command->action != GATE_ACTION_UNLOCK) {
+            rate_limit_refund(command->user_id, command->gate);
+        }
+    }
+
+    // Changes made by the handlers of the batch are committed together, before any of them is acknowledged
+    guests_expire();
+    esp_err_t users_err = users_flush();
+    esp_err_t guests_err = guests_flush();
+    esp_err_t cfg_err = cfg_flush();
+    bool store_failed = users_err != ESP_OK || guests_err != ESP_OK || cfg_err != ESP_OK;
+    if (store_failed) {
+        ESP_LOGE(TAG, "Failed to store changes: users %i, guests %i, config %i", users_err, guests_err, cfg_err);
+    }
+
+    ack_commands(arena);
+    evtlog_flush(false);
+
+    size_t chat_count = 0;
+    for (chat_ack_t* ack = chat_acks; ack != NULL; ack = ack->next) {
+        chat_count++;
+    }
+
+    handler_response_t* resp = arena_calloc(arena, chat_count + 1, sizeof(handler_response_t));
+    if (resp != NULL) {
+        size_t i = 0;
+        for (chat_ack_t* ack = chat_acks; ack != NULL; ack = ack->next) {
+            char* text = compose_ack(arena, ack, store_failed);
+            if (text == NULL) {
+                text = ACK_FAILED_TEXT;
+            } else if (*text == '\0') {
+                continue;
+            }
+
+            resp[i].chat_id = ack->chat_id;
+            resp[i].text = text;
+            i++;
+        }
+    }
+
+    gate_commands = NULL;
+    gate_commands_tail = &gate_commands;
+    chat_acks = NULL;
+
+    return resp;
+}
+
+// Reply keyboard of the gate table: the open buttons two in a row, then a status and lock row and an unlock row for
+// every gate that can be locked. MAX_GATES gates with the longest names fit TG_KEYBOARD_MAX_LEN
+const char* gk_keyboard() {
+    char button[GATE_BUTTON_MAX_LEN];
+    size_t size = sizeof(keyboard);
+    size_t len = snprintf(keyboard, size, "{\"keyboard\":[");
+
+    for (size_t gate = 0; gate < gate_count() && len < size; gate++) {
+        format_gate_button(button, sizeof(button), gate, GATE_BUTTON_OPEN);
+        len += snprintf(&keyboard[len], size - len, "%s{\"text\":\"%s\"}%s", gate % 2 ? "," : gate ? ",[" : "[", button,
+            gate % 2 || gate + 1 == gate_count() ? "]" : "");
+    }
+
+    for (size_t gate = 0; gate < gate_count() && len < size; gate++) {
+        if (gate_get(gate)->lock_duration == 0) continue;
+
+        format_gate_button(button, sizeof(button), gate, GATE_BUTTON_STATUS);
+        len += snprintf(&keyboard[len], size - len, ",[{\"text\":\"%s\"},", button);
+        if (len >= size) break;
+        format_gate_button(button, sizeof(button), gate, GATE_BUTTON_LOCK);
+        len += snprintf(&keyboard[len], size - len, "{\"text\":\"%s\"}]", button);
+        if (len >= size) break;
+        format_gate_button(button, sizeof(button), gate, GATE_BUTTON_UNLOCK);
+        len += snprintf(&keyboard[len], size - len, ",[{\"text\":\"%s\"}]", button);
+    }
+
+    if (len < size) {
+        len += snprintf(&keyboard[len], size - len, "]}");
+    }
+    if (len >= size) {
+        ESP_LOGE(TAG, "Keyboard doesn't fit %u bytes", size);
+    }
 
-    return resp_batch_buf;
+    return keyboard;
 }
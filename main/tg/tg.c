@@ -1,8 +1,15 @@
 #include <stdio.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 #include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
 
 #include "esp_tls.h"
 #include "esp_crt_bundle.h"
@@ -15,31 +22,66 @@
 #define AS_STRING(x) #x
 
 #define TOK_LEN 512
+#define UPDATES_MAX_LEN 5 // the limit of a getUpdates batch
+#define REPLY_MAX_LEN 1536 // the longest reply composed in the arena, /settings or an acknowledgement of MAX_GATES gates, with its entries
+#define ARENA_SIZE (2 * UPDATES_MAX_LEN * REPLY_MAX_LEN) // a reply to every update of the batch and an acknowledgement to every chat
+
+#define STORAGE_NAMESPACE "tg"
+#define NVS_KEY_UPDATE_ID "updateid"
+#define UPDATE_ID_STORE_PERIOD_US (10 * 60 * 1000000LL) // limits flash writes, RTC memory covers warm resets
+#define RTC_UPDATE_ID_MAGIC 0x54475550
+
+#define FANOUT_WORKERS 3
+#define FANOUT_WORKER_STACK_SIZE 6144
+#define FANOUT_WORKER_HEAP_SIZE (48 * 1024) // a TLS session with its buffers
+#define FANOUT_QUEUE_LENGTH 16
+#define FANOUT_RESPONSE_SIZE 512
 
 #define HOST_NAME "api.telegram.org"
 #define WEB_SERVER_URL "https://" HOST_NAME
 #define WEB_PORT "443"
 
-#define GET_MESSAGES_FORMAT_STRING "GET /bot%s/getUpdates?offset=%li&limit=5 HTTP/1.1\r\n" \
+#define GET_MESSAGES_FORMAT_STRING "GET /bot%s/getUpdates?offset=%li&limit=%i HTTP/1.1\r\n" \
     "Host: " HOST_NAME "\r\n" \
     "User-Agent: esp-idf/1.0 esp32\r\n" \
     "Connection: close\r\n\r\n"
 
-#define SEND_MESSAGE_BODY_FORMAT_STRING "{\"reply_markup\":" \
-    "{\"keyboard\":[" \
-        "[{\"text\":\"Open upper gate\"},{\"text\":\"Open lower gate\"}]," \
-        "[{\"text\":\"Lower gate status\"},{\"text\":\"Open and lock lower gate\"}]," \
-        "[{\"text\":\"Unlock lower gate\"}]" \
-    "]}," \
-    "\"chat_id\":%s,\"text\":\"%s\"}\r\n"
+#define SEND_MESSAGE_BODY_PREFIX_FORMAT_STRING "{\"reply_markup\":%s,\"chat_id\":%s,\"text\":\""
+
+#define SEND_MESSAGE_BODY_SUFFIX "\"}\r\n"
 
-#define SEND_MESSAGE_FORMAT_STRING "POST /bot%s/sendMessage HTTP/1.1\r\n" \
+#define SEND_MESSAGE_BODY_FORMAT_STRING SEND_MESSAGE_BODY_PREFIX_FORMAT_STRING "%s" SEND_MESSAGE_BODY_SUFFIX
+
+#define SEND_MESSAGE_HEADER_FORMAT_STRING "POST /bot%s/sendMessage HTTP/1.1\r\n" \
     "Host: " HOST_NAME "\r\n" \
     "User-Agent: esp-idf/1.0 esp32\r\n" \
     "Connection: close\r\n" \
     "Content-Type: application/json\r\n" \
-    "Content-length: %i\r\n\r\n" \
-    SEND_MESSAGE_BODY_FORMAT_STRING
+    "Content-length: %i\r\n\r\n"
+
+#define SEND_MESSAGE_FORMAT_STRING SEND_MESSAGE_HEADER_FORMAT_STRING SEND_MESSAGE_BODY_FORMAT_STRING
+
+#define MESSAGE_MAX_LEN 4096 // Telegram limit in characters, which is never more than the UTF-8 bytes
+#define LINE_MAX_LEN 256
+#define SEND_HEADER_MAX_LEN 256
+#define SEND_REQUEST_MAX_LEN (1792 + TG_KEYBOARD_MAX_LEN)
+
+typedef struct {
+    uint32_t magic;
+    int64_t update_id;
+    int64_t check; // inverted update_id
+} rtc_update_id_t;
+
+typedef struct {
+    const char* chat_id;
+    const char* text;
+    int* result;
+} fanout_job_t;
+
+typedef struct {
+    char request[SEND_REQUEST_MAX_LEN];
+    char response[FANOUT_RESPONSE_SIZE]; // only the status line is of interest
+} fanout_worker_t;
 
 typedef struct {
     char bot_token[46];
@@ -50,11 +92,26 @@ typedef struct {
 
 
 static int https_send_request(char*, int, esp_tls_cfg_t, const char*, const char*);
+static int format_send_message(char*, size_t, const char*, const char*);
 
 static jsmntok_t tokens[TOK_LEN];
 static char req_buf[4096];
 static char resp_buf[4096];
-static char request[2048]; // make sure the request fits this size
+static char request[SEND_REQUEST_MAX_LEN]; // make sure the request fits this size
+// A whole message of streamed lines is formatted in place, after the room left for the header
+static char stream_request[SEND_HEADER_MAX_LEN + sizeof(SEND_MESSAGE_BODY_FORMAT_STRING) + TG_KEYBOARD_MAX_LEN + TG_CHAT_ID_MAX_LEN + MESSAGE_MAX_LEN];
+static const char* keyboard = "{\"remove_keyboard\":true}"; // reply_markup of every message
+static uint8_t arena_buf[ARENA_SIZE];
+static arena_t batch_arena; // owns the responses of a getUpdates batch
+
+static fanout_worker_t fanout_workers[FANOUT_WORKERS];
+static QueueHandle_t fanout_queue;
+static SemaphoreHandle_t fanout_done;
+
+// Survives software and watchdog resets, but not power loss
+RTC_NOINIT_ATTR static rtc_update_id_t rtc_update_id;
+static int64_t stored_update_id = -1;
+static int64_t stored_at = 0;
 
 static const char TAG[] = "tg";
 
@@ -95,6 +152,7 @@ static void tg_log(char* buf, tg_update_t* update) {
     if (update->message != NULL) {
         token = update->message->id;
         tg_log_token(buf, "message_id", token);
+        tg_log_token(buf, "date", update->message->date);
 
         tg_user_t* user = update->message->from;
         if (user != NULL) {
@@ -367,6 +425,19 @@ static bool parse_message(tg_message_t* message, char* buf, jsmntok_t* tokens, i
             }
         }
 
+        if (jsmn_strcmp(buf, &tokens[*i_tok], "date")) {
+            (*i_tok)++;
+            __JSMNLOG(buf, tokens, *i_tok);
+            if (jsmn_is_int(buf, &tokens[*i_tok])) {
+                buf[tokens[*i_tok].end] = '\0';
+                message->date = &tokens[*i_tok];
+                (*i_tok)++;
+                continue;
+            } else {
+                return false;
+            }
+        }
+
         if (jsmn_strcmp(buf, &tokens[*i_tok], "from")) {
             (*i_tok)++;
             __JSMNLOG(buf, tokens, *i_tok);
@@ -446,7 +517,130 @@ static bool parse_update(tg_update_t* update, char* buf, jsmntok_t* tokens, int
     return true;
 }
 
-static void handle_updates(char* buf, int buf_size, handler_response_t* update_handler(char*, tg_update_t*, QueueHandle_t, QueueHandle_t), QueueHandle_t open_queue, QueueHandle_t status_queue) {
+// Status code of the HTTP response, 0 if the status line can't be parsed
+static int http_status(const char* response) {
+    int status;
+    if (sscanf(response, "HTTP/%*u.%*u %3d", &status) != 1) return 0;
+    return status;
+}
+
+// Takes jobs until the queue is empty, then gives fanout_done once and exits, so that no worker outlives the fan-out
+// that started it
+static void fanout_worker(void* pvparameters) {
+    fanout_worker_t* worker = pvparameters;
+    fanout_job_t job;
+
+    while (xQueueReceive(fanout_queue, &job, 0)) {
+        if (format_send_message(worker->request, sizeof(worker->request), job.chat_id, job.text) < 0) {
+            *job.result = ESP_ERR_INVALID_SIZE;
+            continue;
+        }
+
+        *job.result = https_send_request(worker->response, sizeof(worker->response), tg_config.tls_cfg, WEB_SERVER_URL, worker->request);
+        if (*job.result > 0) {
+            int status = http_status(worker->response);
+            if (status < 200 || status > 299) {
+                ESP_LOGE(TAG, "Broadcast to %s answered with HTTP status %i", job.chat_id, status);
+                *job.result = ESP_FAIL;
+            }
+        }
+    }
+
+    xSemaphoreGive(fanout_done);
+    vTaskDelete(NULL);
+}
+
+// Sends the broadcast entries of the response batch over concurrent connections. The workers only live
+// for the duration of the fan-out, and no more of them are started than the heap can hold TLS sessions for
+static int fanout(handler_response_t* resp_batch, int* results) {
+    int count = 0;
+    for (int idx = 0; resp_batch[idx].chat_id != NULL; idx++) {
+        if (!resp_batch[idx].broadcast) continue;
+
+        fanout_job_t job = {
+            .chat_id = resp_batch[idx].chat_id,
+            .text = resp_batch[idx].text,
+            .result = &results[idx],
+        };
+        if (xQueueSend(fanout_queue, &job, 0) != pdTRUE) {
+            results[idx] = ESP_ERR_NO_MEM;
+            continue;
+        }
+        count++;
+    }
+
+    int workers = 0;
+    while (workers < FANOUT_WORKERS && workers < count) {
+        if (workers > 0 && esp_get_free_heap_size() < FANOUT_WORKER_HEAP_SIZE) break;
+        if (xTaskCreate(&fanout_worker, "gkFanout", FANOUT_WORKER_STACK_SIZE, &fanout_workers[workers], 5, NULL) != pdPASS) break;
+        workers++;
+    }
+
+    if (workers == 0) {
+        fanout_job_t job;
+        while (xQueueReceive(fanout_queue, &job, 0)) {
+            *job.result = ESP_ERR_NO_MEM;
+        }
+        return count;
+    }
+
+    // Every job has been carried out once every worker has left, and the worker buffers are free for the next fan-out
+    for (int i = 0; i < workers; i++) {
+        xSemaphoreTake(fanout_done, portMAX_DELAY);
+    }
+
+    return count;
+}
+
+static void send_responses(arena_t* arena, handler_response_t** batch, int size) {
+    for (int i = 0; i < size; i++) {
+        handler_response_t* resp_batch = batch[i];
+        if (resp_batch == NULL) continue;
+
+        int resp_count = 0;
+        while (resp_batch[resp_count].chat_id != NULL) {
+            resp_count++;
+        }
+
+        int* results = arena_calloc(arena, resp_count, sizeof(int));
+        int broadcast_count = results != NULL ? fanout(resp_batch, results) : 0;
+        int delivered = 0;
+        for (int idx = 0; results != NULL && idx < resp_count; idx++) {
+            if (!resp_batch[idx].broadcast) continue;
+
+            if (results[idx] > 0) {
+                delivered++;
+                ESP_LOGI(TAG, "Broadcast delivered to %s", resp_batch[idx].chat_id);
+            } else {
+                ESP_LOGE(TAG, "Broadcast to %s failed with code %i", resp_batch[idx].chat_id, results[idx]);
+            }
+        }
+
+        for (int idx = 0; idx < resp_count; idx++) {
+            if (resp_batch[idx].broadcast) continue;
+
+            const char* text = resp_batch[idx].text;
+            if (resp_batch[idx].delivery_report && broadcast_count > 0) {
+                char* report = arena_sprintf(arena, "%s (delivered to %i of %i)", text, delivered, broadcast_count);
+                if (report != NULL) {
+                    text = report;
+                }
+            }
+
+            int ret;
+            if (resp_batch[idx].lines != NULL) {
+                ret = tg_send_lines(resp_batch[idx].chat_id, text, resp_batch[idx].lines);
+            } else {
+                ret = tg_send_message(resp_batch[idx].chat_id, text);
+            }
+            if (ret <= 0) {
+                ESP_LOGE(TAG, "Failed sending message with code %i", ret);
+            }
+        }
+    }
+}
+
+static void handle_updates(char* buf, int buf_size, tg_update_handler_t update_handler, tg_batch_handler_t batch_handler) {
     jsmn_parser parser;
 
     jsmn_init(&parser);
@@ -457,6 +651,8 @@ static void handle_updates(char* buf, int buf_size, handler_response_t* update_h
         return;
     }
 
+    arena_reset(&batch_arena);
+
     int i_tok = 0;
 #ifdef TG_DEBUG
     for (i_tok = 0; i_tok < parsed_len; i_tok++) {
@@ -492,6 +688,13 @@ static void handle_updates(char* buf, int buf_size, handler_response_t* update_h
             }
             int size = tokens[i_tok].size;
             i_tok++;
+
+            // Responses are kept until the whole batch is handled, the last slot belongs to the batch handler
+            handler_response_t** batch = arena_calloc(&batch_arena, size + 1, sizeof(handler_response_t*));
+            if (batch == NULL) {
+                return;
+            }
+
             for (int i = 0; i < size && i_tok < parsed_len; i++) {
                 tg_chat_t chat_buf = {
                     .id = NULL,
@@ -509,6 +712,7 @@ static void handle_updates(char* buf, int buf_size, handler_response_t* update_h
                 };
                 tg_message_t message_buf = {
                     .id = NULL,
+                    .date = NULL,
                     .from = &user_buf,
                     .chat = &chat_buf,
                     .reply_to_message = NULL,
@@ -523,17 +727,12 @@ static void handle_updates(char* buf, int buf_size, handler_response_t* update_h
                 if (parse_update(&update, buf, tokens, parsed_len, &i_tok)) {
                     tg_config.update_id = atol(&buf[update.id->start]);
 
-                    handler_response_t* resp_batch = update_handler(buf, &update, open_queue, status_queue);
-                    if (resp_batch == NULL) continue;
-
-                    for (int idx = 0; resp_batch[idx].chat_id != NULL; idx++) {
-                        int ret = tg_send_message(resp_batch[idx].chat_id, resp_batch[idx].text);
-                        if (ret <= 0) {
-                            ESP_LOGE(TAG, "Failed sending message with code %i", ret);
-                        }
-                    }
+                    batch[i] = update_handler(buf, &update, &batch_arena);
                 }
             }
+
+            batch[size] = batch_handler(&batch_arena);
+            send_responses(&batch_arena, batch, size + 1);
             continue;
         }
 
@@ -541,7 +740,7 @@ static void handle_updates(char* buf, int buf_size, handler_response_t* update_h
     }
 }
 
-static void tg_parse(char* buf, int buf_len, handler_response_t* update_handler(char*, tg_update_t*, QueueHandle_t, QueueHandle_t), QueueHandle_t open_queue, QueueHandle_t status_queue) {
+static void tg_parse(char* buf, int buf_len, tg_update_handler_t update_handler, tg_batch_handler_t batch_handler) {
     if (buf_len < 4) {
         return;
     }
@@ -550,7 +749,7 @@ static void tg_parse(char* buf, int buf_len, handler_response_t* update_handler(
         // Looking for response body
         if (strncmp(buf + start_pos, "\r\n\r\n", 4) == 0) {
             start_pos += 4;
-            handle_updates(buf + start_pos, buf_len - start_pos, update_handler, open_queue, status_queue);
+            handle_updates(buf + start_pos, buf_len - start_pos, update_handler, batch_handler);
             return;
         }
     }
@@ -626,26 +825,160 @@ cleanup:
     return ret;
 }
 
+static int format_send_message(char* buf, size_t buf_size, const char* chat_id, const char* text) {
+    int len = snprintf(buf, buf_size, SEND_MESSAGE_FORMAT_STRING, tg_config.bot_token, sizeof(SEND_MESSAGE_BODY_FORMAT_STRING) - sizeof("%s%s%s") + strlen(keyboard) + strlen(chat_id) + strlen(text), keyboard, chat_id, text);
+    if (len >= buf_size) {
+        ESP_LOGE(TAG, "Message to %s doesn't fit the request buffer", chat_id);
+        return -1;
+    }
+
+    return len;
+}
+
 int tg_send_message(const char* chat_id, const char* text) {
     if (!tg_config.initialized) return ESP_FAIL;
 
-    sprintf(request, SEND_MESSAGE_FORMAT_STRING, tg_config.bot_token, sizeof(SEND_MESSAGE_BODY_FORMAT_STRING) - sizeof("%s%s") + strlen(chat_id) + strlen(text), chat_id, text);
+    if (format_send_message(request, sizeof(request), chat_id, text) < 0) return ESP_FAIL;
     return https_send_request(resp_buf, sizeof(resp_buf), tg_config.tls_cfg, WEB_SERVER_URL, request);
 }
 
+// Sends the text followed by the lines, starting a new message whenever the next line would exceed the message limit
+int tg_send_lines(const char* chat_id, const char* text, tg_line_source_t* lines) {
+    if (!tg_config.initialized) return ESP_FAIL;
+    if (strlen(chat_id) > TG_CHAT_ID_MAX_LEN) return ESP_FAIL;
+
+    char* body = &stream_request[SEND_HEADER_MAX_LEN];
+    size_t body_size = sizeof(stream_request) - SEND_HEADER_MAX_LEN;
+    char line[LINE_MAX_LEN];
+
+    const char* pending = text != NULL ? text : "";
+    size_t pending_len = strlen(pending);
+    if (pending_len == 0) {
+        pending = line;
+        pending_len = lines->next(lines, line, sizeof(line));
+    }
+
+    int ret = ESP_FAIL;
+    while (pending_len > 0) {
+        size_t len = snprintf(body, body_size, SEND_MESSAGE_BODY_PREFIX_FORMAT_STRING, keyboard, chat_id);
+        size_t text_len = 0;
+
+        // Every message takes at least one line, a line longer than a message is cut
+        do {
+            size_t n = pending_len < MESSAGE_MAX_LEN - text_len ? pending_len : MESSAGE_MAX_LEN - text_len;
+            memcpy(&body[len], pending, n);
+            len += n;
+            text_len += n;
+
+            pending = line;
+            pending_len = lines->next(lines, line, sizeof(line));
+        } while (pending_len > 0 && text_len + pending_len <= MESSAGE_MAX_LEN);
+
+        memcpy(&body[len], SEND_MESSAGE_BODY_SUFFIX, sizeof(SEND_MESSAGE_BODY_SUFFIX));
+        len += sizeof(SEND_MESSAGE_BODY_SUFFIX) - 1;
+
+        char header[SEND_HEADER_MAX_LEN];
+        int header_len = snprintf(header, sizeof(header), SEND_MESSAGE_HEADER_FORMAT_STRING, tg_config.bot_token, (int)len);
+        if (header_len >= sizeof(header)) return ESP_FAIL;
+
+        char* message = body - header_len;
+        memcpy(message, header, header_len);
+
+        ret = https_send_request(resp_buf, sizeof(resp_buf), tg_config.tls_cfg, WEB_SERVER_URL, message);
+        if (ret <= 0) break;
+    }
+
+    return ret;
+}
+
 int tg_get_messages(char* bot_token, int32_t update_id) {
     if (!tg_config.initialized) return ESP_FAIL;
 
-    sprintf(request, GET_MESSAGES_FORMAT_STRING, bot_token, update_id + 1);
+    sprintf(request, GET_MESSAGES_FORMAT_STRING, bot_token, update_id + 1, UPDATES_MAX_LEN);
     return https_send_request(req_buf, sizeof(req_buf), tg_config.tls_cfg, WEB_SERVER_URL, request);
 }
 
+static void load_update_id() {
+    nvs_handle_t nvs_handle = 0;
+    esp_err_t err;
+
+    err = nvs_open(STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if (err == ESP_OK) {
+        err = nvs_get_i64(nvs_handle, NVS_KEY_UPDATE_ID, &stored_update_id);
+    }
+
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGE(TAG, "Error reading update ID from NVS: %i (%#x)", err, err);
+    }
+
+    if (nvs_handle != 0) {
+        nvs_close(nvs_handle);
+    }
+
+    tg_config.update_id = stored_update_id;
+    if (rtc_update_id.magic == RTC_UPDATE_ID_MAGIC && rtc_update_id.check == ~rtc_update_id.update_id &&
+        rtc_update_id.update_id > tg_config.update_id) {
+        tg_config.update_id = rtc_update_id.update_id;
+    }
+
+    ESP_LOGI(TAG, "Restored update ID %lli", tg_config.update_id);
+}
+
+static void store_update_id() {
+    rtc_update_id.magic = RTC_UPDATE_ID_MAGIC;
+    rtc_update_id.update_id = tg_config.update_id;
+    rtc_update_id.check = ~tg_config.update_id;
+
+    int64_t now = esp_timer_get_time();
+    if (tg_config.update_id == stored_update_id || (stored_at != 0 && now - stored_at < UPDATE_ID_STORE_PERIOD_US)) {
+        return;
+    }
+
+    nvs_handle_t nvs_handle = 0;
+    esp_err_t err;
+
+    err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        goto exit;
+    }
+
+    err = nvs_set_i64(nvs_handle, NVS_KEY_UPDATE_ID, tg_config.update_id);
+    if (err != ESP_OK) {
+        goto exit;
+    }
+
+    err = nvs_commit(nvs_handle);
+    if (err != ESP_OK) {
+        goto exit;
+    }
+
+    stored_update_id = tg_config.update_id;
+    stored_at = now;
+
+exit:
+    if (nvs_handle != 0) {
+        nvs_close(nvs_handle);
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error storing update ID in NVS: %i (%#x)", err, err);
+    }
+}
+
 esp_err_t tg_init(char* bot_token) {
     if (tg_config.initialized) {
         return ESP_FAIL;
     }
 
     strcpy(tg_config.bot_token, bot_token);
+    arena_init(&batch_arena, arena_buf, sizeof(arena_buf));
+    load_update_id();
+
+    fanout_queue = xQueueCreate(FANOUT_QUEUE_LENGTH, sizeof(fanout_job_t));
+    fanout_done = xSemaphoreCreateCounting(FANOUT_QUEUE_LENGTH, 0);
+    if (fanout_queue == NULL || fanout_done == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
     tg_config.initialized = true;
 
     return ESP_OK;
@@ -655,7 +988,17 @@ void tg_deinit() {
     tg_config.initialized = false;
 }
 
-void tg_start(handler_response_t* update_handler(char*, tg_update_t*, QueueHandle_t, QueueHandle_t), QueueHandle_t open_queue, QueueHandle_t status_queue) {
+// The keyboard JSON must stay valid while the bot runs and be shorter than TG_KEYBOARD_MAX_LEN
+void tg_set_keyboard(const char* reply_markup) {
+    if (strlen(reply_markup) >= TG_KEYBOARD_MAX_LEN) {
+        ESP_LOGE(TAG, "Keyboard of %u bytes ignored", strlen(reply_markup));
+        return;
+    }
+
+    keyboard = reply_markup;
+}
+
+void tg_start(tg_update_handler_t update_handler, tg_batch_handler_t batch_handler) {
     if (!tg_config.initialized) {
         return;
     }
@@ -666,9 +1009,19 @@ void tg_start(handler_response_t* update_handler(char*, tg_update_t*, QueueHandl
         int ret = tg_get_messages(tg_config.bot_token, tg_config.update_id);
         if (ret > 0) {
             int buf_size = ret;
-            tg_parse(req_buf, buf_size, update_handler, open_queue, status_queue);
+            tg_parse(req_buf, buf_size, update_handler, batch_handler);
+            store_update_id();
         }
 
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        // Until the next poll, the gate task wakes the task up to have its carried out commands acknowledged
+        TickType_t poll_at = xTaskGetTickCount() + 1000 / portTICK_PERIOD_MS;
+        while (42) {
+            TickType_t now = xTaskGetTickCount();
+            if ((int32_t)(poll_at - now) <= 0 || ulTaskNotifyTake(pdTRUE, poll_at - now) == 0) break;
+
+            arena_reset(&batch_arena);
+            handler_response_t* response = batch_handler(&batch_arena);
+            send_responses(&batch_arena, &response, 1);
+        }
     }
 }
\ No newline at end of file
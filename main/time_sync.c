@@ -1,3 +1,5 @@
+#include <stdlib.h>
+#include <time.h>
 #include "esp_sntp.h"
 #include "esp_netif_sntp.h"
 #include "esp_log.h"
@@ -17,6 +19,12 @@ void initialize_sntp(void) {
     esp_netif_sntp_init(&config);
 }
 
+void set_local_timezone(const char* tz) {
+    ESP_LOGI(TAG, "Local time zone %s", tz);
+    setenv("TZ", tz, 1);
+    tzset();
+}
+
 static esp_err_t obtain_time(void) {
     // wait for time to be set
     int retry = 0;
@@ -1,10 +1,21 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <time.h>
+#include "sdkconfig.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "esp_partition.h"
 #include "nvs.h"
+#include "nvs_flash.h"
 #include "users.h"
+#include "guests.h"
 #include "secrets.h"
 
 #ifndef ADMINS_INITIALIZER
@@ -16,85 +27,198 @@
 #endif
 
 #define USER_FORMAT_STRING "id: %lli, username: %s, first name: %s, last name: %s\n"
-#define USER_FORMAT_STRING_SIZE (sizeof(USER_FORMAT_STRING) - sizeof("%lli%s%s"))
-#define USER_ID_MAX_LEN 16 // 52-bit value
+#define USER_ID_MAX ((1LL << 52) - 1)
 
+// Up to 110 user_t slots under a<n>/u<n> keys in the default NVS partition
+#define LEGACY_STORAGE_NAMESPACE "users"
+#define LEGACY_MAX_ADMINS 10
+#define LEGACY_MAX_USERS 100
+
+#define STORAGE_PARTITION "users"
 #define STORAGE_NAMESPACE "users"
+#define PROFILE_PARTITION "profiles"
+#define PROFILE_NAMESPACE "profiles"
+#define PROFILE_KEY_PREFIX 'p'
+#define PROFILE_BUCKET_COUNT 256 // about 20 profiles in a blob at MAX_USERS
+#define TABLE_KEY "table"
+#define TABLE_MAGIC 0x55535254 // "USRT"
+#define TABLE_VERSION 1
+#define SCHEDULES_KEY "schedules"
+
+#define LOG_PARTITION "usrlog"
+#define LOG_PARTITION_SUBTYPE 0x40
+#define LOG_READ_CHUNK_LEN 32 // records
+#define LOG_MAGIC 0x55534c4f47000001LL // "USLOG" and the format version
+#define PENDING_MAX_LEN 32
+
+// Log entries pack the ID with the index it belongs to and whether it was added or dropped
+#define LOG_ENTRY_SCHEDULE_SHIFT 56
+#define LOG_ENTRY(id, index, dropped, schedule) (((int64_t)(schedule) << LOG_ENTRY_SCHEDULE_SHIFT) | ((id) << 2) | (((index) == &user_index) << 1) | (dropped))
+#define LOG_ENTRY_ID(entry) (((entry) >> 2) & USER_ID_MAX)
+#define LOG_ENTRY_SCHEDULE(entry) ((entry) >> LOG_ENTRY_SCHEDULE_SHIFT)
+#define LOG_ENTRY_INDEX(entry) (((entry) & 2) ? &user_index : &admin_index)
+#define LOG_ENTRY_DROPPED(entry) ((entry) & 1)
+
+#define INDEX_MIN_SIZE 16
+
+#define PROFILE_HASH_UNKNOWN 0
+#define PROFILE_PENDING_LEN 8
+#define PROFILE_WRITE_PERIOD (60 * 1000000LL) // us per profile write allowed
+#define PROFILE_WRITE_BURST 5
+#define NEGATIVE_CACHE_SIZE 8
+
+#if CONFIG_SPIRAM
+#define INDEX_MALLOC_CAPS (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#else
+#define INDEX_MALLOC_CAPS MALLOC_CAP_8BIT
+#endif
 
-static char TAG[] = "users";
+// Sorted IDs and hashes of the matching profiles, the only per-user data kept in RAM. The arrays grow with the
+// number of users
+typedef struct {
+    int64_t* ids;
+    uint32_t* profile_hashes; // PROFILE_HASH_UNKNOWN until the profile is read or written
+    uint8_t* schedules;
+    size_t len;
+    size_t size;
+    size_t max_len;
+    char key_prefix;
+} id_index_t;
+
+// Both ID tables are stored as a single blob: this header, then the admin IDs, then the user IDs and then a byte
+// per user with their schedule
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t admin_count;
+    uint32_t user_count;
+    uint32_t crc; // of everything following the header
+    uint32_t generation; // counts table writes, the log applies to the table of its generation only
+} table_header_t;
+
+// Record of the append-only change log. Erased flash reads as all ones, which marks the end of the log. The first
+// record of the log holds LOG_MAGIC and the generation of the table the log applies to in place of the time
+typedef struct {
+    int64_t entry; // see LOG_ENTRY()
+    uint32_t time;
+    uint32_t crc; // of the fields above
+} log_record_t;
 
-static user_t admins[MAX_ADMINS] = ADMINS_INITIALIZER;
-static user_t users[MAX_USERS] = USERS_INITIALIZER;
+static char TAG[] = "users";
 
-static esp_err_t add(int64_t id, user_t* users, size_t size);
-static esp_err_t drop(int64_t id, user_t* users, size_t size);
-static char* list(char* buf, size_t buf_size, user_t* users, size_t size);
-static size_t count(user_t* usr, size_t usr_size);
-static esp_err_t get_nvs_key(char key[3], user_t* usr, size_t idx);
-static esp_err_t store_if_changed(user_t* usr, size_t idx);
-static esp_err_t erase(user_t* usr, size_t idx);
+static const user_t admin_seed[] = ADMINS_INITIALIZER;
+static const user_t user_seed[] = USERS_INITIALIZER;
+
+static id_index_t admin_index = { .ids = NULL, .profile_hashes = NULL, .schedules = NULL, .len = 0, .size = 0, .max_len = MAX_ADMINS, .key_prefix = 'a' };
+static id_index_t user_index = { .ids = NULL, .profile_hashes = NULL, .schedules = NULL, .len = 0, .size = 0, .max_len = MAX_USERS, .key_prefix = 'u' };
+
+// Changes made since the last flush
+static log_record_t pending[PENDING_MAX_LEN];
+static size_t pending_len;
+static bool table_dirty; // changes too many for the log, the next flush writes the whole table
+
+// Profiles that changed and wait for a write. The writes are limited by a token bucket
+static user_t pending_profiles[PROFILE_PENDING_LEN];
+static size_t pending_profiles_len;
+static int64_t profile_write_tokens_at; // time when the bucket had no tokens
+
+static week_schedule_t schedules[MAX_SCHEDULES]; // schedule 0 is never looked at
+static bool schedules_dirty;
+
+static const esp_partition_t* log_partition;
+static size_t log_offset; // where the next record is written
+static uint32_t table_generation; // of the stored table
+static bool store_locked; // the stored table couldn't be read, writing over it or its log would lose its users
+static uint32_t change_count; // of the changes that wait for users_flush()
+
+// Recent unauthorized senders, so that repeated messages from them skip the lookup
+static int64_t negative_cache[NEGATIVE_CACHE_SIZE];
+static size_t negative_cache_next;
+
+static esp_err_t add(int64_t id, id_index_t* index);
+static esp_err_t insert(int64_t id, id_index_t* index);
+static esp_err_t drop(int64_t id, id_index_t* index);
+static bool list_match(const user_list_cursor_t* cursor, nvs_handle_t nvs_handle, user_t* usr);
+static void get_nvs_key(char key[NVS_KEY_NAME_MAX_SIZE], char prefix, int64_t id);
+static esp_err_t init_partition(const char* label);
+static esp_err_t load_table();
+static esp_err_t load_schedules();
+static esp_err_t store_schedules();
+static esp_err_t store_table();
+static esp_err_t replay_log();
+static esp_err_t append_log();
+static esp_err_t compact_log();
+static esp_err_t reset_log(size_t used);
+static bool log_record_erased(const log_record_t* record);
+static uint32_t log_record_crc(const log_record_t* record);
+static void mark_dirty(int64_t id, id_index_t* index, bool dropped);
+static esp_err_t load_profile(nvs_handle_t nvs_handle, int64_t id, user_t* usr);
+static esp_err_t store_profile(nvs_handle_t nvs_handle, const user_t* usr);
+static void erase_profile(int64_t id);
+static esp_err_t read_bucket(nvs_handle_t nvs_handle, int64_t id, size_t extra, uint8_t** blob, size_t* blob_size);
+static size_t bucket_find(const uint8_t* blob, size_t blob_size, int64_t id, size_t* record_len);
+static esp_err_t flush_profiles();
+static uint32_t profile_hash(const user_t* usr);
+static uint32_t* get_profile_hash(int64_t id, id_index_t* index);
+static void set_profile_hash(int64_t id, uint32_t hash);
+static esp_err_t migrate_legacy_slots();
+static bool index_find(id_index_t* index, int64_t id, size_t* pos);
+static esp_err_t index_insert(id_index_t* index, int64_t id);
+static esp_err_t index_reserve(id_index_t* index, size_t size);
+static void index_remove(id_index_t* index, int64_t id);
 
 esp_err_t load_users() {
-    nvs_handle_t nvs_handle = 0;
     esp_err_t err;
 
-    err = nvs_open(STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
+    err = init_partition(STORAGE_PARTITION);
     if (err != ESP_OK) {
-        goto exit;
+        ESP_LOGE(TAG, "Failed to initialize user storage: %i (%#x)", err, err);
+        return err;
     }
 
-    user_t blob_content;
-    size_t blob_size;
-    char key[] = { 0, 0, 0 };
-
-    for (size_t i = 0; i < MAX_ADMINS; i++) {
-        if (admins[i].id != 0) continue;
-
-        err = get_nvs_key(key, admins, i);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to build NVS key");
-            goto exit;
-        }
-
-        err = nvs_get_blob(nvs_handle, key, &blob_content, &blob_size);
-        if (err == ESP_ERR_NVS_NOT_FOUND) {
-            admins[i].id = 0;
-            continue;
-        } else if (err != ESP_OK) {
-            goto exit;
-        }
-
-        memcpy(&admins[i], &blob_content, sizeof(admins[0]));
+    // Profiles only cache what Telegram sends with every message, users are still served without them
+    err = init_partition(PROFILE_PARTITION);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to initialize profile storage: %i (%#x)", err, err);
     }
 
-    for (size_t i = 0; i < MAX_USERS; i++) {
-        if (users[i].id != 0) continue;
+    int64_t start = esp_timer_get_time();
 
-        err = get_nvs_key(key, users, i);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to build NVS key");
-            goto exit;
+    err = load_table();
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        // First boot with the table format: gather whatever older firmware stored and save it as the table
+        esp_err_t migrate_err = migrate_legacy_slots();
+        if (migrate_err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to migrate users: %i (%#x)", migrate_err, migrate_err);
         }
+        err = ESP_OK;
+    } else if (err != ESP_OK) {
+        // Failing the boot would lock everyone out, so carry on with the built-in users. The table and its log are
+        // the only copies of the others, so nothing is written until a restart reads them
+        ESP_LOGE(TAG, "User table is unreadable, only built-in users are loaded and changes aren't stored");
+        store_locked = true;
+        err = ESP_OK;
+    }
 
-        err = nvs_get_blob(nvs_handle, key, &blob_content, &blob_size);
-        if (err == ESP_ERR_NVS_NOT_FOUND) {
-            users[i].id = 0;
-            continue;
-        } else if (err != ESP_OK) {
-            goto exit;
-        }
+    if (load_schedules() != ESP_OK) {
+        ESP_LOGE(TAG, "Schedules are unreadable, scheduled users have no access");
+    }
 
-        memcpy(&users[i], &blob_content, sizeof(users[0]));
+    if (replay_log() != ESP_OK) {
+        // Appending after an unreadable log could write over data, so fall back to rewriting the table
+        log_partition = NULL;
+        ESP_LOGE(TAG, "Failed to replay the user log");
     }
 
-exit:
-    if (err == ESP_ERR_NVS_NOT_FOUND) {
-        err = ESP_OK;
+    for (size_t i = 0; i < sizeof(admin_seed) / sizeof(admin_seed[0]); i++) {
+        index_insert(&admin_index, admin_seed[i].id);
     }
 
-    if (nvs_handle != 0) {
-        nvs_close(nvs_handle);
+    for (size_t i = 0; i < sizeof(user_seed) / sizeof(user_seed[0]); i++) {
+        index_insert(&user_index, user_seed[i].id);
     }
+
+    ESP_LOGI(TAG, "Loaded %u admins and %u users in %lli us", admin_index.len, user_index.len, esp_timer_get_time() - start);
     return err;
 }
 
@@ -103,13 +227,7 @@ bool is_admin(int64_t id) {
         return false;
     }
 
-    for (int i = 0; i < MAX_ADMINS; i++) {
-        if (admins[i].id == id) {
-            return true;
-        }
-    }
-
-    return false;
+    return index_find(&admin_index, id, NULL);
 }
 
 bool is_user(int64_t id) {
@@ -117,183 +235,507 @@ bool is_user(int64_t id) {
         return false;
     }
 
-    for (int i = 0; i < MAX_USERS; i++) {
-        if (users[i].id == id) {
-            return true;
-        }
-    }
-
-    return false;
+    return index_find(&user_index, id, NULL);
 }
 
+// Admins are always authorized, users only in the hours their schedule allows
 bool is_authorized(int64_t id) {
-    return is_admin(id) || is_user(id);
-}
+    if (is_admin(id)) return true;
 
-esp_err_t user_add(int64_t id) {
-    return add(id, users, MAX_USERS);
+    size_t pos;
+    if (id == 0 || !index_find(&user_index, id, &pos)) return false;
+
+    uint8_t schedule = user_index.schedules[pos];
+    return schedule == SCHEDULE_ALWAYS || schedule_allows(&schedules[schedule], schedule_week_hour());
 }
 
-esp_err_t user_drop(int64_t id) {
-    return drop(id, users, MAX_USERS);
+user_role_t user_role(int64_t id) {
+    if (id == 0) return ROLE_NONE;
+
+    // Guests come and go without touching the cache, so a cached sender may have become one since
+    for (size_t i = 0; i < NEGATIVE_CACHE_SIZE; i++) {
+        if (negative_cache[i] == id) return is_guest(id) ? ROLE_GUEST : ROLE_NONE;
+    }
+
+    if (is_admin(id)) return ROLE_ADMIN;
+    if (is_user(id)) return ROLE_USER;
+    if (is_guest(id)) return ROLE_GUEST;
+
+    negative_cache[negative_cache_next] = id;
+    negative_cache_next = (negative_cache_next + 1) % NEGATIVE_CACHE_SIZE;
+
+    return ROLE_NONE;
 }
 
-char* users_list(char* buf, size_t buf_size) {
-    char* resp = list(buf, buf_size, users, MAX_USERS);
+esp_err_t user_add(int64_t id) {
+    return add(id, &user_index);
+}
 
-    if (resp == NULL) {
-        return "No users";
+// Adds the user in RAM only. The next users_flush() writes the whole table at once instead of logging every ID
+esp_err_t user_import(int64_t id) {
+    esp_err_t err = insert(id, &user_index);
+    if (err == ESP_OK) {
+        table_dirty = true;
+        change_count++;
     }
 
-    return resp;
+    return err;
+}
+
+esp_err_t user_drop(int64_t id) {
+    return drop(id, &user_index);
 }
 
 size_t user_count() {
-    return count(users, MAX_USERS);
+    return user_index.len;
 }
 
 esp_err_t admin_add(int64_t id) {
-    return add(id, admins, MAX_ADMINS);
+    return add(id, &admin_index);
 }
 
 esp_err_t admin_drop(int64_t id) {
-    return drop(id, admins, MAX_ADMINS);
+    return drop(id, &admin_index);
 }
 
-char* admins_list(char* buf, size_t buf_size) {
-    char* resp = list(buf, buf_size, admins, MAX_ADMINS);
+size_t admin_count() {
+    return admin_index.len;
+}
 
-    if (resp == NULL) {
-        return "No admins";
-    }
+size_t get_admin_ids(int64_t* buf, size_t buf_size) {
+    size_t count = admin_index.len < buf_size ? admin_index.len : buf_size;
+    memcpy(buf, admin_index.ids, count * sizeof(*buf));
 
-    return resp;
+    return count;
 }
 
-size_t admin_count() {
-    return count(admins, MAX_ADMINS);
+static esp_err_t add(int64_t id, id_index_t* index) {
+    esp_err_t err = insert(id, index);
+    if (err == ESP_OK) {
+        mark_dirty(id, index, false);
+    }
+
+    return err;
 }
 
-size_t get_admin_ids(int64_t* buf, size_t buf_size) {
-    size_t count = 0;
-    for (int i = 0; i < MAX_ADMINS && count < buf_size; i++) {
-        if (admins[i].id != 0) {
-            buf[count] = admins[i].id;
-            count++;
-        }
+static esp_err_t insert(int64_t id, id_index_t* index) {
+    if (id <= 0 || id > USER_ID_MAX) return ESP_ERR_USR_WRONG_ID;
+
+    if (index_find(index, id, NULL)) {
+        return ESP_ERR_USR_ALREADY_EXISTS;
     }
 
-    return count;
-}
+    if (index->len >= index->max_len) {
+        return ESP_ERR_USR_NO_SPACE;
+    }
 
-static size_t count(user_t* usr, size_t usr_size) {
-    int counter = 0;
-    for (int i = 0; i < usr_size; i++) {
-        if (usr[i].id != 0) {
-            counter++;
+    esp_err_t err = index_insert(index, id);
+    if (err != ESP_OK) {
+        return ESP_ERR_USR_NO_SPACE;
+    }
+
+    for (size_t i = 0; i < NEGATIVE_CACHE_SIZE; i++) {
+        if (negative_cache[i] == id) {
+            negative_cache[i] = 0;
         }
     }
 
-    return counter;
+    return ESP_OK;
 }
 
-static esp_err_t add(int64_t id, user_t* usr, size_t usr_size) {
+static esp_err_t drop(int64_t id, id_index_t* index) {
     if (id == 0) return ESP_ERR_USR_WRONG_ID;
 
-    int_fast8_t empty = -1;
-    for (int i = 0; i < usr_size; i++) {
-        if (usr[i].id == id) {
-            return ESP_ERR_USR_ALREADY_EXISTS;
+    if (!index_find(index, id, NULL)) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    index_remove(index, id);
+    mark_dirty(id, index, true);
+    return ESP_OK;
+}
+
+// Counts the changes made, so that a caller can tell whether a call changed anything. Profiles aren't counted, they
+// are only a cache of what Telegram sends
+uint32_t users_change_count() {
+    return change_count;
+}
+
+// Changes are kept in RAM until flushed. A flush appends them to the log, and the table is rewritten only
+// when the log is close to full
+esp_err_t users_flush() {
+    esp_err_t err = flush_profiles();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error updating profiles in NVS: %i (%#x)", err, err);
+    }
+
+    if (schedules_dirty) {
+        err = store_schedules();
+        if (err != ESP_OK) {
+            return err;
         }
-        if (usr[i].id == 0) {
-            empty = i;
+        schedules_dirty = false;
+    }
+
+    if (pending_len == 0 && !table_dirty) return ESP_OK;
+    if (store_locked) return ESP_ERR_INVALID_STATE;
+
+    if (log_partition == NULL) {
+        err = store_table();
+    } else if (table_dirty) {
+        err = compact_log();
+    } else if (log_offset + pending_len * sizeof(log_record_t) > log_partition->size * 3 / 4) {
+        err = compact_log();
+    } else {
+        err = append_log();
+    }
+
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    for (size_t i = 0; i < pending_len; i++) {
+        int64_t id = LOG_ENTRY_ID(pending[i].entry);
+        if (LOG_ENTRY_DROPPED(pending[i].entry) && !is_admin(id) && !is_user(id)) {
+            erase_profile(id);
         }
     }
+    pending_len = 0;
+    table_dirty = false;
 
-    if (empty >= 0) {
-        usr[empty].id = id;
-        store_if_changed(usr, empty);
-        return ESP_OK;
+    return ESP_OK;
+}
+
+static void mark_dirty(int64_t id, id_index_t* index, bool dropped) {
+    change_count++;
+    if (pending_len == PENDING_MAX_LEN) {
+        users_flush();
+    }
+
+    // If the flush failed, the oldest change is only kept in RAM, so the next flush writes the whole table
+    if (pending_len == PENDING_MAX_LEN) {
+        memmove(&pending[0], &pending[1], (PENDING_MAX_LEN - 1) * sizeof(pending[0]));
+        pending_len--;
+        table_dirty = true;
     }
 
-    return ESP_ERR_USR_NO_SPACE;
+    // The entry of an added user also carries their schedule, so changing it is logged as adding them again
+    size_t pos;
+    uint8_t schedule = !dropped && index_find(index, id, &pos) ? index->schedules[pos] : SCHEDULE_ALWAYS;
+
+    log_record_t* record = &pending[pending_len++];
+    record->entry = LOG_ENTRY(id, index, dropped, schedule);
+    record->time = time(NULL);
+    record->crc = log_record_crc(record);
 }
 
-static esp_err_t drop(int64_t id, user_t* usr, size_t usr_size) {
-    if (id == 0) return ESP_ERR_USR_WRONG_ID;
+// Called for every message of an authorized user. In the common case the profile is unchanged and only its hash
+// is compared
+void user_profile_update(const user_t* usr) {
+    uint32_t* admin_hash = get_profile_hash(usr->id, &admin_index);
+    uint32_t* user_hash = get_profile_hash(usr->id, &user_index);
+    uint32_t* stored_hash = admin_hash != NULL ? admin_hash : user_hash;
+    if (stored_hash == NULL) return;
+
+    uint32_t hash = profile_hash(usr);
+    if (hash == *stored_hash) return;
+
+    // The first message after boot compares against the stored profile, which costs a read but not a write
+    if (*stored_hash == PROFILE_HASH_UNKNOWN) {
+        user_t stored = { .id = usr->id };
+        nvs_handle_t nvs_handle = 0;
+        if (nvs_open_from_partition(PROFILE_PARTITION, PROFILE_NAMESPACE, NVS_READONLY, &nvs_handle) == ESP_OK) {
+            load_profile(nvs_handle, usr->id, &stored);
+            nvs_close(nvs_handle);
+        }
 
-    for (size_t i = 0; i < usr_size; i++) {
-        if (usr[i].id == id) {
-            erase(usr, i);
-            usr[i].id = 0;
-            return ESP_OK;
+        set_profile_hash(usr->id, profile_hash(&stored));
+        if (hash == *stored_hash) return;
+    }
+
+    for (size_t i = 0; i < pending_profiles_len; i++) {
+        if (pending_profiles[i].id == usr->id) {
+            pending_profiles[i] = *usr;
+            return;
         }
     }
 
-    return ESP_ERR_NOT_FOUND;
+    // The hash is only updated once the profile is written, so a dropped update is retried on the next message
+    if (pending_profiles_len < PROFILE_PENDING_LEN) {
+        pending_profiles[pending_profiles_len++] = *usr;
+    }
 }
 
-static char* list(char* buf, size_t buf_size, user_t* usr, size_t usr_size) {
-    size_t len = 1;
-    for (size_t i = 0; i < usr_size; i++) {
-        if (usr[i].id != 0) {
-            user_t u = usr[i];
-            if (len + USER_FORMAT_STRING_SIZE + USER_ID_MAX_LEN > buf_size) {
-                return buf;
-            }
+const week_schedule_t* schedule_get(uint8_t schedule) {
+    if (schedule == SCHEDULE_ALWAYS || schedule >= MAX_SCHEDULES) return NULL;
+
+    return &schedules[schedule];
+}
+
+esp_err_t schedule_set(uint8_t schedule, const week_schedule_t* week) {
+    if (schedule == SCHEDULE_ALWAYS || schedule >= MAX_SCHEDULES) return ESP_ERR_INVALID_ARG;
+
+    schedules[schedule] = *week;
+    schedules_dirty = true;
+    change_count++;
+    return ESP_OK;
+}
+
+// Returns the schedule of the user, or -1 for anyone else. Admins aren't scheduled
+int user_get_schedule(int64_t id) {
+    size_t pos;
+    if (id == 0 || !index_find(&user_index, id, &pos)) return -1;
+
+    return user_index.schedules[pos];
+}
+
+esp_err_t user_set_schedule(int64_t id, uint8_t schedule) {
+    if (schedule >= MAX_SCHEDULES) return ESP_ERR_INVALID_ARG;
 
-            len += sprintf(buf + len - 1, USER_FORMAT_STRING, u.id, u.username, u.first_name, u.last_name);
+    size_t pos;
+    if (id == 0 || !index_find(&user_index, id, &pos)) return ESP_ERR_NOT_FOUND;
+    if (user_index.schedules[pos] == schedule) return ESP_OK;
+
+    user_index.schedules[pos] = schedule;
+    mark_dirty(id, &user_index, false);
+    return ESP_OK;
+}
+
+size_t user_list_pages(bool admins) {
+    id_index_t* index = admins ? &admin_index : &user_index;
+
+    return (index->len + USER_LIST_PAGE_SIZE - 1) / USER_LIST_PAGE_SIZE;
+}
+
+bool user_list_seek(user_list_cursor_t* cursor, size_t page) {
+    id_index_t* index = cursor->admins ? &admin_index : &user_index;
+
+    cursor->pos = 0;
+    if (cursor->prefix == NULL) {
+        cursor->pos = page * USER_LIST_PAGE_SIZE;
+        return cursor->pos < index->len;
+    }
+
+    // Pages of a filtered list start wherever the matches of the previous pages end
+    nvs_handle_t nvs_handle = 0;
+    nvs_open_from_partition(PROFILE_PARTITION, PROFILE_NAMESPACE, NVS_READONLY, &nvs_handle);
+
+    for (size_t skipped = 0; skipped < page * USER_LIST_PAGE_SIZE && cursor->pos < index->len; cursor->pos++) {
+        user_t usr = { .id = index->ids[cursor->pos] };
+        if (list_match(cursor, nvs_handle, &usr)) {
+            skipped++;
         }
     }
 
-    if (len == 1) return NULL;
+    // Also skip to the first match of the page, so that an empty page is reported as such
+    for (; cursor->pos < index->len; cursor->pos++) {
+        user_t usr = { .id = index->ids[cursor->pos] };
+        if (list_match(cursor, nvs_handle, &usr)) break;
+    }
 
-    return buf;
+    if (nvs_handle != 0) {
+        nvs_close(nvs_handle);
+    }
+
+    return cursor->pos < index->len;
 }
 
-static esp_err_t get_nvs_key(char key[3], user_t* usr, size_t idx) {
-    if (idx > UCHAR_MAX) return ESP_ERR_INVALID_SIZE;
+// Names are only needed here, so they are read from NVS entry by entry instead of being kept in RAM
+size_t user_list_next(user_list_cursor_t* cursor, char* buf, size_t buf_size) {
+    id_index_t* index = cursor->admins ? &admin_index : &user_index;
+    size_t len = 0;
 
-    if (usr == admins) {
-        if (idx >= MAX_ADMINS) return ESP_ERR_INVALID_SIZE;
-        key[0] = 'a';
-    } else if (usr == users) {
-        if (idx >= MAX_USERS) return ESP_ERR_INVALID_SIZE;
-        key[0] = 'u';
-    } else {
-        ESP_LOGE(TAG, "Unknown user privilege");
-        return ESP_FAIL;
+    nvs_handle_t nvs_handle = 0;
+    nvs_open_from_partition(PROFILE_PARTITION, PROFILE_NAMESPACE, NVS_READONLY, &nvs_handle);
+
+    for (; cursor->pos < index->len; cursor->pos++) {
+        user_t usr = { .id = index->ids[cursor->pos] };
+        if (!list_match(cursor, nvs_handle, &usr)) continue;
+
+        int n = snprintf(buf, buf_size, USER_FORMAT_STRING, usr.id, usr.username, usr.first_name, usr.last_name);
+        len = n < 0 ? 0 : n < buf_size ? n : buf_size - 1;
+        cursor->pos++;
+        break;
+    }
+
+    if (nvs_handle != 0) {
+        nvs_close(nvs_handle);
     }
 
-    key[1] = idx + 1;
+    return len;
+}
 
-    ESP_LOGI(TAG, "User storage key: %s", key);
+// Formats as many of the following IDs as fit a line, separated by spaces. The prefix of the cursor is ignored
+size_t user_export_next(user_list_cursor_t* cursor, char* buf, size_t buf_size) {
+    id_index_t* index = cursor->admins ? &admin_index : &user_index;
+    size_t len = 0;
 
-    return ESP_OK;
+    for (; cursor->pos < index->len; cursor->pos++) {
+        int n = snprintf(&buf[len], buf_size - len, "%lli ", index->ids[cursor->pos]);
+        if (n < 0 || n >= buf_size - len) break;
+        len += n;
+    }
+
+    if (len > 0) {
+        buf[len - 1] = '\n';
+    }
+
+    return len;
+}
+
+// Loads the profile of the user and checks it against the prefix of the cursor
+static bool list_match(const user_list_cursor_t* cursor, nvs_handle_t nvs_handle, user_t* usr) {
+    if (nvs_handle != 0) {
+        load_profile(nvs_handle, usr->id, usr);
+    }
+
+    if (cursor->prefix == NULL) return true;
+
+    size_t prefix_len = strlen(cursor->prefix);
+    return strncasecmp(usr->username, cursor->prefix, prefix_len) == 0
+        || strncasecmp(usr->first_name, cursor->prefix, prefix_len) == 0
+        || strncasecmp(usr->last_name, cursor->prefix, prefix_len) == 0;
+}
+
+static void get_nvs_key(char key[NVS_KEY_NAME_MAX_SIZE], char prefix, int64_t id) {
+    snprintf(key, NVS_KEY_NAME_MAX_SIZE, "%c%llx", prefix, id);
 }
 
-static esp_err_t erase(user_t* usr, size_t idx) {
-    if (usr[idx].id == 0) {
-        ESP_LOGE(TAG, "ID can't be 0");
-        return ESP_ERR_USR_WRONG_ID;
+static esp_err_t init_partition(const char* label) {
+    esp_err_t err = nvs_flash_init_partition(label);
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(TAG, "Erasing partition %s", label);
+        err = nvs_flash_erase_partition(label);
+        if (err == ESP_OK) {
+            err = nvs_flash_init_partition(label);
+        }
     }
+    return err;
+}
 
+static esp_err_t load_table() {
     nvs_handle_t nvs_handle = 0;
+    uint8_t* blob = NULL;
     esp_err_t err;
 
-    char key[] = { 0, 0, 0 };
-    err = get_nvs_key(key, usr, idx);
+    err = nvs_open_from_partition(STORAGE_PARTITION, STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to build NVS key");
         goto exit;
     }
 
-    err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    size_t blob_size = 0;
+    err = nvs_get_blob(nvs_handle, TABLE_KEY, NULL, &blob_size);
     if (err != ESP_OK) {
         goto exit;
     }
 
-    err = nvs_erase_key(nvs_handle, key);
+    if (blob_size < sizeof(table_header_t)) {
+        err = ESP_ERR_INVALID_SIZE;
+        goto exit;
+    }
+
+    blob = heap_caps_malloc(blob_size, INDEX_MALLOC_CAPS);
+    if (blob == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+
+    err = nvs_get_blob(nvs_handle, TABLE_KEY, blob, &blob_size);
+    if (err != ESP_OK) {
+        goto exit;
+    }
+
+    table_header_t header;
+    memcpy(&header, blob, sizeof(header));
+    if (header.magic != TABLE_MAGIC || header.version != TABLE_VERSION) {
+        err = ESP_ERR_INVALID_VERSION;
+        goto exit;
+    }
+
+    const uint8_t* ids = blob + sizeof(header);
+    size_t ids_size = ((size_t)header.admin_count + header.user_count) * sizeof(int64_t);
+    size_t schedules_size = header.user_count;
+
+    if (blob_size != sizeof(header) + ids_size + schedules_size
+        || header.admin_count > admin_index.max_len || header.user_count > user_index.max_len) {
+        err = ESP_ERR_INVALID_SIZE;
+        goto exit;
+    }
+
+    if (esp_rom_crc32_le(0, ids, ids_size + schedules_size) != header.crc) {
+        err = ESP_ERR_INVALID_CRC;
+        goto exit;
+    }
+
+    // IDs are stored sorted, so they are copied into the indexes as they are
+    err = index_reserve(&admin_index, header.admin_count);
+    if (err == ESP_OK) {
+        err = index_reserve(&user_index, header.user_count);
+    }
+    if (err != ESP_OK) {
+        goto exit;
+    }
+
+    memcpy(admin_index.ids, ids, header.admin_count * sizeof(int64_t));
+    memset(admin_index.profile_hashes, 0, header.admin_count * sizeof(uint32_t));
+    memset(admin_index.schedules, SCHEDULE_ALWAYS, header.admin_count);
+    admin_index.len = header.admin_count;
+    memcpy(user_index.ids, ids + header.admin_count * sizeof(int64_t), header.user_count * sizeof(int64_t));
+    memset(user_index.profile_hashes, 0, header.user_count * sizeof(uint32_t));
+    memcpy(user_index.schedules, ids + ids_size, header.user_count);
+    user_index.len = header.user_count;
+    table_generation = header.generation;
+
+exit:
+    free(blob);
+
+    if (nvs_handle != 0) {
+        nvs_close(nvs_handle);
+    }
+
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGE(TAG, "Error reading user table from NVS: %i (%#x)", err, err);
+    }
+    return err;
+}
+
+static esp_err_t store_table() {
+    nvs_handle_t nvs_handle = 0;
+    uint8_t* blob = NULL;
+    esp_err_t err;
+
+    size_t admins_size = admin_index.len * sizeof(int64_t);
+    size_t users_size = user_index.len * sizeof(int64_t);
+    size_t schedules_size = user_index.len;
+    size_t blob_size = sizeof(table_header_t) + admins_size + users_size + schedules_size;
+
+    blob = heap_caps_malloc(blob_size, INDEX_MALLOC_CAPS);
+    if (blob == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+
+    uint8_t* ids = blob + sizeof(table_header_t);
+    memcpy(ids, admin_index.ids, admins_size);
+    memcpy(ids + admins_size, user_index.ids, users_size);
+    memcpy(ids + admins_size + users_size, user_index.schedules, schedules_size);
+
+    table_header_t header = {
+        .magic = TABLE_MAGIC,
+        .version = TABLE_VERSION,
+        .admin_count = admin_index.len,
+        .user_count = user_index.len,
+        .crc = esp_rom_crc32_le(0, ids, admins_size + users_size + schedules_size),
+        .generation = table_generation + 1,
+    };
+    memcpy(blob, &header, sizeof(header));
+
+    err = nvs_open_from_partition(STORAGE_PARTITION, STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        goto exit;
+    }
+
+    err = nvs_set_blob(nvs_handle, TABLE_KEY, blob, blob_size);
     if (err != ESP_OK) {
         goto exit;
     }
@@ -303,7 +745,11 @@ static esp_err_t erase(user_t* usr, size_t idx) {
         goto exit;
     }
 
+    table_generation = header.generation;
+
 exit:
+    free(blob);
+
     if (nvs_handle != 0) {
         nvs_close(nvs_handle);
     }
@@ -316,54 +762,597 @@ exit:
     return err;
 }
 
-static esp_err_t store_if_changed(user_t* usr, size_t idx) {
-    if (usr[idx].id == 0) {
-        ESP_LOGE(TAG, "ID can't be 0");
-        return ESP_ERR_USR_WRONG_ID;
+static esp_err_t load_schedules() {
+    nvs_handle_t nvs_handle = 0;
+    esp_err_t err;
+
+    err = nvs_open_from_partition(STORAGE_PARTITION, STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK) {
+        goto exit;
+    }
+
+    size_t size = sizeof(schedules);
+    err = nvs_get_blob(nvs_handle, SCHEDULES_KEY, schedules, &size);
+    if (err == ESP_OK && size != sizeof(schedules)) {
+        memset(schedules, 0, sizeof(schedules));
+        err = ESP_ERR_INVALID_SIZE;
+    }
+
+exit:
+    if (nvs_handle != 0) {
+        nvs_close(nvs_handle);
+    }
+
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        err = ESP_OK;
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error reading schedules from NVS: %i (%#x)", err, err);
     }
+    return err;
+}
 
+static esp_err_t store_schedules() {
     nvs_handle_t nvs_handle = 0;
     esp_err_t err;
 
-    char key[] = { 0, 0, 0 };
-    err = get_nvs_key(key, usr, idx);
+    err = nvs_open_from_partition(STORAGE_PARTITION, STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to build NVS key");
         goto exit;
     }
 
-    err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    err = nvs_set_blob(nvs_handle, SCHEDULES_KEY, schedules, sizeof(schedules));
     if (err != ESP_OK) {
         goto exit;
     }
 
-    user_t blob_content;
-    size_t blob_size;
-    err = nvs_get_blob(nvs_handle, key, &blob_content, &blob_size);
-    if ((err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) ||
-        (blob_size == sizeof(blob_content) && memcmp(&blob_content, &usr[idx], sizeof(*usr)))) {
+    err = nvs_commit(nvs_handle);
+
+exit:
+    if (nvs_handle != 0) {
+        nvs_close(nvs_handle);
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error updating schedules in NVS: %i (%#x)", err, err);
+    }
+    return err;
+}
+
+// Applies the changes logged after the table was last written. A log of an older table generation is left from
+// a compaction cut short by a power loss: its changes are in the table and replaying them could undo later ones
+static esp_err_t replay_log() {
+    log_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, LOG_PARTITION_SUBTYPE, LOG_PARTITION);
+    if (log_partition == NULL) {
+        ESP_LOGW(TAG, "No user log partition, every change rewrites the table");
+        return ESP_OK;
+    }
+    if (store_locked) {
+        ESP_LOGW(TAG, "User log left as it is, its table is unreadable");
+        return ESP_OK;
+    }
+
+    log_record_t records[LOG_READ_CHUNK_LEN];
+    size_t replayed = 0;
+    size_t end = log_partition->size - log_partition->size % sizeof(log_record_t);
+
+    // The first record marks a formatted log. Anything else is left from an older partition layout
+    esp_err_t err = esp_partition_read(log_partition, 0, records, sizeof(log_record_t));
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (log_record_erased(&records[0]) || records[0].entry != LOG_MAGIC || records[0].crc != log_record_crc(&records[0])) {
+        ESP_LOGW(TAG, "Formatting user log");
+        return reset_log(log_record_erased(&records[0]) ? 0 : log_partition->size);
+    }
+
+    uint32_t generation = records[0].time;
+    if (generation != table_generation) {
+        ESP_LOGW(TAG, "Discarding user log of table generation %" PRIu32 ", the table is of %" PRIu32, generation, table_generation);
+        return reset_log(log_partition->size);
+    }
+
+    for (log_offset = sizeof(log_record_t); log_offset < end; ) {
+        size_t len = end - log_offset < sizeof(records) ? end - log_offset : sizeof(records);
+        err = esp_partition_read(log_partition, log_offset, records, len);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        for (size_t i = 0; i < len / sizeof(log_record_t); i++, log_offset += sizeof(log_record_t)) {
+            log_record_t* record = &records[i];
+            if (log_record_erased(record)) {
+                goto exit;
+            }
+
+            // A record torn by a power loss is skipped; the change was never acknowledged
+            if (record->crc != log_record_crc(record)) {
+                ESP_LOGW(TAG, "Skipping corrupted log record at %#x", log_offset);
+                continue;
+            }
+
+            int64_t id = LOG_ENTRY_ID(record->entry);
+            id_index_t* index = LOG_ENTRY_INDEX(record->entry);
+            size_t pos;
+            if (LOG_ENTRY_DROPPED(record->entry)) {
+                index_remove(index, id);
+            } else if (index_insert(index, id) == ESP_OK && index_find(index, id, &pos)) {
+                uint8_t schedule = LOG_ENTRY_SCHEDULE(record->entry);
+                index->schedules[pos] = schedule < MAX_SCHEDULES ? schedule : SCHEDULE_ALWAYS;
+            }
+            replayed++;
+        }
+    }
+
+exit:
+    ESP_LOGI(TAG, "Replayed %u log records, %u bytes of %" PRIu32 " used", replayed, log_offset, log_partition->size);
+    return ESP_OK;
+}
+
+static esp_err_t append_log() {
+    size_t len = pending_len * sizeof(log_record_t);
+
+    esp_err_t err = esp_partition_write(log_partition, log_offset, pending, len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error appending to user log: %i (%#x)", err, err);
+        // The records may be partially written, so skip them rather than writing over them
+    }
+
+    log_offset += len;
+    return err;
+}
+
+// Writes the whole table and starts a new log
+static esp_err_t compact_log() {
+    esp_err_t err = store_table();
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Compacting user log of %u bytes", log_offset);
+    err = reset_log(log_offset);
+    if (err != ESP_OK) {
+        // Changes appended to the old log would be discarded at boot, so every change rewrites the table instead
+        log_partition = NULL;
+    }
+    return err;
+}
+
+// Erases the used part of the log and writes its first record. Sectors are erased from the end, so that a power
+// loss while erasing leaves a log that still starts with the first record, of a table generation older than the
+// stored one
+static esp_err_t reset_log(size_t used) {
+    esp_err_t err;
+    size_t sector_size = log_partition->erase_size;
+
+    used = (used + sector_size - 1) / sector_size * sector_size;
+    for (size_t offset = used; offset > 0; offset -= sector_size) {
+        err = esp_partition_erase_range(log_partition, offset - sector_size, sector_size);
+        if (err != ESP_OK) {
+            goto exit;
+        }
+    }
+
+    log_record_t header = { .entry = LOG_MAGIC, .time = table_generation };
+    header.crc = log_record_crc(&header);
+    err = esp_partition_write(log_partition, 0, &header, sizeof(header));
+    if (err != ESP_OK) {
         goto exit;
     }
 
-    err = nvs_set_blob(nvs_handle, key, &usr[idx], sizeof(*usr));
+    log_offset = sizeof(header);
+
+exit:
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error resetting user log: %i (%#x)", err, err);
+    }
+    return err;
+}
+
+static bool log_record_erased(const log_record_t* record) {
+    return record->entry == -1 && record->time == UINT32_MAX && record->crc == UINT32_MAX;
+}
+
+static uint32_t log_record_crc(const log_record_t* record) {
+    return esp_rom_crc32_le(0, (const uint8_t*)record, offsetof(log_record_t, crc));
+}
+
+// Profiles are packed into PROFILE_BUCKET_COUNT blobs by ID, which spreads the overhead of an NVS blob over many
+// users. A record is the ID followed by the three names, each with its terminating zero
+static esp_err_t load_profile(nvs_handle_t nvs_handle, int64_t id, user_t* usr) {
+    uint8_t* blob = NULL;
+    size_t blob_size = 0;
+    esp_err_t err = read_bucket(nvs_handle, id, 0, &blob, &blob_size);
     if (err != ESP_OK) {
         goto exit;
     }
 
-    err = nvs_commit(nvs_handle);
+    size_t record_len;
+    size_t pos = bucket_find(blob, blob_size, id, &record_len);
+    if (pos == blob_size) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+        goto exit;
+    }
+
+    char* names[] = { usr->username, usr->first_name, usr->last_name };
+    pos += sizeof(id);
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        size_t len = strlen((char*)&blob[pos]);
+        size_t copy_len = len < sizeof(usr->username) ? len : sizeof(usr->username) - 1;
+        memcpy(names[i], &blob[pos], copy_len);
+        names[i][copy_len] = '\0';
+        pos += len + 1;
+    }
+
+exit:
+    free(blob);
+    return err;
+}
+
+static esp_err_t store_profile(nvs_handle_t nvs_handle, const user_t* usr) {
+    uint8_t* blob = NULL;
+    size_t blob_size = 0;
+    size_t max_record_len = sizeof(usr->id) + sizeof(usr->username) + sizeof(usr->first_name) + sizeof(usr->last_name);
+    esp_err_t err = read_bucket(nvs_handle, usr->id, max_record_len, &blob, &blob_size);
     if (err != ESP_OK) {
         goto exit;
     }
 
+    // The record is moved to the end, whether it changed size or not
+    size_t record_len;
+    size_t pos = bucket_find(blob, blob_size, usr->id, &record_len);
+    if (pos < blob_size) {
+        memmove(&blob[pos], &blob[pos + record_len], blob_size - pos - record_len);
+        blob_size -= record_len;
+    }
+
+    memcpy(&blob[blob_size], &usr->id, sizeof(usr->id));
+    blob_size += sizeof(usr->id);
+    const char* names[] = { usr->username, usr->first_name, usr->last_name };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        size_t len = strnlen(names[i], sizeof(usr->username) - 1);
+        memcpy(&blob[blob_size], names[i], len);
+        blob[blob_size + len] = '\0';
+        blob_size += len + 1;
+    }
+
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    get_nvs_key(key, PROFILE_KEY_PREFIX, usr->id % PROFILE_BUCKET_COUNT);
+    err = nvs_set_blob(nvs_handle, key, blob, blob_size);
+
 exit:
-    if (nvs_handle != 0) {
-        nvs_close(nvs_handle);
+    free(blob);
+    return err;
+}
+
+static void erase_profile(int64_t id) {
+    nvs_handle_t nvs_handle = 0;
+    uint8_t* blob = NULL;
+    size_t blob_size = 0;
+
+    if (nvs_open_from_partition(PROFILE_PARTITION, PROFILE_NAMESPACE, NVS_READWRITE, &nvs_handle) != ESP_OK) {
+        return;
+    }
+
+    if (read_bucket(nvs_handle, id, 0, &blob, &blob_size) != ESP_OK) {
+        goto exit;
+    }
+
+    size_t record_len;
+    size_t pos = bucket_find(blob, blob_size, id, &record_len);
+    if (pos == blob_size) {
+        goto exit;
+    }
+
+    memmove(&blob[pos], &blob[pos + record_len], blob_size - pos - record_len);
+    blob_size -= record_len;
+
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    get_nvs_key(key, PROFILE_KEY_PREFIX, id % PROFILE_BUCKET_COUNT);
+    esp_err_t err = blob_size > 0 ? nvs_set_blob(nvs_handle, key, blob, blob_size) : nvs_erase_key(nvs_handle, key);
+    if (err == ESP_OK) {
+        nvs_commit(nvs_handle);
+    }
+
+exit:
+    free(blob);
+    nvs_close(nvs_handle);
+}
+
+// Reads the bucket of the ID into a buffer with room for extra bytes after it. A missing bucket reads as empty
+static esp_err_t read_bucket(nvs_handle_t nvs_handle, int64_t id, size_t extra, uint8_t** blob, size_t* blob_size) {
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    get_nvs_key(key, PROFILE_KEY_PREFIX, id % PROFILE_BUCKET_COUNT);
+
+    *blob_size = 0;
+    esp_err_t err = nvs_get_blob(nvs_handle, key, NULL, blob_size);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        *blob_size = 0;
+    } else if (err != ESP_OK) {
+        return err;
     }
 
+    *blob = malloc(*blob_size + extra + 1);
+    if (*blob == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (*blob_size > 0) {
+        err = nvs_get_blob(nvs_handle, key, *blob, blob_size);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    return ESP_OK;
+}
+
+// Returns the position of the record of the ID, or blob_size if the bucket holds none. A record cut short ends the
+// bucket
+static size_t bucket_find(const uint8_t* blob, size_t blob_size, int64_t id, size_t* record_len) {
+    size_t pos = 0;
+    while (42) {
+        if (blob_size - pos < sizeof(id)) return blob_size;
+
+        int64_t record_id;
+        memcpy(&record_id, &blob[pos], sizeof(record_id));
+
+        size_t len = sizeof(record_id);
+        for (size_t i = 0; i < 3; i++) {
+            size_t name_len = strnlen((const char*)&blob[pos + len], blob_size - pos - len);
+            if (pos + len + name_len == blob_size) return blob_size;
+            len += name_len + 1;
+        }
+
+        if (record_id == id) {
+            *record_len = len;
+            return pos;
+        }
+        pos += len;
+    }
+}
+
+static esp_err_t flush_profiles() {
+    if (pending_profiles_len == 0) return ESP_OK;
+
+    int64_t now = esp_timer_get_time();
+    if (profile_write_tokens_at < now - PROFILE_WRITE_BURST * PROFILE_WRITE_PERIOD) {
+        profile_write_tokens_at = now - PROFILE_WRITE_BURST * PROFILE_WRITE_PERIOD;
+    }
+
+    size_t tokens = (now - profile_write_tokens_at) / PROFILE_WRITE_PERIOD;
+    if (tokens == 0) return ESP_OK;
+
+    nvs_handle_t nvs_handle = 0;
+    esp_err_t err = nvs_open_from_partition(PROFILE_PARTITION, PROFILE_NAMESPACE, NVS_READWRITE, &nvs_handle);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error updating value in NVS: %i (%#x)", err, err);
-    } else {
-        ESP_LOGI(TAG, "Updated value in NVS");
+        return err;
+    }
+
+    size_t done = 0;
+    size_t written = 0;
+    for (; done < pending_profiles_len && written < tokens; done++) {
+        user_t* usr = &pending_profiles[done];
+        if (!is_admin(usr->id) && !is_user(usr->id)) continue;
+
+        err = store_profile(nvs_handle, usr);
+        if (err != ESP_OK) {
+            break;
+        }
+
+        set_profile_hash(usr->id, profile_hash(usr));
+        written++;
     }
+
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+
+    profile_write_tokens_at += written * PROFILE_WRITE_PERIOD;
+    pending_profiles_len -= done;
+    memmove(&pending_profiles[0], &pending_profiles[done], pending_profiles_len * sizeof(pending_profiles[0]));
+
     return err;
-}
\ No newline at end of file
+}
+
+// FNV-1a of the three names, each including its terminating zero
+static uint32_t profile_hash(const user_t* usr) {
+    const char* names[] = { usr->username, usr->first_name, usr->last_name };
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const char* p = names[i];
+        do {
+            hash = (hash ^ (uint8_t)*p) * 16777619u;
+        } while (*p++ != '\0');
+    }
+
+    return hash == PROFILE_HASH_UNKNOWN ? 1 : hash;
+}
+
+static uint32_t* get_profile_hash(int64_t id, id_index_t* index) {
+    size_t pos;
+    if (!index_find(index, id, &pos)) return NULL;
+
+    return &index->profile_hashes[pos];
+}
+
+static void set_profile_hash(int64_t id, uint32_t hash) {
+    id_index_t* indexes[] = { &admin_index, &user_index };
+    for (size_t i = 0; i < sizeof(indexes) / sizeof(indexes[0]); i++) {
+        uint32_t* stored_hash = get_profile_hash(id, indexes[i]);
+        if (stored_hash != NULL) {
+            *stored_hash = hash;
+        }
+    }
+}
+
+// Moves the users stored by older firmware as whole user_t blobs under a<n>/u<n> keys of the default partition
+static esp_err_t migrate_legacy_slots() {
+    nvs_handle_t legacy_handle = 0;
+    nvs_handle_t profile_handle = 0;
+    esp_err_t err;
+    size_t migrated = 0;
+
+    err = nvs_open(LEGACY_STORAGE_NAMESPACE, NVS_READWRITE, &legacy_handle);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        return ESP_OK;
+    } else if (err != ESP_OK) {
+        goto exit;
+    }
+
+    err = nvs_open_from_partition(PROFILE_PARTITION, PROFILE_NAMESPACE, NVS_READWRITE, &profile_handle);
+    if (err != ESP_OK) {
+        goto exit;
+    }
+
+    id_index_t* indexes[] = { &admin_index, &user_index };
+    size_t slots[] = { LEGACY_MAX_ADMINS, LEGACY_MAX_USERS };
+    for (size_t t = 0; t < sizeof(indexes) / sizeof(indexes[0]); t++) {
+        for (size_t i = 0; i < slots[t]; i++) {
+            char legacy_key[] = { indexes[t]->key_prefix, i + 1, 0 };
+            user_t usr;
+            size_t blob_size = sizeof(usr);
+
+            err = nvs_get_blob(legacy_handle, legacy_key, &usr, &blob_size);
+            if (err == ESP_ERR_NVS_NOT_FOUND) {
+                continue;
+            } else if (err != ESP_OK) {
+                goto exit;
+            }
+
+            if (blob_size != sizeof(usr) || usr.id <= 0 || usr.id > USER_ID_MAX) continue;
+
+            err = index_insert(indexes[t], usr.id);
+            if (err != ESP_OK) {
+                goto exit;
+            }
+
+            if (usr.username[0] || usr.first_name[0] || usr.last_name[0]) {
+                err = store_profile(profile_handle, &usr);
+                if (err != ESP_OK) {
+                    goto exit;
+                }
+            }
+
+            migrated++;
+        }
+    }
+
+    err = nvs_commit(profile_handle);
+    if (err != ESP_OK) {
+        goto exit;
+    }
+
+    if (migrated > 0) {
+        err = store_table();
+        if (err != ESP_OK) {
+            goto exit;
+        }
+    }
+
+    err = nvs_erase_all(legacy_handle);
+    if (err == ESP_OK) {
+        err = nvs_commit(legacy_handle);
+    }
+
+exit:
+    if (profile_handle != 0) {
+        nvs_close(profile_handle);
+    }
+
+    if (legacy_handle != 0) {
+        nvs_close(legacy_handle);
+    }
+
+    if (migrated > 0) {
+        ESP_LOGI(TAG, "Migrated %u users from legacy slots", migrated);
+    }
+    return err;
+}
+
+// Returns whether the ID is in the index, and its position or the position it should be inserted at
+static bool index_find(id_index_t* index, int64_t id, size_t* pos) {
+    size_t low = 0;
+    size_t high = index->len;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (index->ids[mid] < id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (pos != NULL) {
+        *pos = low;
+    }
+
+    return low < index->len && index->ids[low] == id;
+}
+
+static esp_err_t index_insert(id_index_t* index, int64_t id) {
+    size_t pos;
+    if (id == 0 || index_find(index, id, &pos)) return ESP_OK;
+    if (index->len >= index->max_len) return ESP_ERR_NO_MEM;
+
+    if (index->len == index->size) {
+        size_t size = index->size ? 2 * index->size : INDEX_MIN_SIZE;
+        esp_err_t err = index_reserve(index, size < index->max_len ? size : index->max_len);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    memmove(&index->ids[pos + 1], &index->ids[pos], (index->len - pos) * sizeof(index->ids[0]));
+    memmove(&index->profile_hashes[pos + 1], &index->profile_hashes[pos], (index->len - pos) * sizeof(index->profile_hashes[0]));
+    memmove(&index->schedules[pos + 1], &index->schedules[pos], index->len - pos);
+    index->ids[pos] = id;
+    index->profile_hashes[pos] = PROFILE_HASH_UNKNOWN;
+    index->schedules[pos] = SCHEDULE_ALWAYS;
+    index->len++;
+
+    return ESP_OK;
+}
+
+static esp_err_t index_reserve(id_index_t* index, size_t size) {
+    if (size <= index->size) return ESP_OK;
+
+    int64_t* ids = heap_caps_realloc(index->ids, size * sizeof(ids[0]), INDEX_MALLOC_CAPS);
+    if (ids == NULL) {
+        ESP_LOGE(TAG, "Failed to grow ID index to %u entries", size);
+        return ESP_ERR_NO_MEM;
+    }
+    index->ids = ids;
+
+    uint32_t* profile_hashes = heap_caps_realloc(index->profile_hashes, size * sizeof(profile_hashes[0]), INDEX_MALLOC_CAPS);
+    if (profile_hashes == NULL) {
+        ESP_LOGE(TAG, "Failed to grow ID index to %u entries", size);
+        return ESP_ERR_NO_MEM;
+    }
+    index->profile_hashes = profile_hashes;
+
+    uint8_t* schedules = heap_caps_realloc(index->schedules, size, INDEX_MALLOC_CAPS);
+    if (schedules == NULL) {
+        ESP_LOGE(TAG, "Failed to grow ID index to %u entries", size);
+        return ESP_ERR_NO_MEM;
+    }
+    index->schedules = schedules;
+    index->size = size;
+
+    return ESP_OK;
+}
+
+static void index_remove(id_index_t* index, int64_t id) {
+    size_t pos;
+    if (!index_find(index, id, &pos)) return;
+
+    memmove(&index->ids[pos], &index->ids[pos + 1], (index->len - pos - 1) * sizeof(index->ids[0]));
+    memmove(&index->profile_hashes[pos], &index->profile_hashes[pos + 1], (index->len - pos - 1) * sizeof(index->profile_hashes[0]));
+    memmove(&index->schedules[pos], &index->schedules[pos + 1], index->len - pos - 1);
+    index->len--;
+}
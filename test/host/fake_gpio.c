@@ -0,0 +1,37 @@
+#include <string.h>
+#include "driver/gpio.h"
+#include "soc/gpio_reg.h"
+#include "fake_gpio.h"
+
+uint32_t fake_gpio_levels;
+uint64_t fake_gpio_configured;
+fake_gpio_write_t fake_gpio_writes[FAKE_GPIO_MAX_WRITES];
+size_t fake_gpio_write_count;
+void (*fake_gpio_on_write)();
+
+void fake_gpio_clear() {
+    memset(fake_gpio_writes, 0, sizeof(fake_gpio_writes));
+    fake_gpio_write_count = 0;
+}
+
+void reg_write(uint32_t reg, uint32_t value) {
+    if (reg == GPIO_OUT_W1TS_REG) {
+        fake_gpio_levels |= value;
+    } else if (reg == GPIO_OUT_W1TC_REG) {
+        fake_gpio_levels &= ~value;
+    }
+
+    if (fake_gpio_write_count < FAKE_GPIO_MAX_WRITES) {
+        fake_gpio_writes[fake_gpio_write_count] = (fake_gpio_write_t){ .reg = reg, .value = value };
+    }
+    fake_gpio_write_count++;
+
+    if (fake_gpio_on_write != NULL) {
+        fake_gpio_on_write();
+    }
+}
+
+esp_err_t gpio_config(const gpio_config_t* config) {
+    fake_gpio_configured |= config->pin_bit_mask;
+    return ESP_OK;
+}
@@ -0,0 +1,19 @@
+// Fake GPIO driver: keeps the levels of the pins written through the set and clear registers and records the writes
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define FAKE_GPIO_MAX_WRITES 16
+
+typedef struct {
+    uint32_t reg;
+    uint32_t value;
+} fake_gpio_write_t;
+
+extern uint32_t fake_gpio_levels; // a bit per GPIO
+extern uint64_t fake_gpio_configured; // the pins configured as outputs
+extern fake_gpio_write_t fake_gpio_writes[FAKE_GPIO_MAX_WRITES]; // since the last fake_gpio_clear(), the first ones
+extern size_t fake_gpio_write_count;
+extern void (*fake_gpio_on_write)(); // called after each write, NULL if none
+
+void fake_gpio_clear();
@@ -0,0 +1,163 @@
+// Host test of the gate outputs against the fake GPIO driver: set_levels() writes only the pins that change, releases
+// a button before it presses the next one and sets the outputs released before they are enabled.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gate_control.c"
+#include "fake_gpio.h"
+
+#define TRANSITIONS 100000
+
+static int failures;
+static uint32_t written_unconfigured; // pins written before gpio_config()
+static uint32_t pressed_at_once; // gates found pressed together after a single write
+
+int64_t esp_timer_get_time() {
+    return 0;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle) {
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    return ESP_OK;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    return NULL;
+}
+
+void xTaskNotifyGive(TaskHandle_t task) {
+}
+
+uint32_t ulTaskNotifyTake(bool clear_on_exit, TickType_t ticks_to_wait) {
+    return 0;
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t mode, nvs_handle_t* handle) {
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+void nvs_close(nvs_handle_t handle) {
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char* key, uint32_t* value) {
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char* key, uint32_t value) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* value, size_t* length) {
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length) {
+    return ESP_OK;
+}
+
+// Levels with the given gate pressed, or none if it is gates_count
+static uint32_t press_levels(size_t pressed) {
+    uint32_t levels = pressed < gates_count ? 1 << GPIO_LED_NUM : 0;
+    for (size_t i = 0; i < gates_count; i++) {
+        bool press = i == pressed;
+        if (gates[i].open_level ? press : !press) {
+            levels |= 1 << gates[i].pin;
+        }
+    }
+    return levels;
+}
+
+static void check_write() {
+    if (fake_gpio_configured == 0 && fake_gpio_write_count <= FAKE_GPIO_MAX_WRITES) {
+        written_unconfigured |= fake_gpio_writes[fake_gpio_write_count - 1].value;
+    }
+
+    int pressed = 0;
+    for (size_t i = 0; i < gates_count; i++) {
+        pressed += ((fake_gpio_levels >> gates[i].pin) & 1) == gates[i].open_level;
+    }
+    if (pressed > 1) {
+        pressed_at_once++;
+    }
+}
+
+static void expect(bool ok, const char* what) {
+    if (!ok) {
+        printf("%s\n", what);
+        failures++;
+    }
+}
+
+// Sets the levels and checks that the writes cover exactly the pins that change, each written once
+static void check_transition(uint32_t levels) {
+    uint32_t before = fake_gpio_levels;
+    fake_gpio_clear();
+    set_levels(levels);
+
+    uint32_t covered = 0;
+    bool overlap = false;
+    for (size_t i = 0; i < fake_gpio_write_count && i < FAKE_GPIO_MAX_WRITES; i++) {
+        overlap |= fake_gpio_writes[i].value == 0 || (covered & fake_gpio_writes[i].value);
+        covered |= fake_gpio_writes[i].value;
+    }
+
+    expect(fake_gpio_write_count <= 4, "more than 4 register writes for a change");
+    expect(!overlap, "an empty write, or a pin written twice");
+    expect(covered == ((before ^ levels) & output_mask), "written pins other than those that change");
+    expect(fake_gpio_levels == levels, "levels not set");
+}
+
+int main() {
+    gates[0] = (gate_config_t){ .pin = 4, .open_level = 1 };
+    gates[1] = (gate_config_t){ .pin = 15, .open_level = 0 };
+    gates[2] = (gate_config_t){ .pin = 13, .open_level = 1 };
+    gates_count = 3;
+    config.gate_open_pulse_duration = 50;
+
+    fake_gpio_on_write = check_write;
+    gate_outputs_init();
+    expect(fake_gpio_levels == press_levels(gates_count), "outputs not released at boot");
+    expect(fake_gpio_configured == output_mask, "outputs other than the gates and the LED configured");
+    expect((written_unconfigured & output_mask) == output_mask, "outputs enabled before they are released");
+
+    fake_gpio_clear();
+    set_levels(press_levels(gates_count));
+    expect(fake_gpio_write_count == 0, "unchanged levels written");
+
+    fake_gpio_clear();
+    set_levels(press_levels(0));
+    expect(fake_gpio_write_count == 1 && fake_gpio_writes[0].reg == GPIO_OUT_W1TS_REG
+        && fake_gpio_writes[0].value == ((1 << 4) | (1 << GPIO_LED_NUM)), "press of gate 0 not a single set");
+
+    // Gate 0 is released through the clear register before gate 1, active low, is pressed through it too
+    fake_gpio_clear();
+    set_levels(press_levels(1));
+    expect(fake_gpio_write_count == 2 && fake_gpio_writes[0].value == 1 << 4 && fake_gpio_writes[1].value == 1 << 15,
+        "gate 0 not released before gate 1 is pressed");
+
+    unsigned seed = 7;
+    for (int i = 0; i < TRANSITIONS; i++) {
+        check_transition(press_levels(rand_r(&seed) % (gates_count + 1)));
+    }
+    expect(pressed_at_once == 0, "two buttons pressed at once");
+
+    if (failures > 0) {
+        printf("%i checks of the outputs failed\n", failures);
+        return 1;
+    }
+
+    printf("%i transitions, only the changed pins written\n", TRANSITIONS);
+    return 0;
+}
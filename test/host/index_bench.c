@@ -0,0 +1,154 @@
+// Host benchmark of the user ID lookup: index_find() on sorted indexes of 100, 1,000 and 10,000 random IDs, against
+// the scan of user_t slots it replaced. Half of the looked up IDs are in the index. The figures are host times, they
+// only compare the two lookups with each other
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "users.c"
+
+#define LOOKUPS 2000000
+#define ID_BITS 40 // Telegram user IDs are below 2^40 so far
+
+int64_t esp_timer_get_time() {
+    return 0;
+}
+
+bool is_guest(int64_t id) {
+    return false;
+}
+
+bool schedule_allows(const week_schedule_t* week, int week_hour) {
+    return true;
+}
+
+int schedule_week_hour() {
+    return 0;
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const* buf, uint32_t len) {
+    return 0;
+}
+
+esp_err_t nvs_flash_init_partition(const char* part) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase_partition(const char* part) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_open_from_partition(const char* part, const char* ns, nvs_open_mode_t mode, nvs_handle_t* handle) {
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_open(const char* ns, nvs_open_mode_t mode, nvs_handle_t* handle) {
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+void nvs_close(nvs_handle_t handle) {
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* value, size_t* length) {
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length) {
+    return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key) {
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+    return ESP_OK;
+}
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label) {
+    return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t offset, void* dst, size_t size) {
+    return ESP_FAIL;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t offset, const void* src, size_t size) {
+    return ESP_FAIL;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size) {
+    return ESP_FAIL;
+}
+
+static int64_t random_id(unsigned* seed) {
+    return (((int64_t)rand_r(seed) << 20) ^ rand_r(seed)) % (1LL << ID_BITS) + 1;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The lookup before the index: a scan of the occupied user_t slots
+static bool scan_slots(const user_t* slots, size_t count, int64_t id) {
+    for (size_t i = 0; i < count; i++) {
+        if (slots[i].id == id) return true;
+    }
+    return false;
+}
+
+int main() {
+    const size_t counts[] = { 100, 1000, 10000 };
+    int64_t* lookups = malloc(LOOKUPS * sizeof(lookups[0]));
+    if (lookups == NULL) return 1;
+
+    printf("%8s %16s %16s\n", "users", "index_find, ns", "slot scan, ns");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        unsigned seed = 1;
+        id_index_t index = { .max_len = counts[c] };
+        user_t* slots = calloc(counts[c], sizeof(user_t));
+        if (slots == NULL) return 1;
+
+        for (size_t i = 0; i < counts[c]; i++) {
+            slots[i].id = random_id(&seed);
+            if (index_insert(&index, slots[i].id) != ESP_OK) return 1;
+        }
+
+        for (size_t i = 0; i < LOOKUPS; i++) {
+            lookups[i] = i % 2 ? slots[rand_r(&seed) % counts[c]].id : random_id(&seed);
+        }
+
+        size_t found = 0;
+        double start = now_ns();
+        for (size_t i = 0; i < LOOKUPS; i++) {
+            found += index_find(&index, lookups[i], NULL);
+        }
+        double find_ns = (now_ns() - start) / LOOKUPS;
+
+        // The scan is much slower, a tenth of the lookups is enough
+        size_t scanned = 0;
+        start = now_ns();
+        for (size_t i = 0; i < LOOKUPS / 10; i++) {
+            scanned += scan_slots(slots, counts[c], lookups[i]);
+        }
+        double scan_ns = (now_ns() - start) / (LOOKUPS / 10);
+
+        if (found < LOOKUPS / 2 || scanned < LOOKUPS / 20) return 1;
+        printf("%8u %16.1f %16.1f\n", counts[c], find_ns, scan_ns);
+
+        free(slots);
+        free(index.ids);
+        free(index.profile_hashes);
+        free(index.schedules);
+    }
+
+    free(lookups);
+    return 0;
+}
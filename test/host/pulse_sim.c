@@ -0,0 +1,485 @@
+// Host simulation of the gate pulses: runs random command schedules through gate_submit() and the real gate task,
+// with esp_timer and the task notifications emulated on a simulated clock, and checks that the output pins follow
+// the loop of the baseline firmware at every millisecond. The baseline polled the tick count, here it is polled
+// every millisecond with its tick comparisons made exact, so that a deadline takes effect at its time.
+//
+// The task never returns, so the simulation leaves it through a longjmp once the schedule is over.
+//
+// Run with "jitter", it instead measures the pulses of a gate held open, through the gate task and through the
+// baseline loop as it ran, polling every 20 ms, with the task getting the CPU back a random time after each wakeup.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "gate_control.c"
+#include "fake_gpio.h"
+
+#define SCHEDULES 300
+#define COMMANDS 12 // per schedule
+#define MAX_GAP_MS 4000 // between commands
+#define UNLOCK_PERCENT 15
+#define MAX_DELAY 600 // ticks
+#define HORIZON_MS 120000 // of a schedule, enough for the last command to end
+#define MAX_CHANGES 20000 // of the pin levels in a schedule
+#define JITTER_RUNS 200
+#define JITTER_OPEN_TICKS 6000
+#define BASELINE_POLL 2 // ticks, the default gate_poll of the baseline
+
+typedef struct {
+    int64_t at; // us
+    gate_t gate;
+    int32_t delay;
+} command_t;
+
+typedef struct {
+    int64_t at; // us
+    uint32_t pins;
+} change_t;
+
+// The state of the baseline loop
+typedef struct {
+    int64_t close_gate_at[MAX_GATES];
+    int64_t change_level_at;
+    size_t active_output_idx;
+} reference_t;
+
+static int64_t sim_now; // us
+static int64_t timer_at; // 0 if not started
+static esp_timer_cb_t timer_callback;
+static bool notified;
+static jmp_buf schedule_over;
+
+static command_t commands[COMMANDS];
+static size_t next_command;
+static change_t changes[MAX_CHANGES];
+static size_t changes_len;
+static uint32_t wakeups;
+static int64_t task_delay_max; // us, from a wakeup of the gate task until it runs
+static unsigned task_delay_seed;
+
+int64_t esp_timer_get_time() {
+    return sim_now;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle) {
+    timer_callback = args->callback;
+    *handle = NULL;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    timer_at = sim_now + timeout_us;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    timer_at = 0;
+    return ESP_OK;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    return (TaskHandle_t)1;
+}
+
+void xTaskNotifyGive(TaskHandle_t task) {
+    notified = true;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    return 0;
+}
+
+static int64_t task_delay() {
+    return task_delay_max > 0 ? rand_r(&task_delay_seed) % (task_delay_max + 1) : 0;
+}
+
+// Moves the clock to whatever wakes the task first: a command, which is submitted as the handler would, or the
+// timeout. The task then runs after its delay. Timer edges and commands on the way go on meanwhile
+uint32_t ulTaskNotifyTake(bool clear_on_exit, TickType_t ticks_to_wait) {
+    int64_t wake_at = ticks_to_wait == portMAX_DELAY ? INT64_MAX : sim_now + TICKS_TO_US(ticks_to_wait);
+    int64_t run_at = INT64_MAX;
+    wakeups++;
+
+    while (42) {
+        if (run_at == INT64_MAX && (notified || sim_now >= wake_at)) {
+            run_at = sim_now + task_delay();
+        }
+
+        int64_t command_at = next_command < COMMANDS ? commands[next_command].at : INT64_MAX;
+        int64_t at = run_at != INT64_MAX ? run_at : wake_at;
+        if (timer_at != 0 && timer_at <= at && timer_at <= command_at) {
+            sim_now = timer_at;
+            timer_at = 0;
+            timer_callback(NULL);
+            continue;
+        }
+
+        if (command_at <= at && command_at != INT64_MAX) {
+            sim_now = command_at;
+            uint32_t command_id;
+            gate_submit(commands[next_command].gate, commands[next_command].delay, 1, &command_id);
+            next_command++;
+            continue;
+        }
+
+        if (at == INT64_MAX) longjmp(schedule_over, 1);
+
+        sim_now = at;
+        if (at == run_at) break;
+    }
+
+    notified = false;
+    return 1;
+}
+
+// Records the levels after every write to the output registers
+static void record_change() {
+    if (changes_len > 0 && changes[changes_len - 1].at == sim_now) {
+        changes[changes_len - 1].pins = fake_gpio_levels;
+    } else if (changes_len < MAX_CHANGES) {
+        changes[changes_len++] = (change_t){ .at = sim_now, .pins = fake_gpio_levels };
+    }
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t mode, nvs_handle_t* handle) {
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+void nvs_close(nvs_handle_t handle) {
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char* key, uint32_t* value) {
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char* key, uint32_t value) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* value, size_t* length) {
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length) {
+    return ESP_OK;
+}
+
+// An iteration of the baseline loop at the given time, for the command that woke it if any
+static uint32_t reference_poll(reference_t* ref, int64_t now, const command_t* command) {
+    int64_t pulse = TICKS_TO_US(cfg_get_gate_open_pulse_duration());
+
+    if (command != NULL) {
+        if (command->delay < 0) {
+            ref->close_gate_at[command->gate] = now;
+            ref->change_level_at = now;
+        } else if (now + TICKS_TO_US(command->delay) > ref->close_gate_at[command->gate]) {
+            ref->close_gate_at[command->gate] = now + TICKS_TO_US(command->delay);
+        }
+    }
+
+    uint32_t outputs = 0;
+    for (size_t i = 0; i < gates_count; i++) {
+        if (now >= ref->close_gate_at[i]) {
+            ref->close_gate_at[i] = now;
+            continue;
+        }
+        outputs |= 1 << (2 * i + 1);
+    }
+
+    // The tick the baseline added to the change time only kept the outputs from turning while all gates were closed
+    if (outputs == 0) {
+        ref->active_output_idx = 0;
+        ref->change_level_at = now;
+    } else if (now >= ref->change_level_at) {
+        ref->change_level_at = now + pulse;
+        ref->active_output_idx = (ref->active_output_idx + 1) % (2 * gates_count);
+    }
+
+    uint32_t levels = 0;
+    if (outputs & (1 << ref->active_output_idx)) {
+        levels |= 1 << GPIO_LED_NUM;
+    }
+    for (size_t i = 0; i < gates_count; i++) {
+        bool press = outputs & (1 << ref->active_output_idx) & (1 << (2 * i + 1));
+        if (gates[i].open_level ? press : !press) {
+            levels |= 1 << gates[i].pin;
+        }
+    }
+
+    return levels;
+}
+
+// Runs the schedule through the gate task from a fresh state, recording the pin changes
+static void run_task() {
+    memset(&state, 0, sizeof(state));
+    memset(submitted, 0, sizeof(submitted));
+    memset(command_records, 0, sizeof(command_records));
+    sim_now = 0;
+    timer_at = 0;
+    edge_at = 0;
+    edge_done = false;
+    notified = false;
+    next_command = 0;
+    fake_gpio_levels = 0;
+    fake_gpio_on_write = record_change;
+    changes_len = 0;
+    written = false;
+
+    gate_outputs_init();
+    if (setjmp(schedule_over) == 0) {
+        startGateControl();
+    }
+}
+
+// Compares the recorded pins with the baseline at every millisecond. Returns the first time they differ, -1 if never
+static int64_t compare() {
+    reference_t ref = { 0 };
+    size_t command = 0;
+    size_t change = 0;
+
+    for (int64_t now = 0; now <= HORIZON_MS * 1000LL; now += 1000) {
+        uint32_t expected = reference_poll(&ref, now, NULL);
+        for (; command < COMMANDS && commands[command].at == now; command++) {
+            expected = reference_poll(&ref, now, &commands[command]);
+        }
+
+        for (; change + 1 < changes_len && changes[change + 1].at <= now; change++);
+        if ((changes[change].pins & output_mask) != expected) return now;
+    }
+
+    return -1;
+}
+
+static void random_schedule(unsigned* seed) {
+    int64_t at = 0;
+    for (size_t i = 0; i < COMMANDS; i++) {
+        at += (1 + rand_r(seed) % MAX_GAP_MS) * 1000LL;
+        commands[i].at = at;
+        commands[i].gate = rand_r(seed) % gates_count;
+        commands[i].delay = rand_r(seed) % 100 < UNLOCK_PERCENT ? GATE_DELAY_UNLOCK : 1 + rand_r(seed) % MAX_DELAY;
+    }
+}
+
+static void setup_gates(size_t count, unsigned* seed) {
+    const uint8_t pins[] = { 4, 15, 13, 14, 16, 17 };
+    gates_count = count;
+    for (size_t i = 0; i < count; i++) {
+        gates[i] = (gate_config_t){ .pin = pins[i], .open_level = rand_r(seed) % 2 };
+    }
+    config.gate_open_pulse_duration = 10 + rand_r(seed) % 60;
+}
+
+// A single open gate of two is pressed for one pulse in four, as it was before the gate table
+static int check_duty_cycle() {
+    unsigned seed = 1;
+    setup_gates(2, &seed);
+    gates[1].open_level = 1;
+    config.gate_open_pulse_duration = 50;
+
+    memset(commands, 0, sizeof(commands));
+    commands[0] = (command_t){ .at = 1000, .gate = 1, .delay = 20 * 50 };
+    for (size_t i = 1; i < COMMANDS; i++) {
+        commands[i].at = INT64_MAX;
+    }
+    run_task();
+
+    int presses = 0;
+    int64_t pressed_for = 0;
+    for (size_t i = 0; i < changes_len; i++) {
+        if (!(changes[i].pins & (1 << gates[1].pin))) continue;
+        presses++;
+        if (i + 1 < changes_len) {
+            pressed_for += changes[i + 1].at - changes[i].at;
+        }
+    }
+
+    if (presses != 5 || pressed_for != 5 * TICKS_TO_US(50)) {
+        printf("single gate pressed %i times for %lli us in 20 pulses\n", presses, pressed_for);
+        return 1;
+    }
+
+    printf("single open gate pressed 5 times in 20 pulses\n");
+    return 0;
+}
+
+// The baseline loop as it ran, for a single open command: it read the tick count, waited up to gate_poll ticks for
+// a command and then worked out the levels from the tick count read before the wait
+static void run_polling(const command_t* command) {
+    uint32_t close_gate_at[MAX_GATES] = { 0 };
+    uint32_t change_level_at = 0;
+    size_t active_output_idx = 0;
+    bool taken = false;
+
+    changes_len = 0;
+    for (int64_t t = 0; t < command->at + TICKS_TO_US(command->delay) + 1000000;) {
+        uint32_t now = t / TICKS_TO_US(1);
+        int64_t timeout_at = TICKS_TO_US(now + BASELINE_POLL);
+        bool received = !taken && command->at <= timeout_at;
+        t = (received ? (command->at > t ? command->at : t) : timeout_at) + task_delay();
+
+        if (received) {
+            taken = true;
+            uint32_t new_close_time = now + command->delay;
+            if ((int32_t)(new_close_time - close_gate_at[command->gate]) > 0) {
+                close_gate_at[command->gate] = new_close_time;
+            }
+        }
+
+        uint32_t outputs = 0;
+        for (size_t i = 0; i < gates_count; i++) {
+            if ((int32_t)(now - close_gate_at[i]) > 0) {
+                close_gate_at[i] = now;
+                continue;
+            }
+            outputs |= 1 << (2 * i + 1);
+        }
+
+        if (outputs == 0) {
+            active_output_idx = 0;
+            change_level_at = now + 1;
+        }
+
+        if ((int32_t)(now - change_level_at) > 0) {
+            change_level_at = now + cfg_get_gate_open_pulse_duration();
+            active_output_idx = (active_output_idx + 1) % (2 * gates_count);
+        }
+
+        uint32_t levels = 0;
+        for (size_t i = 0; i < gates_count; i++) {
+            if (outputs & (1 << active_output_idx) & (1 << (2 * i + 1))) {
+                levels |= 1 << gates[i].pin;
+            }
+        }
+
+        if (changes_len == 0 || changes[changes_len - 1].pins != levels) {
+            changes[changes_len++] = (change_t){ .at = t, .pins = levels };
+        }
+    }
+}
+
+typedef struct {
+    int64_t count;
+    int64_t length_error_sum; // us
+    int64_t length_error_max;
+    int64_t period_error_sum;
+    int64_t period_error_max;
+} jitter_t;
+
+// Adds the presses of the pin to the errors against the pulse duration and the period of a round of the gates. The
+// press cut short by the close is left out
+static void add_jitter(jitter_t* jitter, uint8_t pin, int64_t close_at) {
+    int64_t pulse = TICKS_TO_US(cfg_get_gate_open_pulse_duration());
+    int64_t pressed_at = 0;
+    int64_t previous_pressed_at = 0;
+
+    for (size_t i = 0; i < changes_len; i++) {
+        bool pressed = changes[i].pins & (1 << pin);
+        if (pressed && pressed_at == 0) {
+            previous_pressed_at = pressed_at = changes[i].at;
+            continue;
+        }
+        if (pressed || pressed_at == 0) continue;
+        if (changes[i].at > close_at - pulse / 2) break;
+
+        int64_t length_error = llabs(changes[i].at - pressed_at - pulse);
+        jitter->length_error_sum += length_error;
+        if (length_error > jitter->length_error_max) {
+            jitter->length_error_max = length_error;
+        }
+
+        // The period is taken from one press to the next
+        for (size_t j = i + 1; j < changes_len; j++) {
+            if (!(changes[j].pins & (1 << pin))) continue;
+            int64_t period_error = llabs(changes[j].at - previous_pressed_at - 2 * gates_count * pulse);
+            jitter->period_error_sum += period_error;
+            if (period_error > jitter->period_error_max) {
+                jitter->period_error_max = period_error;
+            }
+            break;
+        }
+
+        jitter->count++;
+        pressed_at = 0;
+    }
+}
+
+static void print_jitter(const char* loop, int64_t delay_max, const jitter_t* jitter) {
+    printf("%-10s %8lli %10lli %10lli %10lli %10lli %8lli\n", loop, delay_max / 1000, jitter->length_error_sum / jitter->count,
+        jitter->length_error_max, jitter->period_error_sum / jitter->count, jitter->period_error_max, jitter->count);
+}
+
+// Opens the second of two gates for a minute at a random time, through the baseline loop and through the gate task,
+// for task delays of none and of a whole tick, the time slice of the Telegram task at the same priority
+static int report_jitter() {
+    const int64_t delays[] = { 0, TICKS_TO_US(1) };
+    unsigned seed = 3;
+
+    setup_gates(2, &seed);
+    gates[0].open_level = 1;
+    gates[1].open_level = 1;
+    config.gate_open_pulse_duration = 50;
+
+    printf("%u ms presses of one gate of two, %i runs, errors in us\n", pdTICKS_TO_MS(cfg_get_gate_open_pulse_duration()), JITTER_RUNS);
+    printf("%-10s %8s %10s %10s %10s %10s %8s\n", "loop", "delay ms", "length avg", "length max", "period avg", "period max", "presses");
+    for (size_t d = 0; d < sizeof(delays) / sizeof(delays[0]); d++) {
+        task_delay_max = delays[d];
+        jitter_t polling = { 0 };
+        jitter_t timer = { 0 };
+
+        for (int run = 0; run < JITTER_RUNS; run++) {
+            memset(commands, 0, sizeof(commands));
+            commands[0] = (command_t){ .at = 1000000 + rand_r(&seed) % 1000000, .gate = 1, .delay = JITTER_OPEN_TICKS };
+            for (size_t i = 1; i < COMMANDS; i++) {
+                commands[i].at = INT64_MAX;
+            }
+            int64_t close_at = commands[0].at + TICKS_TO_US(JITTER_OPEN_TICKS);
+
+            run_polling(&commands[0]);
+            add_jitter(&polling, gates[1].pin, close_at);
+
+            run_task();
+            add_jitter(&timer, gates[1].pin, close_at);
+        }
+
+        print_jitter("polling", delays[d], &polling);
+        print_jitter("esp_timer", delays[d], &timer);
+    }
+
+    task_delay_max = 0;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "jitter") == 0) return report_jitter();
+
+    int failures = 0;
+    uint32_t edges = 0;
+    unsigned seed = 42;
+
+    for (int i = 0; i < SCHEDULES; i++) {
+        setup_gates(1 + i % MAX_GATES, &seed);
+        random_schedule(&seed);
+        wakeups = 0;
+        run_task();
+        edges += changes_len;
+
+        int64_t at = compare();
+        if (at >= 0) {
+            printf("schedule %i with %u gates differs at %lli ms\n", i, gates_count, at / 1000);
+            failures++;
+        }
+    }
+
+    if (failures > 0) {
+        printf("%i of %i schedules differ from the baseline\n", failures, SCHEDULES);
+        return 1;
+    }
+
+    printf("%i schedules, %lu level changes, same levels as the baseline at every ms\n", SCHEDULES, edges);
+    return check_duty_cycle();
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+typedef enum { GPIO_NUM_2 = 2, GPIO_NUM_4 = 4, GPIO_NUM_15 = 15 } gpio_num_t;
+typedef enum { GPIO_MODE_OUTPUT = 2 } gpio_mode_t;
+typedef struct { uint64_t pin_bit_mask; gpio_mode_t mode; bool pull_up_en; bool pull_down_en; int intr_type; } gpio_config_t;
+esp_err_t gpio_config(const gpio_config_t* config);
+#define GPIO_IS_VALID_OUTPUT_GPIO(pin) ((pin) < 34)
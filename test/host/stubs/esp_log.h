@@ -0,0 +1,8 @@
+#pragma once
+#include <stdio.h>
+#include <inttypes.h>
+#define ESP_LOG_QUIET(tag, fmt, ...) do { (void)(tag); if (0) printf(fmt, ##__VA_ARGS__); } while (0)
+#define ESP_LOGI ESP_LOG_QUIET
+#define ESP_LOGW ESP_LOG_QUIET
+#define ESP_LOGE ESP_LOG_QUIET
+#define ESP_LOGD ESP_LOG_QUIET
@@ -0,0 +1,4 @@
+#pragma once
+#include <stdint.h>
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const* buf, uint32_t len);
+uint16_t esp_rom_crc16_le(uint16_t crc, uint8_t const* buf, uint32_t len);
@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+typedef uint32_t TickType_t;
+typedef unsigned int UBaseType_t;
+typedef void* TaskHandle_t;
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+#define portTICK_PERIOD_MS 10 // CONFIG_FREERTOS_HZ=100 of sdkconfig
+#define portMAX_DELAY UINT32_MAX
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms) / portTICK_PERIOD_MS)
+#define pdTICKS_TO_MS(ticks) ((ticks) * portTICK_PERIOD_MS)
@@ -0,0 +1,6 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+uint32_t ulTaskNotifyTake(bool clear_on_exit, TickType_t ticks_to_wait);
+void xTaskNotifyGive(TaskHandle_t task);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
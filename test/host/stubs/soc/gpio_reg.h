@@ -0,0 +1,6 @@
+#pragma once
+#include <stdint.h>
+#define GPIO_OUT_W1TS_REG 0x3ff44008
+#define GPIO_OUT_W1TC_REG 0x3ff4400c
+void reg_write(uint32_t reg, uint32_t value);
+#define REG_WRITE(reg, value) reg_write(reg, value)
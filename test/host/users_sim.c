@@ -0,0 +1,476 @@
+// Host simulation of the user store: runs a sequence of user changes against emulated NVS and log partition,
+// cuts the power at every write boundary and checks that the store loaded after the restart holds either the
+// changes acknowledged before the cut or those of the flush that was cut, and keeps working after that. It then
+// checks that a table that can't be read is neither written over nor loses its log, and that profiles sharing a
+// bucket are kept apart.
+//
+// Every run happens in a child process, so that each one starts from the pristine state of users.c. The emulated
+// flash is shared with the parent and survives the child.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "users.c"
+
+#define LOG_SIZE (3 * 4096) // compacted every few hundred changes
+#define NVS_MAX_ENTRIES 64
+#define NVS_MAX_BLOB 8192
+#define NVS_MAX_HANDLES 8
+#define ID_COUNT 300 // user IDs 1 to ID_COUNT
+#define ADMIN_BASE 1000 // admin IDs after that
+#define ADMIN_COUNT 5
+#define STEPS 1500
+#define EXTRA_ID 100000 // added after the restart
+
+typedef struct {
+    char part[16];
+    char ns[16];
+    char key[16];
+    size_t len;
+    uint8_t data[NVS_MAX_BLOB];
+} nvs_entry_t;
+
+typedef struct {
+    int8_t users[ID_COUNT + 1]; // schedule, -1 if not a user
+    bool admins[ADMIN_COUNT];
+} model_t;
+
+// Shared between the parent and the runs
+typedef struct {
+    uint8_t log[LOG_SIZE];
+    nvs_entry_t nvs[NVS_MAX_ENTRIES];
+    char namespaces[NVS_MAX_ENTRIES][2][16];
+    int ops; // writes and erases so far
+    int cut_at; // write or erase cut by the power loss, 0 for none
+    int acked; // steps acknowledged by a successful flush
+    model_t loaded;
+} sim_t;
+
+typedef struct {
+    char part[16];
+    char ns[16];
+    bool open;
+} handle_t;
+
+static sim_t* sim;
+static handle_t handles[NVS_MAX_HANDLES + 1]; // handle 0 is never given out
+static const esp_partition_t log_part = { .type = ESP_PARTITION_TYPE_DATA, .size = LOG_SIZE, .erase_size = 4096, .label = LOG_PARTITION };
+
+// Counts a write or an erase. Returns true if the power is cut by it, then the caller applies what a cut write
+// would leave and the run ends
+static bool power_cut() {
+    return sim->cut_at != 0 && ++sim->ops == sim->cut_at;
+}
+
+static void power_off() {
+    _exit(0);
+}
+
+int64_t esp_timer_get_time() {
+    return 0;
+}
+
+bool is_guest(int64_t id) {
+    return false;
+}
+
+bool schedule_allows(const week_schedule_t* week, int week_hour) {
+    return true;
+}
+
+int schedule_week_hour() {
+    return 0;
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const* buf, uint32_t len) {
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= buf[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label) {
+    return strcmp(label, LOG_PARTITION) ? NULL : &log_part;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t offset, void* dst, size_t size) {
+    if (offset + size > LOG_SIZE) return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, &sim->log[offset], size);
+    return ESP_OK;
+}
+
+// NOR flash only clears bits. A cut write leaves its first half written
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t offset, const void* src, size_t size) {
+    if (offset + size > LOG_SIZE) return ESP_ERR_INVALID_SIZE;
+
+    bool cut = power_cut();
+    if (cut) size /= 2;
+    for (size_t i = 0; i < size; i++) {
+        sim->log[offset + i] &= ((const uint8_t*)src)[i];
+    }
+    if (cut) power_off();
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size) {
+    if (offset + size > LOG_SIZE || offset % partition->erase_size || size % partition->erase_size) return ESP_ERR_INVALID_ARG;
+
+    bool cut = power_cut();
+    memset(&sim->log[offset], 0xff, cut ? size / 2 : size);
+    if (cut) power_off();
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_init_partition(const char* part) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase_partition(const char* part) {
+    return ESP_OK;
+}
+
+static bool namespace_exists(const char* part, const char* ns, bool create) {
+    for (size_t i = 0; i < NVS_MAX_ENTRIES; i++) {
+        if (!strcmp(sim->namespaces[i][0], part) && !strcmp(sim->namespaces[i][1], ns)) return true;
+        if (sim->namespaces[i][1][0] == '\0') {
+            if (!create) return false;
+            strcpy(sim->namespaces[i][0], part);
+            strcpy(sim->namespaces[i][1], ns);
+            return true;
+        }
+    }
+    return false;
+}
+
+esp_err_t nvs_open_from_partition(const char* part, const char* ns, nvs_open_mode_t mode, nvs_handle_t* handle) {
+    if (!namespace_exists(part, ns, mode == NVS_READWRITE)) return ESP_ERR_NVS_NOT_FOUND;
+
+    for (nvs_handle_t h = 1; h <= NVS_MAX_HANDLES; h++) {
+        if (handles[h].open) continue;
+        strcpy(handles[h].part, part);
+        strcpy(handles[h].ns, ns);
+        handles[h].open = true;
+        *handle = h;
+        return ESP_OK;
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t nvs_open(const char* ns, nvs_open_mode_t mode, nvs_handle_t* handle) {
+    return nvs_open_from_partition("nvs", ns, mode, handle);
+}
+
+void nvs_close(nvs_handle_t handle) {
+    handles[handle].open = false;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    return ESP_OK;
+}
+
+static nvs_entry_t* find_entry(nvs_handle_t handle, const char* key) {
+    for (size_t i = 0; i < NVS_MAX_ENTRIES; i++) {
+        nvs_entry_t* entry = &sim->nvs[i];
+        if (entry->key[0] != '\0' && !strcmp(entry->part, handles[handle].part) && !strcmp(entry->ns, handles[handle].ns)
+            && !strcmp(entry->key, key)) return entry;
+    }
+    return NULL;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* value, size_t* length) {
+    nvs_entry_t* entry = find_entry(handle, key);
+    if (entry == NULL) return ESP_ERR_NVS_NOT_FOUND;
+
+    if (value != NULL) {
+        if (*length < entry->len) return ESP_ERR_NVS_INVALID_LENGTH;
+        memcpy(value, entry->data, entry->len);
+    }
+    *length = entry->len;
+    return ESP_OK;
+}
+
+// NVS writes an entry completely or not at all
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length) {
+    if (length > NVS_MAX_BLOB) return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+
+    nvs_entry_t* entry = find_entry(handle, key);
+    for (size_t i = 0; entry == NULL && i < NVS_MAX_ENTRIES; i++) {
+        if (sim->nvs[i].key[0] == '\0') {
+            entry = &sim->nvs[i];
+        }
+    }
+    if (entry == NULL) return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    if (power_cut()) power_off();
+
+    strcpy(entry->part, handles[handle].part);
+    strcpy(entry->ns, handles[handle].ns);
+    strcpy(entry->key, key);
+    memcpy(entry->data, value, length);
+    entry->len = length;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key) {
+    nvs_entry_t* entry = find_entry(handle, key);
+    if (entry == NULL) return ESP_ERR_NVS_NOT_FOUND;
+    if (power_cut()) power_off();
+
+    entry->key[0] = '\0';
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+    if (power_cut()) power_off();
+
+    for (size_t i = 0; i < NVS_MAX_ENTRIES; i++) {
+        nvs_entry_t* entry = &sim->nvs[i];
+        if (!strcmp(entry->part, handles[handle].part) && !strcmp(entry->ns, handles[handle].ns)) {
+            entry->key[0] = '\0';
+        }
+    }
+    return ESP_OK;
+}
+
+static uint32_t step_hash(uint32_t step) {
+    step = (step ^ 61) ^ (step >> 16);
+    step *= 9;
+    step ^= step >> 4;
+    step *= 0x27d4eb2d;
+    return step ^ (step >> 15);
+}
+
+// Applies a step to the model, and to the store too if asked. Imports every 397th step rewrite the whole table,
+// the other steps are logged
+static void apply_step(model_t* model, uint32_t step, bool store) {
+    uint32_t hash = step_hash(step);
+
+    if (step % 397 == 396) {
+        for (uint32_t i = 0; i < 20; i++) {
+            int64_t id = (hash + i * 7) % ID_COUNT + 1;
+            if (model->users[id] >= 0) continue;
+            model->users[id] = SCHEDULE_ALWAYS;
+            if (store) user_import(id);
+        }
+    } else if (step % 50 == 49) {
+        size_t admin = hash % ADMIN_COUNT;
+        model->admins[admin] = !model->admins[admin];
+        if (store) {
+            model->admins[admin] ? admin_add(ADMIN_BASE + admin) : admin_drop(ADMIN_BASE + admin);
+        }
+    } else if (step % 7 == 6) {
+        int64_t id = hash % ID_COUNT + 1;
+        if (model->users[id] < 0) return;
+        model->users[id] = hash % MAX_SCHEDULES;
+        if (store) user_set_schedule(id, hash % MAX_SCHEDULES);
+    } else {
+        int64_t id = hash % ID_COUNT + 1;
+        if (model->users[id] < 0) {
+            model->users[id] = SCHEDULE_ALWAYS;
+            if (store) user_add(id);
+        } else {
+            model->users[id] = -1;
+            if (store) user_drop(id);
+        }
+    }
+}
+
+static void model_init(model_t* model) {
+    memset(model->users, -1, sizeof(model->users));
+    memset(model->admins, 0, sizeof(model->admins));
+}
+
+static void model_at(model_t* model, int steps) {
+    model_init(model);
+    for (int step = 0; step < steps; step++) {
+        apply_step(model, step, false);
+    }
+}
+
+static void load_into(model_t* model) {
+    model_init(model);
+    for (int64_t id = 1; id <= ID_COUNT; id++) {
+        model->users[id] = user_get_schedule(id);
+    }
+    for (size_t admin = 0; admin < ADMIN_COUNT; admin++) {
+        model->admins[admin] = is_admin(ADMIN_BASE + admin);
+    }
+}
+
+static void run(void (*body)()) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        body();
+        _exit(0);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "run crashed, cut at %i\n", sim->cut_at);
+        exit(1);
+    }
+}
+
+// Runs the steps from a fresh store, acknowledging each of them with a flush, until the power is cut
+static void run_steps() {
+    model_t model;
+    model_init(&model);
+    if (load_users() != ESP_OK) _exit(2);
+
+    for (int step = 0; step < STEPS; step++) {
+        apply_step(&model, step, true);
+        if (users_flush() != ESP_OK) _exit(3);
+        sim->acked = step + 1;
+    }
+}
+
+static void restart() {
+    if (load_users() != ESP_OK) _exit(2);
+    load_into(&sim->loaded);
+
+    if (user_add(EXTRA_ID) != ESP_OK || users_flush() != ESP_OK) _exit(3);
+}
+
+static void restart_again() {
+    if (load_users() != ESP_OK) _exit(2);
+
+    model_t loaded;
+    load_into(&loaded);
+    if (memcmp(&loaded, &sim->loaded, sizeof(loaded)) || !is_user(EXTRA_ID)) _exit(4);
+}
+
+// Loads a store whose table can't be read: changes must fail to flush without writing anything
+static void restart_unreadable() {
+    if (load_users() != ESP_OK) _exit(2);
+
+    int ops = sim->ops;
+    if (user_add(EXTRA_ID) != ESP_OK || users_flush() == ESP_OK || sim->ops != ops) _exit(5);
+}
+
+static nvs_entry_t* find_table() {
+    for (size_t i = 0; i < NVS_MAX_ENTRIES; i++) {
+        if (!strcmp(sim->nvs[i].ns, STORAGE_NAMESPACE) && !strcmp(sim->nvs[i].key, TABLE_KEY)) return &sim->nvs[i];
+    }
+    return NULL;
+}
+
+// Corrupts the table after the steps, restarts twice with it and then once it reads again
+static int check_unreadable_table() {
+    memset(sim, 0, sizeof(*sim));
+    memset(sim->log, 0xff, sizeof(sim->log));
+    sim->cut_at = INT32_MAX;
+    run(run_steps);
+
+    nvs_entry_t* table = find_table();
+    if (table == NULL) return 1;
+    table->data[table->len - 1] ^= 0xff;
+
+    sim->cut_at = INT32_MAX;
+    sim->ops = 0;
+    run(restart_unreadable);
+    run(restart_unreadable);
+
+    table->data[table->len - 1] ^= 0xff;
+    sim->cut_at = 0;
+    run(restart);
+
+    model_t expected;
+    model_at(&expected, STEPS);
+    if (memcmp(&sim->loaded, &expected, sizeof(expected))) {
+        printf("the store lost users while its table was unreadable\n");
+        return 1;
+    }
+
+    printf("unreadable table kept\n");
+    return 0;
+}
+
+// Stores, rewrites and erases profiles that share a bucket, and reads each back
+static void run_profiles() {
+    if (load_users() != ESP_OK) _exit(2);
+
+    nvs_handle_t nvs_handle;
+    if (nvs_open_from_partition(PROFILE_PARTITION, PROFILE_NAMESPACE, NVS_READWRITE, &nvs_handle) != ESP_OK) _exit(3);
+
+    user_t profiles[] = {
+        { .id = 1, .username = "first", .first_name = "A" },
+        { .id = 1 + PROFILE_BUCKET_COUNT, .first_name = "B", .last_name = "Second" },
+        { .id = 1 + 2 * PROFILE_BUCKET_COUNT, .username = "third" },
+    };
+    size_t count = sizeof(profiles) / sizeof(profiles[0]);
+    for (size_t i = 0; i < count; i++) {
+        if (store_profile(nvs_handle, &profiles[i]) != ESP_OK) _exit(4);
+    }
+
+    strcpy(profiles[0].last_name, "a much longer last name of 31 c");
+    if (store_profile(nvs_handle, &profiles[0]) != ESP_OK) _exit(4);
+    nvs_close(nvs_handle);
+
+    erase_profile(profiles[1].id);
+
+    nvs_open_from_partition(PROFILE_PARTITION, PROFILE_NAMESPACE, NVS_READONLY, &nvs_handle);
+    for (size_t i = 0; i < count; i++) {
+        user_t loaded = { .id = profiles[i].id };
+        esp_err_t err = load_profile(nvs_handle, profiles[i].id, &loaded);
+        if (i == 1 ? err != ESP_ERR_NVS_NOT_FOUND : err != ESP_OK || memcmp(&loaded, &profiles[i], sizeof(loaded))) _exit(5);
+    }
+    nvs_close(nvs_handle);
+}
+
+static int check_profiles() {
+    memset(sim, 0, sizeof(*sim));
+    memset(sim->log, 0xff, sizeof(sim->log));
+    run(run_profiles);
+
+    printf("profile buckets kept\n");
+    return 0;
+}
+
+int main() {
+    sim = mmap(NULL, sizeof(sim_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sim == MAP_FAILED) return 1;
+
+    // A run without a cut counts the writes
+    memset(sim, 0, sizeof(*sim));
+    memset(sim->log, 0xff, sizeof(sim->log));
+    sim->cut_at = INT32_MAX;
+    run(run_steps);
+    int total = sim->ops;
+    printf("%i steps, %i writes\n", STEPS, total);
+
+    int failures = 0;
+    for (int cut_at = 1; cut_at <= total; cut_at++) {
+        memset(sim, 0, sizeof(*sim));
+        memset(sim->log, 0xff, sizeof(sim->log));
+        sim->cut_at = cut_at;
+        run(run_steps);
+
+        sim->cut_at = 0;
+        run(restart);
+
+        model_t before, after;
+        model_at(&before, sim->acked);
+        model_at(&after, sim->acked + 1);
+        if (memcmp(&sim->loaded, &before, sizeof(before)) && memcmp(&sim->loaded, &after, sizeof(after))) {
+            printf("cut at write %i after %i steps: the store doesn't match them\n", cut_at, sim->acked);
+            failures++;
+            continue;
+        }
+
+        run(restart_again);
+    }
+
+    if (failures > 0) {
+        printf("%i of %i cuts failed\n", failures, total);
+        return 1;
+    }
+
+    printf("all %i cuts recovered\n", total);
+    return check_unreadable_table() || check_profiles();
+}